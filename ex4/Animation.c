@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Animation.h"
+
+
+#define MAX_LINE_LENGTH 1024
+#define MAX_NAME_LENGTH 64
+
+
+// Animated parameters as named in animation files
+struct _TrackName {
+    const char* _object;
+    const char* _parameter;
+    int _target;
+    int _components;
+};
+
+typedef struct _TrackName TrackName;
+
+static const TrackName g_track_names[] = {
+    {"camera", "position", TRACK_CAMERA_POSITION, 3},
+    {"camera", "lookat", TRACK_CAMERA_LOOK_AT, 3},
+    {"camera", "fov", TRACK_CAMERA_FOV, 1},
+    {"light", "position", TRACK_LIGHT_POSITION, 3},
+    {"light", "color", TRACK_LIGHT_COLOR, 3},
+    {"sphere", "center", TRACK_SPHERE_CENTER, 3},
+    {"sphere", "radius", TRACK_SPHERE_RADIUS, 1}
+};
+
+#define NUMBER_TRACK_NAMES ((int) (sizeof(g_track_names) / sizeof(g_track_names[0])))
+
+
+void initAnimation(Animation* animation) {
+    animation->_number_frames = 1;
+    animation->_number_tracks = 0;
+    animation->_capacity_tracks = 0;
+    animation->_tracks = NULL;
+}
+
+
+// Return the track of target and index, adding it if needed
+static Track* findTrack(Animation* animation, int target, int index) {
+    Track* track;
+    int k;
+
+    for (k = 0; k < animation->_number_tracks; k++) {
+        track = &animation->_tracks[k];
+        if (track->_target == target && track->_index == index) return track;
+    }
+
+    if (animation->_number_tracks == animation->_capacity_tracks) {
+        int capacity = animation->_capacity_tracks > 0 ? 2 * animation->_capacity_tracks : 8;
+        Track* tracks = (Track*) realloc(animation->_tracks, capacity * sizeof(Track));
+        if (!tracks) {
+            printf("Error: Couldn't allocate memory for %d animation tracks\n", capacity);
+            exit(1);
+        }
+        animation->_tracks = tracks;
+        animation->_capacity_tracks = capacity;
+    }
+
+    track = &animation->_tracks[animation->_number_tracks++];
+    track->_target = target;
+    track->_index = index;
+    track->_number_keys = 0;
+    track->_capacity_keys = 0;
+    track->_keys = NULL;
+
+    return track;
+}
+
+
+void addKeyframe(Animation* animation, int target, int index, const Keyframe* key) {
+    Track* track = findTrack(animation, target, index);
+    int k = track->_number_keys;
+
+    while (k > 0 && track->_keys[k - 1]._frame > key->_frame) k--;
+    if (k > 0 && track->_keys[k - 1]._frame == key->_frame) {
+        track->_keys[k - 1] = *key;
+        return;
+    }
+
+    if (track->_number_keys == track->_capacity_keys) {
+        int capacity = track->_capacity_keys > 0 ? 2 * track->_capacity_keys : 8;
+        Keyframe* keys = (Keyframe*) realloc(track->_keys, capacity * sizeof(Keyframe));
+        if (!keys) {
+            printf("Error: Couldn't allocate memory for %d keyframes\n", capacity);
+            exit(1);
+        }
+        track->_keys = keys;
+        track->_capacity_keys = capacity;
+    }
+
+    memmove(&track->_keys[k + 1], &track->_keys[k],
+            (track->_number_keys - k) * sizeof(Keyframe));
+    track->_keys[k] = *key;
+    track->_number_keys++;
+}
+
+
+static void parseError(const char* filename, int line, const char* message) {
+    printf("Error: %s:%d: %s\n", filename, line, message);
+    exit(1);
+}
+
+
+// Parse "frame object [index] parameter values [smooth]"
+static void parseKeyframe(const char* filename, int line_number, const char* args,
+                          Animation* animation) {
+    const char* expected = "expected: key frame object [index] parameter values [smooth]";
+    char object[MAX_NAME_LENGTH];
+    char parameter[MAX_NAME_LENGTH];
+    char smooth[MAX_NAME_LENGTH];
+    const TrackName* name = NULL;
+    Keyframe key;
+    int index = 0;
+    int number_args;
+    int n;
+    int k;
+
+    if (sscanf(args, "%f %63s%n", &key._frame, object, &n) != 2) {
+        parseError(filename, line_number, expected);
+    }
+    args += n;
+
+    if (strcmp(object, "camera") != 0) {
+        if (sscanf(args, "%d%n", &index, &n) != 1 || index < 0) {
+            parseError(filename, line_number, expected);
+        }
+        args += n;
+    }
+
+    if (sscanf(args, "%63s%n", parameter, &n) != 1) {
+        parseError(filename, line_number, expected);
+    }
+    args += n;
+
+    for (k = 0; k < NUMBER_TRACK_NAMES; k++) {
+        if (!strcmp(g_track_names[k]._object, object) &&
+            !strcmp(g_track_names[k]._parameter, parameter)) {
+            name = &g_track_names[k];
+        }
+    }
+    if (!name) parseError(filename, line_number, "unknown animated parameter");
+
+    key._value[1] = 0.0f;
+    key._value[2] = 0.0f;
+    if (name->_components == 3) {
+        number_args = sscanf(args, "%f %f %f %63s", &key._value[0], &key._value[1],
+                             &key._value[2], smooth);
+    } else {
+        number_args = sscanf(args, "%f %63s", &key._value[0], smooth) + 2;
+    }
+    if (number_args < 3 || (number_args == 4 && strcmp(smooth, "smooth") != 0)) {
+        parseError(filename, line_number, expected);
+    }
+    key._smooth = number_args == 4;
+
+    addKeyframe(animation, name->_target, index, &key);
+}
+
+
+void loadAnimation(const char* filename, Animation* animation) {
+    char line[MAX_LINE_LENGTH];
+    char keyword[MAX_NAME_LENGTH];
+    int line_number = 0;
+    FILE* f = fopen(filename, "r");
+
+    if (!f) {
+        printf("Error: Couldn't open animation file %s\n", filename);
+        exit(1);
+    }
+
+    initAnimation(animation);
+
+    while (fgets(line, MAX_LINE_LENGTH, f)) {
+        char* comment = strchr(line, '#');
+        char* args;
+        int n;
+
+        line_number++;
+        if (comment) *comment = '\0';
+        if (sscanf(line, "%63s%n", keyword, &n) != 1) continue;
+        args = line + n;
+
+        if (!strcmp(keyword, "frames")) {
+            if (sscanf(args, "%d", &animation->_number_frames) != 1 ||
+                animation->_number_frames <= 0) {
+                parseError(filename, line_number, "expected: frames n");
+            }
+        } else if (!strcmp(keyword, "key")) {
+            parseKeyframe(filename, line_number, args, animation);
+        } else {
+            parseError(filename, line_number, "unknown statement");
+        }
+    }
+
+    fclose(f);
+}
+
+
+// Slope of the track at keyframe k, per frame, for the spline: that of
+// the line through its neighbours
+static void computeSlope(const Track* track, int k, float* slope) {
+    const Keyframe* before = &track->_keys[k > 0 ? k - 1 : k];
+    const Keyframe* after = &track->_keys[k + 1 < track->_number_keys ? k + 1 : k];
+    float span = after->_frame - before->_frame;
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        slope[c] = span > 0.0f ? (after->_value[c] - before->_value[c]) / span : 0.0f;
+    }
+}
+
+
+// Value of the track at frame
+static void evaluateTrack(const Track* track, float frame, float* value) {
+    const Keyframe* keys = track->_keys;
+    const Keyframe* a;
+    const Keyframe* b;
+    float span;
+    float t;
+    int k = 0;
+    int c;
+
+    if (frame <= keys[0]._frame) {
+        memcpy(value, keys[0]._value, sizeof(keys[0]._value));
+        return;
+    }
+    if (frame >= keys[track->_number_keys - 1]._frame) {
+        memcpy(value, keys[track->_number_keys - 1]._value, sizeof(keys[0]._value));
+        return;
+    }
+
+    while (keys[k + 1]._frame <= frame) k++;
+    a = &keys[k];
+    b = &keys[k + 1];
+    span = b->_frame - a->_frame;
+    t = (frame - a->_frame) / span;
+
+    if (!a->_smooth) {
+        for (c = 0; c < 3; c++) value[c] = a->_value[c] + t * (b->_value[c] - a->_value[c]);
+    } else {
+        // cubic Hermite curve through a and b with the slopes there
+        float slope_a[3];
+        float slope_b[3];
+        float t2 = t * t;
+        float t3 = t2 * t;
+        float h00 = 2.0f * t3 - 3.0f * t2 + 1.0f;
+        float h10 = t3 - 2.0f * t2 + t;
+        float h01 = -2.0f * t3 + 3.0f * t2;
+        float h11 = t3 - t2;
+
+        computeSlope(track, k, slope_a);
+        computeSlope(track, k + 1, slope_b);
+        for (c = 0; c < 3; c++) {
+            value[c] = h00 * a->_value[c] + h10 * span * slope_a[c] +
+                       h01 * b->_value[c] + h11 * span * slope_b[c];
+        }
+    }
+}
+
+
+static void setVector(Vector3* v, const float* value) {
+    v->_x = value[0];
+    v->_y = value[1];
+    v->_z = value[2];
+}
+
+
+void applyAnimation(const Animation* animation, float frame, Scene* scene) {
+    int spheres_changed = 0;
+    int lights_changed = 0;
+    int k;
+
+    for (k = 0; k < animation->_number_tracks; k++) {
+        const Track* track = &animation->_tracks[k];
+        int i = track->_index;
+        float value[3];
+
+        if (track->_number_keys == 0) continue;
+        evaluateTrack(track, frame, value);
+
+        switch (track->_target) {
+            case TRACK_CAMERA_POSITION:
+                setVector(&scene->_camera._position, value);
+                break;
+            case TRACK_CAMERA_LOOK_AT:
+                setVector(&scene->_camera._look_at, value);
+                break;
+            case TRACK_CAMERA_FOV:
+                scene->_camera._fov = value[0];
+                break;
+            case TRACK_LIGHT_POSITION:
+            case TRACK_LIGHT_COLOR:
+                if (i >= scene->_number_lights) {
+                    printf("Error: The animation moves light %d of a scene with %d lights\n",
+                           i, scene->_number_lights);
+                    exit(1);
+                }
+                if (track->_target == TRACK_LIGHT_POSITION) {
+                    setVector(&scene->_lights[i]._light_pos, value);
+                } else {
+                    scene->_lights[i]._light_color._red = value[0];
+                    scene->_lights[i]._light_color._green = value[1];
+                    scene->_lights[i]._light_color._blue = value[2];
+                }
+                lights_changed = 1;
+                break;
+            case TRACK_SPHERE_CENTER:
+            case TRACK_SPHERE_RADIUS:
+                if (i >= scene->_number_spheres) {
+                    printf("Error: The animation moves sphere %d of a scene with %d spheres\n",
+                           i, scene->_number_spheres);
+                    exit(1);
+                }
+                if (track->_target == TRACK_SPHERE_CENTER) {
+                    setVector(&scene->_spheres[i]._center, value);
+                } else {
+                    scene->_spheres[i]._radius = value[0] > 0.0f ? value[0] : 0.0f;
+                }
+                spheres_changed = 1;
+                break;
+        }
+    }
+
+    if (spheres_changed) refitScene(scene);
+    if (lights_changed) updateSceneLights(scene);
+}
+
+
+void freeAnimation(Animation* animation) {
+    int k;
+
+    for (k = 0; k < animation->_number_tracks; k++) free(animation->_tracks[k]._keys);
+    free(animation->_tracks);
+
+    initAnimation(animation);
+}
@@ -0,0 +1,97 @@
+#include "Scene.h"
+
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+
+// Animation of a scene: parameters of the camera, the lights and the
+// spheres given at keyframes and interpolated in between, for
+// rendering sequences of frames (see rtbatch -A).
+//
+// Animation files are text, one statement per line, '#' starts a
+// comment:
+//   frames n
+//   key frame camera position x y z [smooth]
+//   key frame camera lookat x y z [smooth]
+//   key frame camera fov degrees [smooth]
+//   key frame light i position x y z [smooth]
+//   key frame light i color r g b [smooth]
+//   key frame sphere i center x y z [smooth]
+//   key frame sphere i radius r [smooth]
+// Frames are numbered from 0 to n - 1 (keyframes may fall between
+// them). Lights and spheres are numbered in the order of the scene
+// file. A parameter moves in a straight line from a keyframe to the
+// next one, or along a Catmull-Rom spline if the first one is smooth,
+// and keeps the value of the first (last) keyframe before (after)
+// them. Parameters without keyframes keep the value of the scene.
+
+
+// Animated parameters
+#define TRACK_CAMERA_POSITION 0
+#define TRACK_CAMERA_LOOK_AT 1
+#define TRACK_CAMERA_FOV 2
+#define TRACK_LIGHT_POSITION 3
+#define TRACK_LIGHT_COLOR 4
+#define TRACK_SPHERE_CENTER 5
+#define TRACK_SPHERE_RADIUS 6
+
+
+// Value of a parameter at a frame (1 or 3 components)
+struct _Keyframe {
+    float _frame;
+    float _value[3];
+
+    // 1 for a spline up to the next keyframe, 0 for a straight line
+    int _smooth;
+};
+
+typedef struct _Keyframe Keyframe;
+
+
+// Keyframes of one parameter (of light or sphere _index), sorted by
+// frame
+struct _Track {
+    int _target;
+    int _index;
+
+    int _number_keys;
+    int _capacity_keys;
+    Keyframe* _keys;
+};
+
+typedef struct _Track Track;
+
+
+struct _Animation {
+    int _number_frames;
+
+    int _number_tracks;
+    int _capacity_tracks;
+    Track* _tracks;
+};
+
+typedef struct _Animation Animation;
+
+
+// Empty animation of one frame
+void initAnimation(Animation* animation);
+
+// Add a keyframe to the parameter target (TRACK_) of light or sphere
+// index (0 for the camera). A keyframe at the same frame is replaced.
+void addKeyframe(Animation* animation, int target, int index, const Keyframe* key);
+
+// Load an animation from a text file
+void loadAnimation(const char* filename, Animation* animation);
+
+// Set the animated parameters of the finalized scene to their values
+// at frame, and update what depends on them: the sphere hierarchy is
+// refit (see refitScene), not rebuilt, and the light structures are
+// rebuilt only if lights are animated. Exits with an error if a track
+// names a light or sphere the scene does not have.
+void applyAnimation(const Animation* animation, float frame, Scene* scene);
+
+// Free memory used by the animation
+void freeAnimation(Animation* animation);
+
+#endif
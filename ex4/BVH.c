@@ -0,0 +1,314 @@
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "BVH.h"
+
+
+// Number of bins used to evaluate the split candidates along an axis
+#define NUMBER_BINS 16
+
+// A node with at most this many primitives may become a leaf
+#define MAX_LEAF_SIZE 8
+
+// Past this depth, ranges are split in halves to bound the depth
+#define MAX_SAH_DEPTH 96
+
+// Cost of traversing an inner node relative to one primitive test
+#define TRAVERSAL_COST 1.0f
+
+
+struct _Bin {
+    AABB _bounds;
+    int _count;
+};
+
+typedef struct _Bin Bin;
+
+
+struct _BuildState {
+    const AABB* _boxes;
+    Vector3* _centroids;
+    BVH* _bvh;
+};
+
+typedef struct _BuildState BuildState;
+
+
+static void emptyAABB(AABB* box) {
+    box->_lower_bound._x = FLT_MAX;
+    box->_lower_bound._y = FLT_MAX;
+    box->_lower_bound._z = FLT_MAX;
+
+    box->_upper_bound._x = -FLT_MAX;
+    box->_upper_bound._y = -FLT_MAX;
+    box->_upper_bound._z = -FLT_MAX;
+}
+
+
+static void expandPoint(AABB* box, Vector3 p) {
+    if (p._x < box->_lower_bound._x) box->_lower_bound._x = p._x;
+    if (p._y < box->_lower_bound._y) box->_lower_bound._y = p._y;
+    if (p._z < box->_lower_bound._z) box->_lower_bound._z = p._z;
+
+    if (p._x > box->_upper_bound._x) box->_upper_bound._x = p._x;
+    if (p._y > box->_upper_bound._y) box->_upper_bound._y = p._y;
+    if (p._z > box->_upper_bound._z) box->_upper_bound._z = p._z;
+}
+
+
+void expandAABB(AABB* box, const AABB* other) {
+    expandPoint(box, other->_lower_bound);
+    expandPoint(box, other->_upper_bound);
+}
+
+
+float computeSurfaceArea(const AABB* box) {
+    float dx = box->_upper_bound._x - box->_lower_bound._x;
+    float dy = box->_upper_bound._y - box->_lower_bound._y;
+    float dz = box->_upper_bound._z - box->_lower_bound._z;
+
+    if (dx < 0.0f || dy < 0.0f || dz < 0.0f) return 0.0f;
+
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+
+static float getAxis(Vector3 v, int axis) {
+    if (axis == 0) return v._x;
+    if (axis == 1) return v._y;
+    return v._z;
+}
+
+
+static int allocateNode(BVH* bvh) {
+    int idx = bvh->_number_nodes;
+    bvh->_number_nodes++;
+    return idx;
+}
+
+
+static void makeLeaf(BVHNode* node, int first, int count) {
+    node->_offset = first;
+    node->_count = (unsigned short) count;
+    node->_axis = 0;
+}
+
+
+// Build the subtree rooted at node_idx over _indices[first, first + count)
+static void buildNode(BuildState* state, int node_idx, int first, int count, int depth) {
+    BVH* bvh = state->_bvh;
+    int* indices = bvh->_indices;
+    AABB bounds;
+    AABB centroid_bounds;
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = FLT_MAX;
+    float leaf_cost;
+    int mid;
+    int axis;
+    int i;
+
+    emptyAABB(&bounds);
+    emptyAABB(&centroid_bounds);
+    for (i = first; i < first + count; i++) {
+        expandAABB(&bounds, &state->_boxes[indices[i]]);
+        expandPoint(&centroid_bounds, state->_centroids[indices[i]]);
+    }
+
+    bvh->_nodes[node_idx]._lower_bound = bounds._lower_bound;
+    bvh->_nodes[node_idx]._upper_bound = bounds._upper_bound;
+
+    if (count <= 2) {
+        makeLeaf(&bvh->_nodes[node_idx], first, count);
+        return;
+    }
+
+    // Evaluate the SAH cost of NUMBER_BINS - 1 split planes per axis
+    if (depth < MAX_SAH_DEPTH) {
+        for (axis = 0; axis < 3; axis++) {
+            Bin bins[NUMBER_BINS];
+            float right_area[NUMBER_BINS];
+            int right_count[NUMBER_BINS];
+            AABB acc;
+            int acc_count;
+            float lo = getAxis(centroid_bounds._lower_bound, axis);
+            float hi = getAxis(centroid_bounds._upper_bound, axis);
+            float scale;
+
+            if (hi <= lo) continue;
+            scale = NUMBER_BINS / (hi - lo);
+
+            for (i = 0; i < NUMBER_BINS; i++) {
+                emptyAABB(&bins[i]._bounds);
+                bins[i]._count = 0;
+            }
+
+            for (i = first; i < first + count; i++) {
+                int b = (int) ((getAxis(state->_centroids[indices[i]], axis) - lo) * scale);
+                if (b >= NUMBER_BINS) b = NUMBER_BINS - 1;
+                bins[b]._count++;
+                expandAABB(&bins[b]._bounds, &state->_boxes[indices[i]]);
+            }
+
+            // sweep from the right, then from the left
+            emptyAABB(&acc);
+            acc_count = 0;
+            for (i = NUMBER_BINS - 1; i > 0; i--) {
+                expandAABB(&acc, &bins[i]._bounds);
+                acc_count += bins[i]._count;
+                right_area[i] = computeSurfaceArea(&acc);
+                right_count[i] = acc_count;
+            }
+
+            emptyAABB(&acc);
+            acc_count = 0;
+            for (i = 0; i < NUMBER_BINS - 1; i++) {
+                float cost;
+                expandAABB(&acc, &bins[i]._bounds);
+                acc_count += bins[i]._count;
+                if (acc_count == 0 || right_count[i + 1] == 0) continue;
+
+                cost = computeSurfaceArea(&acc) * acc_count
+                       + right_area[i + 1] * right_count[i + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = i + 1;
+                }
+            }
+        }
+    }
+
+    leaf_cost = (float) count;
+    if (best_axis >= 0) {
+        float area = computeSurfaceArea(&bounds);
+        best_cost = area > 0.0f ? TRAVERSAL_COST + best_cost / area : FLT_MAX;
+    }
+
+    if (best_axis >= 0 && (best_cost < leaf_cost || count > MAX_LEAF_SIZE)) {
+        // partition the range around the chosen bin boundary
+        float lo = getAxis(centroid_bounds._lower_bound, best_axis);
+        float hi = getAxis(centroid_bounds._upper_bound, best_axis);
+        float scale = NUMBER_BINS / (hi - lo);
+        int left = first;
+        int right = first + count - 1;
+
+        while (left <= right) {
+            int b = (int) ((getAxis(state->_centroids[indices[left]], best_axis) - lo) * scale);
+            if (b >= NUMBER_BINS) b = NUMBER_BINS - 1;
+            if (b < best_split) {
+                left++;
+            } else {
+                int tmp = indices[left];
+                indices[left] = indices[right];
+                indices[right] = tmp;
+                right--;
+            }
+        }
+
+        mid = left;
+        axis = best_axis;
+    } else if (count <= MAX_LEAF_SIZE) {
+        makeLeaf(&bvh->_nodes[node_idx], first, count);
+        return;
+    } else {
+        // identical centroids or too deep: split the range in halves
+        mid = first + count / 2;
+        axis = 0;
+    }
+
+    {
+        int left_idx = allocateNode(bvh);
+        int right_idx;
+
+        buildNode(state, left_idx, first, mid - first, depth + 1);
+        right_idx = allocateNode(bvh);
+        buildNode(state, right_idx, mid, first + count - mid, depth + 1);
+
+        bvh->_nodes[node_idx]._offset = right_idx;
+        bvh->_nodes[node_idx]._count = 0;
+        bvh->_nodes[node_idx]._axis = (unsigned short) axis;
+    }
+}
+
+
+void buildBVH(BVH* bvh, const AABB* boxes, int count) {
+    BuildState state;
+    int i;
+
+    bvh->_nodes = NULL;
+    bvh->_number_nodes = 0;
+    bvh->_indices = NULL;
+    bvh->_number_indices = count;
+
+    if (count <= 0) return;
+
+    // a binary tree with count leaves has at most 2 * count - 1 nodes
+    bvh->_nodes = (BVHNode*) malloc((2 * count - 1) * sizeof(BVHNode));
+    bvh->_indices = (int*) malloc(count * sizeof(int));
+    state._centroids = (Vector3*) malloc(count * sizeof(Vector3));
+    if (!bvh->_nodes || !bvh->_indices || !state._centroids) {
+        printf("Error: Couldn't allocate memory for the BVH (%d primitives)\n", count);
+        exit(1);
+    }
+
+    for (i = 0; i < count; i++) {
+        bvh->_indices[i] = i;
+        state._centroids[i]._x = 0.5f * (boxes[i]._lower_bound._x + boxes[i]._upper_bound._x);
+        state._centroids[i]._y = 0.5f * (boxes[i]._lower_bound._y + boxes[i]._upper_bound._y);
+        state._centroids[i]._z = 0.5f * (boxes[i]._lower_bound._z + boxes[i]._upper_bound._z);
+    }
+
+    state._boxes = boxes;
+    state._bvh = bvh;
+
+    buildNode(&state, allocateNode(bvh), 0, count, 0);
+
+    free(state._centroids);
+}
+
+
+void refitBVH(BVH* bvh, const AABB* boxes) {
+    int n;
+    int k;
+
+    // children are stored after their parent
+    for (n = bvh->_number_nodes - 1; n >= 0; n--) {
+        BVHNode* node = &bvh->_nodes[n];
+        AABB box;
+
+        if (node->_count > 0) {
+            box = boxes[bvh->_indices[node->_offset]];
+            for (k = 1; k < node->_count; k++) {
+                expandAABB(&box, &boxes[bvh->_indices[node->_offset + k]]);
+            }
+        } else {
+            const BVHNode* right = &bvh->_nodes[node->_offset];
+
+            box._lower_bound = bvh->_nodes[n + 1]._lower_bound;
+            box._upper_bound = bvh->_nodes[n + 1]._upper_bound;
+            expandPoint(&box, right->_lower_bound);
+            expandPoint(&box, right->_upper_bound);
+        }
+
+        node->_lower_bound = box._lower_bound;
+        node->_upper_bound = box._upper_bound;
+    }
+}
+
+
+void initBVH(BVH* bvh) {
+    bvh->_nodes = NULL;
+    bvh->_number_nodes = 0;
+    bvh->_indices = NULL;
+    bvh->_number_indices = 0;
+}
+
+
+void freeBVH(BVH* bvh) {
+    free(bvh->_nodes);
+    free(bvh->_indices);
+
+    initBVH(bvh);
+}
@@ -0,0 +1,75 @@
+#include "Geometry.h"
+
+
+#ifndef BVH_H
+#define BVH_H
+
+
+// Axis-aligned bounding box
+struct _AABB {
+    Vector3 _lower_bound;
+    Vector3 _upper_bound;
+};
+
+typedef struct _AABB AABB;
+
+
+// Node of a flattened bounding volume hierarchy (32 bytes).
+// Nodes are stored in depth-first order: the left child of an inner
+// node is the next node in the array, _offset is the index of the
+// right child. For a leaf, _offset is the first entry of the leaf in
+// _indices and _count is the number of primitives (_count > 0).
+struct _BVHNode {
+    Vector3 _lower_bound;
+    int _offset;
+    Vector3 _upper_bound;
+    unsigned short _count;
+    unsigned short _axis;
+};
+
+typedef struct _BVHNode BVHNode;
+
+
+// Bounding volume hierarchy over an array of primitives.
+// The primitives themselves are not stored: _indices holds, leaf after
+// leaf, the indices of the primitives in the caller's array.
+struct _BVH {
+    BVHNode* _nodes;
+    int _number_nodes;
+
+    int* _indices;
+    int _number_indices;
+};
+
+typedef struct _BVH BVH;
+
+
+// Maximal depth of a hierarchy built by buildBVH.
+// Traversal code can use a stack of this size.
+#define BVH_STACK_SIZE 128
+
+
+// Empty hierarchy
+void initBVH(BVH* bvh);
+
+// Build a hierarchy over count primitives whose bounds are in boxes,
+// using binned surface area heuristic splits.
+void buildBVH(BVH* bvh, const AABB* boxes, int count);
+
+// Recompute the bounds of every node from the new bounds of the
+// primitives (boxes, indexed like those given to buildBVH), keeping
+// the tree as it is. Much faster than building it again, but the
+// tree gets looser as the primitives move away from where it was
+// built.
+void refitBVH(BVH* bvh, const AABB* boxes);
+
+// Free memory used by the hierarchy
+void freeBVH(BVH* bvh);
+
+// Grow box so that it contains other
+void expandAABB(AABB* box, const AABB* other);
+
+// Surface area of a box (0 for an empty box)
+float computeSurfaceArea(const AABB* box);
+
+#endif
@@ -0,0 +1,303 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Camera.h"
+#include "Sampler.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+// The SIMD kernel must round exactly like generateRay
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+void initCamera(Camera* camera) {
+    camera->_position._x = 0.0f;
+    camera->_position._y = 0.0f;
+    camera->_position._z = 10.0f;
+
+    camera->_look_at._x = 0.0f;
+    camera->_look_at._y = 0.0f;
+    camera->_look_at._z = 0.0f;
+
+    camera->_up._x = 0.0f;
+    camera->_up._y = 1.0f;
+    camera->_up._z = 0.0f;
+
+    camera->_fov = 0.0f;
+    camera->_aspect = 0.0f;
+    camera->_scale = 0.03f;
+    camera->_aperture = 0.0f;
+    camera->_focus_distance = 0.0f;
+}
+
+
+void useLookAtCamera(Camera* camera, int height) {
+    float distance;
+
+    if (camera->_fov > 0.0f) return;
+
+    distance = sqrtf(camera->_position._x * camera->_position._x +
+                     camera->_position._y * camera->_position._y +
+                     camera->_position._z * camera->_position._z);
+
+    camera->_look_at._x = 0.0f;
+    camera->_look_at._y = 0.0f;
+    camera->_look_at._z = 0.0f;
+    camera->_up._x = 0.0f;
+    camera->_up._y = 1.0f;
+    camera->_up._z = 0.0f;
+    camera->_aspect = 0.0f;
+    camera->_fov = 360.0f / (float) M_PI * atanf(0.5f * camera->_scale * height / distance);
+}
+
+
+void setupCameraRays(CameraRays* rays, const Camera* camera, int width, int height) {
+    Vector3 forward;
+    Vector3 right;
+    Vector3 up;
+    Vector3 v;
+    float plane_distance;
+
+    rays->_origin = camera->_position;
+
+    if (camera->_fov <= 0.0f) {
+        // the image plane is z = 0, centered on the origin
+        float s = camera->_scale;
+
+        rays->_corner._x = -0.5f * s * width - camera->_position._x;
+        rays->_corner._y = -0.5f * s * height - camera->_position._y;
+        rays->_corner._z = -camera->_position._z;
+        rays->_dx._x = s;
+        rays->_dx._y = 0.0f;
+        rays->_dx._z = 0.0f;
+        rays->_dy._x = 0.0f;
+        rays->_dy._y = s;
+        rays->_dy._z = 0.0f;
+
+        forward._x = 0.0f;
+        forward._y = 0.0f;
+        forward._z = -1.0f;
+        right = rays->_dx;
+        normalize(right, &right);
+        up = rays->_dy;
+        normalize(up, &up);
+        plane_distance = camera->_position._z;
+    } else {
+        // the image plane is one unit in front of the camera
+        float half_height = tanf(camera->_fov * (float) M_PI / 360.0f);
+        float aspect = camera->_aspect > 0.0f ? camera->_aspect : (float) width / height;
+        float half_width = half_height * aspect;
+        float norm;
+
+        sub(camera->_look_at, camera->_position, &forward);
+        normalize(forward, &forward);
+
+        // any other vertical will do if the camera looks along _up
+        computeCrossProduct(forward, camera->_up, &right);
+        computeNorm(right, &norm);
+        if (norm < 1e-6f) {
+            Vector3 other = {1.0f, 0.0f, 0.0f};
+            if (fabsf(forward._x) > 0.9f) {
+                other._x = 0.0f;
+                other._z = 1.0f;
+            }
+            computeCrossProduct(forward, other, &right);
+        }
+        normalize(right, &right);
+        computeCrossProduct(right, forward, &up);
+
+        mulAV(2.0f * half_width / width, right, &rays->_dx);
+        mulAV(2.0f * half_height / height, up, &rays->_dy);
+
+        mulAV(-half_width, right, &v);
+        add(forward, v, &rays->_corner);
+        mulAV(-half_height, up, &v);
+        add(rays->_corner, v, &rays->_corner);
+        plane_distance = 1.0f;
+    }
+
+    // the focus plane defaults to the plane of _look_at
+    rays->_lens = 0;
+    rays->_focus_scale = 1.0f;
+    mulAV(camera->_aperture, right, &rays->_lens_x);
+    mulAV(camera->_aperture, up, &rays->_lens_y);
+    if (camera->_aperture > 0.0f) {
+        float focus_distance = camera->_focus_distance;
+
+        if (focus_distance <= 0.0f) {
+            sub(camera->_look_at, camera->_position, &v);
+            computeDotProduct(v, forward, &focus_distance);
+        }
+        if (focus_distance > 0.0f && plane_distance > 0.0f) {
+            rays->_lens = 1;
+            rays->_focus_scale = focus_distance / plane_distance;
+        }
+    }
+
+#ifdef HAVE_X86_KERNELS
+    rays->_vectorized = __builtin_cpu_supports("avx2") != 0;
+#else
+    rays->_vectorized = 0;
+#endif
+}
+
+
+// Point of the unit disk for the lens sample (u, v) in [0, 1) x [0, 1)
+// (uniform: the radius is the square root of u)
+static void sampleDisk(float u, float v, float* x, float* y) {
+    float r = sqrtf(u);
+    float theta = 2.0f * (float) M_PI * v;
+
+    *x = r * cosf(theta);
+    *y = r * sinf(theta);
+}
+
+
+// Lens sample of pixel (i, j) in the given pass: the lens dimensions
+// of sample pass of the pixel (seed 0) of the sampler
+static void lensSample(int sampler_type, int i, int j, int pass, float* u, float* v) {
+    Sampler sampler;
+
+    startSampler(&sampler, sampler_type, j, i, 0, pass);
+    sampler._dimension = SAMPLE_LENS;
+    nextSample2D(&sampler, u, v);
+}
+
+
+// Direction (not normalized) of the pinhole ray through (x, y), with
+// the row part row = _corner + y * _dy already added
+static void pinholeDirection(const CameraRays* rays, Vector3 row, float x, Vector3* d) {
+    d->_x = row._x + x * rays->_dx._x;
+    d->_y = row._y + x * rays->_dx._y;
+    d->_z = row._z + x * rays->_dx._z;
+}
+
+
+// Normalize d as the SIMD kernel does
+static void normalizeDirection(Vector3* d) {
+    float inv_norm = 1.0f / sqrtf(d->_x * d->_x + d->_y * d->_y + d->_z * d->_z);
+
+    d->_x *= inv_norm;
+    d->_y *= inv_norm;
+    d->_z *= inv_norm;
+}
+
+
+// Turn the pinhole direction d into the ray through the lens at
+// sample (u, v)
+static void applyLens(const CameraRays* rays, float u, float v, Vector3* origin, Vector3* d) {
+    float lx;
+    float ly;
+    Vector3 offset;
+
+    sampleDisk(u, v, &lx, &ly);
+    offset._x = lx * rays->_lens_x._x + ly * rays->_lens_y._x;
+    offset._y = lx * rays->_lens_x._y + ly * rays->_lens_y._y;
+    offset._z = lx * rays->_lens_x._z + ly * rays->_lens_y._z;
+
+    add(rays->_origin, offset, origin);
+    d->_x = d->_x * rays->_focus_scale - offset._x;
+    d->_y = d->_y * rays->_focus_scale - offset._y;
+    d->_z = d->_z * rays->_focus_scale - offset._z;
+}
+
+
+static Vector3 rowStart(const CameraRays* rays, float y) {
+    Vector3 row;
+
+    row._x = rays->_corner._x + y * rays->_dy._x;
+    row._y = rays->_corner._y + y * rays->_dy._y;
+    row._z = rays->_corner._z + y * rays->_dy._z;
+
+    return row;
+}
+
+
+void generateRay(const CameraRays* rays, float x, float y, float lens_u, float lens_v,
+                 Vector3* origin, Vector3* direction) {
+    pinholeDirection(rays, rowStart(rays, y), x, direction);
+
+    *origin = rays->_origin;
+    if (rays->_lens) applyLens(rays, lens_u, lens_v, origin, direction);
+    normalizeDirection(direction);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+// Pinhole rays of 8 pixels of a row, columns j to j + 7: x steps by
+// one pixel from lane to lane, the rest as in generateRay
+__attribute__((target("avx2")))
+static void generateRays8(const CameraRays* rays, Vector3 row, int j, float offset_x,
+                          float* dir_x, float* dir_y, float* dir_z) {
+    __m256 x = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(j),
+                                                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))),
+                             _mm256_set1_ps(offset_x));
+    __m256 dx = _mm256_add_ps(_mm256_set1_ps(row._x), _mm256_mul_ps(x, _mm256_set1_ps(rays->_dx._x)));
+    __m256 dy = _mm256_add_ps(_mm256_set1_ps(row._y), _mm256_mul_ps(x, _mm256_set1_ps(rays->_dx._y)));
+    __m256 dz = _mm256_add_ps(_mm256_set1_ps(row._z), _mm256_mul_ps(x, _mm256_set1_ps(rays->_dx._z)));
+    __m256 n2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                              _mm256_mul_ps(dz, dz));
+    __m256 inv_norm = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(n2));
+
+    _mm256_storeu_ps(dir_x, _mm256_mul_ps(dx, inv_norm));
+    _mm256_storeu_ps(dir_y, _mm256_mul_ps(dy, inv_norm));
+    _mm256_storeu_ps(dir_z, _mm256_mul_ps(dz, inv_norm));
+}
+
+#endif
+
+
+void generateRays(const CameraRays* rays, const Tile* tile, float offset_x, float offset_y,
+                  int sampler, int pass, float* const directions[3], float* const origins[3]) {
+    int k = 0;
+    int i;
+    int j;
+
+    for (i = tile->_y0; i < tile->_y1; i++) {
+        Vector3 row = rowStart(rays, i + offset_y);
+
+        j = tile->_x0;
+
+#ifdef HAVE_X86_KERNELS
+        if (rays->_vectorized && !rays->_lens) {
+            for (; j + 8 <= tile->_x1; j += 8, k += 8) {
+                generateRays8(rays, row, j, offset_x,
+                              directions[0] + k, directions[1] + k, directions[2] + k);
+            }
+        }
+#endif
+
+        for (; j < tile->_x1; j++, k++) {
+            Vector3 d;
+
+            pinholeDirection(rays, row, j + offset_x, &d);
+            if (rays->_lens) {
+                Vector3 origin;
+                float u;
+                float v;
+
+                lensSample(sampler, i, j, pass, &u, &v);
+                applyLens(rays, u, v, &origin, &d);
+                origins[0][k] = origin._x;
+                origins[1][k] = origin._y;
+                origins[2][k] = origin._z;
+            }
+            normalizeDirection(&d);
+
+            directions[0][k] = d._x;
+            directions[1][k] = d._y;
+            directions[2][k] = d._z;
+        }
+    }
+}
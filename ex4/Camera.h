@@ -0,0 +1,91 @@
+#include "Geometry.h"
+#include "TileScheduler.h"
+
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+
+// Camera of a scene.
+// With _fov > 0: a camera at _position looking at _look_at, _up
+// giving the vertical direction of the image. _fov is the vertical
+// field of view in degrees and _aspect the width / height ratio of the
+// view (0: that of the image, for square pixels).
+// With _fov = 0: the view of the first scene files, which only give
+// _position and _scale. The camera looks down -z through the plane
+// z = 0, where the image is centered on the origin and the pixels are
+// _scale apart.
+// _aperture is the radius of a thin lens (0 for a pinhole camera):
+// points at _focus_distance along the view axis are sharp, the others
+// get blurred (0: the distance to _look_at).
+struct _Camera {
+    Vector3 _position;
+    Vector3 _look_at;
+    Vector3 _up;
+    float _fov;
+    float _aspect;
+    float _scale;
+    float _aperture;
+    float _focus_distance;
+};
+
+typedef struct _Camera Camera;
+
+
+// Rays of a camera for one image size, set up by setupCameraRays.
+// Pixel (i, j) (row i, counted from the bottom, and column j) is
+// sampled at image point (x, y) = (j, i), and the ray through image
+// point (x, y) goes from _origin along _corner + x * _dx + y * _dy.
+// A row of rays is thus a start and a step: rayTraceScene no longer
+// works out the geometry of each pixel.
+struct _CameraRays {
+    Vector3 _origin;
+    Vector3 _corner;
+    Vector3 _dx;
+    Vector3 _dy;
+
+    // 1 with a thin lens: rays start at _origin + u * _lens_x +
+    // v * _lens_y for (u, v) in the unit disk and go through the point
+    // _focus_scale times further than the pinhole ray does
+    int _lens;
+    Vector3 _lens_x;
+    Vector3 _lens_y;
+    float _focus_scale;
+
+    // 1 if the SIMD kernels can be used on this CPU
+    int _vectorized;
+};
+
+typedef struct _CameraRays CameraRays;
+
+
+// Camera looking down -z from (0, 0, 10), as in the first scenes
+void initCamera(Camera* camera);
+
+// Turn a camera with _fov = 0 into a camera looking at the origin with
+// the same vertical view in an image height pixels high (exactly the
+// same view if _position is on the z axis), so that it can be moved
+// around and rendered at any size. Other cameras are left unchanged.
+void useLookAtCamera(Camera* camera, int height);
+
+// Set up the rays of camera for a width by height image
+void setupCameraRays(CameraRays* rays, const Camera* camera, int width, int height);
+
+// Generate the rays through the pixels of tile, row by row: ray k goes
+// through pixel (tile->_y0 + k / w, tile->_x0 + k % w) of a tile w
+// pixels wide, at (offset_x, offset_y) from its sample point.
+// directions[0], [1] and [2] get the x, y and z coordinates of the
+// normalized directions. With a lens, origins[0], [1] and [2] get the
+// coordinates of the origins, the lens sample of each pixel being
+// sample pass of the pixel for sampler (SAMPLER_, see Sampler.h);
+// without a lens, every ray starts at rays->_origin and origins is not
+// used.
+void generateRays(const CameraRays* rays, const Tile* tile, float offset_x, float offset_y,
+                  int sampler, int pass, float* const directions[3], float* const origins[3]);
+
+// Generate the ray through image point (x, y), with lens sample
+// (lens_u, lens_v) in [0, 1) x [0, 1) (unused without a lens)
+void generateRay(const CameraRays* rays, float x, float y, float lens_u, float lens_v,
+                 Vector3* origin, Vector3* direction);
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FrameBuffer.h"
+
+
+void initFrameBuffer(FrameBuffer* frame) {
+    frame->_width = 0;
+    frame->_height = 0;
+    frame->_format = FRAMEBUFFER_RGB8;
+    frame->_pixel_size = 3;
+    frame->_row_size = 0;
+    frame->_data = NULL;
+    frame->_capacity = 0;
+}
+
+
+void resizeFrameBuffer(FrameBuffer* frame, int width, int height, int format) {
+    size_t size;
+
+    switch (format) {
+        case FRAMEBUFFER_RGB8: frame->_pixel_size = 3; break;
+        case FRAMEBUFFER_RGB16F: frame->_pixel_size = 3 * sizeof(unsigned short); break;
+        case FRAMEBUFFER_RGB32F: frame->_pixel_size = 3 * sizeof(float); break;
+        default:
+            printf("Error: Unknown frame buffer format %d\n", format);
+            exit(1);
+    }
+
+    frame->_width = width;
+    frame->_height = height;
+    frame->_format = format;
+    frame->_row_size = (size_t) width * frame->_pixel_size;
+
+    size = frame->_row_size * height;
+    if (size > frame->_capacity) {
+        void* data = NULL;
+
+        free(frame->_data);
+        if (posix_memalign(&data, FRAMEBUFFER_ALIGNMENT, size) != 0) {
+            printf("Error: Couldn't allocate memory for a %dx%d frame buffer\n", width, height);
+            exit(1);
+        }
+
+        frame->_data = data;
+        frame->_capacity = size;
+    }
+}
+
+
+void freeFrameBuffer(FrameBuffer* frame) {
+    free(frame->_data);
+    initFrameBuffer(frame);
+}
+
+
+unsigned short floatToHalf(float f) {
+    unsigned int bits;
+    unsigned int sign;
+    unsigned int mantissa;
+    int exponent;
+
+    memcpy(&bits, &f, sizeof(bits));
+    sign = (bits >> 16) & 0x8000u;
+    exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+    mantissa = bits & 0x7fffffu;
+
+    // infinity and NaN (keep NaNs quiet)
+    if (exponent == 0xff - 127 + 15) {
+        return (unsigned short) (sign | 0x7c00u | (mantissa ? 0x200u : 0));
+    }
+
+    // too large: infinity
+    if (exponent >= 0x1f) {
+        return (unsigned short) (sign | 0x7c00u);
+    }
+
+    // too small even for a subnormal: zero
+    if (exponent < -10) {
+        return (unsigned short) sign;
+    }
+
+    // subnormal: shift the mantissa with its implicit bit into place
+    if (exponent <= 0) {
+        unsigned int shift = (unsigned int) (14 - exponent);
+        unsigned int m = mantissa | 0x800000u;
+        unsigned int half = m >> shift;
+        unsigned int rest = m & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return (unsigned short) (sign | half);
+    }
+
+    // normal: round the mantissa to 10 bits; a carry into the exponent
+    // gives the right result, up to infinity
+    {
+        unsigned int half = ((unsigned int) exponent << 10) | (mantissa >> 13);
+        unsigned int rest = mantissa & 0x1fffu;
+
+        if (rest > 0x1000u || (rest == 0x1000u && (half & 1))) half++;
+        return (unsigned short) (sign | half);
+    }
+}
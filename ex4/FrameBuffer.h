@@ -0,0 +1,51 @@
+#include <stddef.h>
+
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+
+// Pixel formats: 8-bit, half float and float RGB
+#define FRAMEBUFFER_RGB8 0
+#define FRAMEBUFFER_RGB16F 1
+#define FRAMEBUFFER_RGB32F 2
+
+#define FRAMEBUFFER_ALIGNMENT 64
+
+
+// An image held in one block of memory aligned on FRAMEBUFFER_ALIGNMENT
+// bytes. Rows are packed one after the other with no padding, row 0 at
+// the bottom, which is the layout glTexImage2D expects (with an unpack
+// alignment of 1). The memory is kept when the buffer is resized to a
+// smaller or equal size, so a buffer reused for every frame only
+// allocates for the first one.
+struct _FrameBuffer {
+    int _width;
+    int _height;
+    int _format;
+
+    // Bytes per pixel and per row
+    int _pixel_size;
+    size_t _row_size;
+
+    void* _data;
+    size_t _capacity;
+};
+
+typedef struct _FrameBuffer FrameBuffer;
+
+
+// Empty buffer
+void initFrameBuffer(FrameBuffer* frame);
+
+// Make room for a width by height image in the given format.
+// The content is undefined afterwards.
+void resizeFrameBuffer(FrameBuffer* frame, int width, int height, int format);
+
+// Free memory used by the buffer
+void freeFrameBuffer(FrameBuffer* frame);
+
+// Convert a float to an IEEE half float (round to nearest even)
+unsigned short floatToHalf(float f);
+
+#endif
@@ -52,3 +52,73 @@ void normalize(Vector3 v, Vector3* result) {
     mulAV(1.0f / norm, v, result);
 }
 
+void computeTriangleArea(Vector3 v1, Vector3 v2, Vector3 v3, float* result) {
+    Vector3 v1v2, v1v3, cross;
+    float norm;
+    sub(v2, v1, &v1v2);
+    sub(v3, v1, &v1v3);
+    computeCrossProduct(v1v2, v1v3, &cross);
+    computeNorm(cross, &norm);
+    *result = 0.5f * norm;
+}
+
+void setIdentity(Transform* result) {
+    int i;
+    int j;
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 4; j++) result->_m[i][j] = i == j ? 1.0f : 0.0f;
+    }
+}
+
+void transformPoint(const Transform* t, Vector3 p, Vector3* result) {
+    transformVector(t, p, result);
+    result->_x += t->_m[0][3];
+    result->_y += t->_m[1][3];
+    result->_z += t->_m[2][3];
+}
+
+void transformVector(const Transform* t, Vector3 v, Vector3* result) {
+    Vector3 r;
+    r._x = t->_m[0][0] * v._x + t->_m[0][1] * v._y + t->_m[0][2] * v._z;
+    r._y = t->_m[1][0] * v._x + t->_m[1][1] * v._y + t->_m[1][2] * v._z;
+    r._z = t->_m[2][0] * v._x + t->_m[2][1] * v._y + t->_m[2][2] * v._z;
+    *result = r;
+}
+
+void transformNormal(const Transform* t, Vector3 n, Vector3* result) {
+    Vector3 r;
+    r._x = t->_m[0][0] * n._x + t->_m[1][0] * n._y + t->_m[2][0] * n._z;
+    r._y = t->_m[0][1] * n._x + t->_m[1][1] * n._y + t->_m[2][1] * n._z;
+    r._z = t->_m[0][2] * n._x + t->_m[1][2] * n._y + t->_m[2][2] * n._z;
+    *result = r;
+}
+
+int invertTransform(const Transform* t, Transform* result) {
+    const float (*m)[4] = t->_m;
+    float c[3][3];
+    float det;
+    int i;
+    int j;
+
+    // cofactors of A: the inverse is their transpose over det(A)
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            c[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+        }
+    }
+    det = m[0][0] * c[0][0] + m[0][1] * c[0][1] + m[0][2] * c[0][2];
+    if (det == 0.0f) return 0;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) result->_m[i][j] = c[j][i] / det;
+    }
+    // b' = -A^-1 b
+    for (i = 0; i < 3; i++) {
+        result->_m[i][3] = -(result->_m[i][0] * m[0][3] + result->_m[i][1] * m[1][3]
+                             + result->_m[i][2] * m[2][3]);
+    }
+
+    return 1;
+}
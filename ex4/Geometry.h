@@ -12,6 +12,15 @@ struct _Vector3 {
 typedef struct _Vector3 Vector3;
 
 
+// Affine map x -> A x + b stored as 3 rows of 4: _m[i] holds row i of
+// A followed by b_i
+struct _Transform {
+  float _m[3][4];
+};
+
+typedef struct _Transform Transform;
+
+
 // result = v1 + v2
 void add(Vector3 v1, Vector3 v2, Vector3* result);
 
@@ -40,6 +49,26 @@ void computeNorm(Vector3 v, float* result);
 // result = v / ||v|| where ||.|| is the L2 norm
 void normalize(Vector3 v, Vector3* result);
 
+// result = area of the triangle (v1, v2, v3)
+void computeTriangleArea(Vector3 v1, Vector3 v2, Vector3 v3, float* result);
+
+// result = the identity map
+void setIdentity(Transform* result);
+
+// result = t applied to the point p (A p + b)
+void transformPoint(const Transform* t, Vector3 p, Vector3* result);
+
+// result = t applied to the direction v (A v)
+void transformVector(const Transform* t, Vector3 v, Vector3* result);
+
+// result = the normal, once mapped by the inverse of t, of a surface
+// of normal n: transpose(A) n (not normalized). With t the world to
+// object map of an instance, this takes object normals to the world.
+void transformNormal(const Transform* t, Vector3 n, Vector3* result);
+
+// result = the inverse of t. Return 0 if t cannot be inverted.
+int invertTransform(const Transform* t, Transform* result);
+
 
 #endif
 
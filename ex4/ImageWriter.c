@@ -0,0 +1,215 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ImageWriter.h"
+
+
+// Largest payload of a stored deflate block
+#define MAX_STORED_BLOCK 65535
+
+
+// Built once, by the first PNG writer (writers may be opened from
+// several threads at once), and only read after that
+static unsigned int g_crc_table[256];
+static pthread_once_t g_crc_table_once = PTHREAD_ONCE_INIT;
+
+
+static void initCRCTable(void) {
+    unsigned int n;
+    int k;
+
+    for (n = 0; n < 256; n++) {
+        unsigned int c = n;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        g_crc_table[n] = c;
+    }
+}
+
+
+static unsigned int updateCRC(unsigned int crc, const unsigned char* buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        crc = g_crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+static void updateAdler(ImageWriter* writer, const unsigned char* buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        writer->_adler_a = (writer->_adler_a + buf[i]) % 65521;
+        writer->_adler_b = (writer->_adler_b + writer->_adler_a) % 65521;
+    }
+}
+
+
+static void putBigEndian(unsigned char* buf, unsigned int v) {
+    buf[0] = (unsigned char) (v >> 24);
+    buf[1] = (unsigned char) (v >> 16);
+    buf[2] = (unsigned char) (v >> 8);
+    buf[3] = (unsigned char) v;
+}
+
+
+// Write one PNG chunk
+static void writeChunk(FILE* f, const char* type, const unsigned char* data, size_t len) {
+    unsigned char buf[4];
+    unsigned int crc = 0xffffffffu;
+
+    putBigEndian(buf, (unsigned int) len);
+    fwrite(buf, 1, 4, f);
+
+    fwrite(type, 1, 4, f);
+    crc = updateCRC(crc, (const unsigned char*) type, 4);
+
+    if (len) {
+        fwrite(data, 1, len, f);
+        crc = updateCRC(crc, data, len);
+    }
+
+    putBigEndian(buf, crc ^ 0xffffffffu);
+    fwrite(buf, 1, 4, f);
+}
+
+
+void openImageWriter(ImageWriter* writer, const char* filename, int width, int height) {
+    size_t len = strlen(filename);
+
+    writer->_file = fopen(filename, "wb");
+    if (!writer->_file) {
+        printf("Error: Couldn't open the output image: %s\n", filename);
+        exit(1);
+    }
+
+    writer->_format = IMAGE_PPM;
+    if (len >= 4 && (!strcmp(filename + len - 4, ".png") || !strcmp(filename + len - 4, ".PNG"))) {
+        writer->_format = IMAGE_PNG;
+    }
+
+    writer->_width = width;
+    writer->_height = height;
+    writer->_rows_written = 0;
+    writer->_adler_a = 1;
+    writer->_adler_b = 0;
+    writer->_buffer = NULL;
+
+    if (writer->_format == IMAGE_PPM) {
+        fprintf(writer->_file, "P6\n%d %d\n255\n", width, height);
+    } else {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        unsigned char ihdr[13];
+
+        size_t row_size = 1 + 3 * (size_t) width;
+
+        pthread_once(&g_crc_table_once, initCRCTable);
+
+        // one compressed row: zlib header, block headers, checksum
+        writer->_buffer = (unsigned char*) malloc(row_size + 5 * (row_size / MAX_STORED_BLOCK + 1) + 6);
+        if (!writer->_buffer) {
+            printf("Error: Couldn't allocate memory for a row of %d pixels\n", width);
+            exit(1);
+        }
+
+        fwrite(signature, 1, 8, writer->_file);
+
+        putBigEndian(ihdr, (unsigned int) width);
+        putBigEndian(ihdr + 4, (unsigned int) height);
+        ihdr[8] = 8;   // bits per channel
+        ihdr[9] = 2;   // RGB
+        ihdr[10] = 0;  // deflate
+        ihdr[11] = 0;  // adaptive filtering
+        ihdr[12] = 0;  // no interlace
+        writeChunk(writer->_file, "IHDR", ihdr, 13);
+    }
+}
+
+
+// Write the row as one IDAT chunk: the zlib header before the first
+// row, then the row (filter byte + pixels) in stored deflate blocks,
+// then the checksum after the last row.
+static void writePNGRow(ImageWriter* writer, const unsigned char* rgb) {
+    size_t row_size = 1 + 3 * (size_t) writer->_width;
+    int last_row = writer->_rows_written == writer->_height - 1;
+    unsigned char* buf = writer->_buffer;
+    size_t len = 0;
+    size_t done = 0;
+
+    if (writer->_rows_written == 0) {
+        buf[len++] = 0x78;  // deflate, 32K window
+        buf[len++] = 0x01;  // no preset dictionary, fastest
+    }
+
+    while (done < row_size) {
+        size_t block = row_size - done;
+        size_t start;
+        if (block > MAX_STORED_BLOCK) block = MAX_STORED_BLOCK;
+
+        buf[len++] = (last_row && done + block == row_size) ? 1 : 0;
+        buf[len++] = (unsigned char) block;
+        buf[len++] = (unsigned char) (block >> 8);
+        buf[len++] = (unsigned char) ~block;
+        buf[len++] = (unsigned char) (~block >> 8);
+
+        start = len;
+        if (done == 0) {
+            buf[len++] = 0;  // filter: none
+            memcpy(buf + len, rgb, block - 1);
+            len += block - 1;
+        } else {
+            memcpy(buf + len, rgb + done - 1, block);
+            len += block;
+        }
+        updateAdler(writer, buf + start, len - start);
+
+        done += block;
+    }
+
+    if (last_row) {
+        putBigEndian(buf + len, (writer->_adler_b << 16) | writer->_adler_a);
+        len += 4;
+    }
+
+    writeChunk(writer->_file, "IDAT", buf, len);
+}
+
+
+void writeImageRow(ImageWriter* writer, const unsigned char* rgb) {
+    if (writer->_rows_written >= writer->_height) {
+        printf("Error: Too many rows written to the output image\n");
+        exit(1);
+    }
+
+    if (writer->_format == IMAGE_PPM) {
+        fwrite(rgb, 1, 3 * (size_t) writer->_width, writer->_file);
+    } else {
+        writePNGRow(writer, rgb);
+    }
+
+    writer->_rows_written++;
+}
+
+
+void closeImageWriter(ImageWriter* writer) {
+    if (writer->_rows_written != writer->_height) {
+        printf("Error: Only %d of %d rows were written to the output image\n",
+               writer->_rows_written, writer->_height);
+        exit(1);
+    }
+
+    if (writer->_format == IMAGE_PNG) {
+        writeChunk(writer->_file, "IEND", NULL, 0);
+    }
+
+    if (fclose(writer->_file) != 0) {
+        printf("Error: Couldn't finish writing the output image\n");
+        exit(1);
+    }
+
+    free(writer->_buffer);
+    writer->_buffer = NULL;
+    writer->_file = NULL;
+}
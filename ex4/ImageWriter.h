@@ -0,0 +1,43 @@
+#include <stdio.h>
+
+
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+
+#define IMAGE_PPM 0
+#define IMAGE_PNG 1
+
+
+// Writes an 8-bit RGB image to a file one row at a time, from top to
+// bottom, so the image never has to be held in memory.
+// PNG files are written uncompressed (stored deflate blocks).
+struct _ImageWriter {
+    FILE* _file;
+    int _format;
+    int _width;
+    int _height;
+    int _rows_written;
+
+    // PNG only: running Adler-32 checksum of the zlib stream
+    unsigned int _adler_a;
+    unsigned int _adler_b;
+
+    // PNG only: one row wrapped in deflate blocks
+    unsigned char* _buffer;
+};
+
+typedef struct _ImageWriter ImageWriter;
+
+
+// Open filename for writing a width by height image. The format is
+// PNG if the name ends with ".png", binary PPM otherwise.
+void openImageWriter(ImageWriter* writer, const char* filename, int width, int height);
+
+// Append the next row (3 * width bytes, RGB)
+void writeImageRow(ImageWriter* writer, const unsigned char* rgb);
+
+// Finish the file. Every row must have been written.
+void closeImageWriter(ImageWriter* writer);
+
+#endif
@@ -0,0 +1,403 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#include "Scene.h"
+#include "SceneFile.h"
+#include "RayTrace.h"
+#include "ToneMap.h"
+#include "ImageWriter.h"
+#include "Animation.h"
+#include "TileScheduler.h"
+
+
+// Headless renderer: ray-trace a scene without opening a window and
+// write the image to a PPM or PNG file, then print timing statistics.
+// With an animation, render its frames to numbered files instead.
+
+
+static int g_width = 512;
+static int g_height = 512;
+static int g_aa_samples = DEFAULT_AA_SAMPLES;
+static float g_aa_contrast = DEFAULT_AA_CONTRAST;
+static int g_number_threads = 0;
+
+
+// Frames of an animation are rendered side by side by frame workers,
+// each with its own copy of the scene and its share of the threads:
+// while one worker updates its scene or writes its image, the others
+// keep the cores busy.
+struct _SequenceJob {
+    const Scene* _scene;
+    const Animation* _animation;
+    const char* _pattern;
+    int _tile_threads;
+
+    // Next frame to render (taken atomically by the workers)
+    int _next_frame;
+};
+
+typedef struct _SequenceJob SequenceJob;
+
+
+static double getTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static void writeRow(const unsigned char* rgb, int row, void* data)
+{
+    writeImageRow((ImageWriter*) data, rgb);
+}
+
+
+static void printUsage(const char* name)
+{
+    printf("Usage: %s [options] output.(ppm|png)\n", name);
+    printf("       %s [options] -A animation output%%04d.(ppm|png)\n", name);
+    printf("  -w width     image width in pixels (default %d)\n", g_width);
+    printf("  -h height    image height in pixels (default %d)\n", g_height);
+    printf("  -t threads   render threads, 0 for one per core (default 0)\n");
+    printf("  -p size      primary ray packet size: 1, 4, 8, 16, 0 for auto (default 0)\n");
+    printf("  -d depth     reflection and refraction depth (default %d, at most %d)\n",
+           DEFAULT_TRACE_DEPTH, MAX_TRACE_DEPTH);
+    printf("  -r rays      rays traced per pixel at most (default %d)\n", DEFAULT_RAY_BUDGET);
+    printf("  -l samples   shadow rays per hit point, 0 for one per light (default 0)\n");
+    printf("  -L samples   shadow rays per area light: 1 (hard shadows), 4, %d (default %d)\n",
+           AREA_MAX_SAMPLES, DEFAULT_AREA_SAMPLES);
+    printf("  -a samples   samples of the anti-aliased pixels: 1 (off), 4, %d (default %d)\n",
+           AA_MAX_SAMPLES, DEFAULT_AA_SAMPLES);
+    printf("  -c contrast  contrast above which pixels are anti-aliased (default %g)\n",
+           DEFAULT_AA_CONTRAST);
+    printf("  -m operator  tone mapping: default, srgb, reinhard, aces (default: default)\n");
+    printf("  -S sampler   numbers of the stochastic effects: random, sobol, bluenoise\n");
+    printf("               (default: random)\n");
+    printf("  -s scene     load the scene from a text or binary scene file\n");
+    printf("  -b scene     also save the scene in binary form\n");
+    printf("  -P prefix    write the profile of the frame to prefix.json, prefix.csv\n");
+    printf("               and a heatmap of the time per tile to prefix.ppm\n");
+    printf("               (needs a build with -DRAYTRACE_PROFILE)\n");
+    printf("  -A animation render the frames of an animation file (see Animation.h), each\n");
+    printf("               to the output name with %%d replaced by the frame number\n");
+    printf("  -F frames    frames rendered at once, 0 for auto (default 0)\n");
+}
+
+
+// Open the file prefix + extension for writing
+static FILE* openProfileFile(const char* prefix, const char* extension, char* filename,
+                             size_t size)
+{
+    FILE* f;
+
+    snprintf(filename, size, "%s%s", prefix, extension);
+    f = fopen(filename, "w");
+    if (!f) {
+        printf("Error: Couldn't open %s for writing\n", filename);
+        exit(1);
+    }
+
+    return f;
+}
+
+
+// Write the profile of the last frame next to the image
+static void writeProfile(const char* prefix)
+{
+    const FrameProfile* profile = getRayTraceProfile();
+    ProfileCounters total;
+    char filename[1024];
+    ImageWriter writer;
+    unsigned char* heatmap;
+    FILE* f;
+    int i;
+
+    f = openProfileFile(prefix, ".json", filename, sizeof(filename));
+    writeProfileJSON(profile, f);
+    fclose(f);
+
+    f = openProfileFile(prefix, ".csv", filename, sizeof(filename));
+    writeProfileCSV(profile, f);
+    fclose(f);
+
+    heatmap = (unsigned char*) malloc((size_t) 3 * profile->_width * profile->_height);
+    if (!heatmap) {
+        printf("Error: Couldn't allocate memory for the heatmap\n");
+        exit(1);
+    }
+    drawProfileHeatmap(profile, heatmap);
+    snprintf(filename, sizeof(filename), "%s.ppm", prefix);
+    openImageWriter(&writer, filename, profile->_width, profile->_height);
+    for (i = 0; i < profile->_height; i++) {
+        writeImageRow(&writer, heatmap + (size_t) 3 * i * profile->_width);
+    }
+    closeImageWriter(&writer);
+    free(heatmap);
+
+    sumFrameProfile(profile, &total);
+    printf("profile: %llu primary, %llu secondary, %llu shadow rays, %llu BVH nodes\n",
+           total._counts[PROFILE_PRIMARY_RAYS], total._counts[PROFILE_SECONDARY_RAYS],
+           total._counts[PROFILE_SHADOW_RAYS], total._counts[PROFILE_BVH_NODES]);
+    printf("         written to %s.json, %s.csv and %s.ppm\n", prefix, prefix, prefix);
+}
+
+
+// Write frame number f of a sequence, named after pattern
+static void writeFrame(const char* pattern, int f, const FrameBuffer* frame)
+{
+    char filename[1024];
+    ImageWriter writer;
+    int i;
+
+    snprintf(filename, sizeof(filename), pattern, f);
+    openImageWriter(&writer, filename, frame->_width, frame->_height);
+    for (i = frame->_height - 1; i >= 0; i--) {
+        writeImageRow(&writer, (const unsigned char*) frame->_data + i * frame->_row_size);
+    }
+    closeImageWriter(&writer);
+}
+
+
+static void* frameWorker(void* data)
+{
+    SequenceJob* job = (SequenceJob*) data;
+    Scene scene;
+    FrameBuffer frame;
+    int f;
+
+    copySceneFrame(&scene, job->_scene);
+    initFrameBuffer(&frame);
+    resizeFrameBuffer(&frame, g_width, g_height, FRAMEBUFFER_RGB8);
+
+    while ((f = __sync_fetch_and_add(&job->_next_frame, 1)) < job->_animation->_number_frames) {
+        applyAnimation(job->_animation, (float) f, &scene);
+        rayTraceSceneToBufferThreads(&scene, &frame, job->_tile_threads);
+        writeFrame(job->_pattern, f, &frame);
+    }
+
+    freeFrameBuffer(&frame);
+    freeSceneFrame(&scene);
+
+    return NULL;
+}
+
+
+// Render every frame of animation with number_workers frame workers
+static void renderSequence(const Scene* scene, const Animation* animation,
+                           const char* pattern, int number_workers)
+{
+    int number_threads = g_number_threads > 0 ? g_number_threads : getNumberCores();
+    pthread_t* threads;
+    SequenceJob job;
+    int w;
+
+    // one frame at a time on few cores, otherwise two: enough to hide
+    // the serial work of each frame
+    if (number_workers <= 0) number_workers = number_threads >= 4 ? 2 : 1;
+    if (number_workers > animation->_number_frames) number_workers = animation->_number_frames;
+
+    job._scene = scene;
+    job._animation = animation;
+    job._pattern = pattern;
+    job._tile_threads = (number_threads + number_workers - 1) / number_workers;
+    job._next_frame = 0;
+
+    threads = (pthread_t*) malloc(number_workers * sizeof(pthread_t));
+    if (!threads) {
+        printf("Error: Couldn't allocate memory for %d frame workers\n", number_workers);
+        exit(1);
+    }
+    for (w = 1; w < number_workers; w++) {
+        if (pthread_create(&threads[w], NULL, frameWorker, &job) != 0) {
+            printf("Error: Couldn't start a frame worker\n");
+            exit(1);
+        }
+    }
+    frameWorker(&job);
+    for (w = 1; w < number_workers; w++) pthread_join(threads[w], NULL);
+
+    free(threads);
+}
+
+
+// 1 if pattern holds exactly one %d (with flags and width) and no
+// other conversion
+static int isFramePattern(const char* pattern)
+{
+    int conversions = 0;
+    const char* p;
+
+    for (p = pattern; *p; p++) {
+        if (*p != '%') continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+        p++;
+        while (*p == '0' || *p == '-' || (*p >= '1' && *p <= '9')) p++;
+        if (*p != 'd') return 0;
+        conversions++;
+    }
+
+    return conversions == 1;
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* output = NULL;
+    const char* scene_file = NULL;
+    const char* binary_file = NULL;
+    const char* profile_prefix = NULL;
+    const char* animation_file = NULL;
+    int number_workers = 0;
+    Animation animation;
+    Scene scene;
+    ImageWriter writer;
+    double t0, t1, t2;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0' && i + 1 < argc) {
+            int value = atoi(argv[i + 1]);
+            switch (argv[i][1]) {
+                case 'w': g_width = value; break;
+                case 'h': g_height = value; break;
+                case 't':
+                    setRayTraceThreads(value);
+                    g_number_threads = value;
+                    break;
+                case 'p': setRayTracePacketSize(value); break;
+                case 'd': setRayTraceDepth(value); break;
+                case 'r': setRayTraceRayBudget(value); break;
+                case 'l': setRayTraceLightSamples(value); break;
+                case 'L': setRayTraceAreaSamples(value); break;
+                case 'a': g_aa_samples = value; break;
+                case 'c': g_aa_contrast = (float) atof(argv[i + 1]); break;
+                case 'm':
+                    if (!strcmp(argv[i + 1], "default")) {
+                        setRayTraceToneMap(TONEMAP_DEFAULT);
+                    } else if (!strcmp(argv[i + 1], "srgb")) {
+                        setRayTraceToneMap(TONEMAP_SRGB);
+                    } else if (!strcmp(argv[i + 1], "reinhard")) {
+                        setRayTraceToneMap(TONEMAP_REINHARD);
+                    } else if (!strcmp(argv[i + 1], "aces")) {
+                        setRayTraceToneMap(TONEMAP_ACES);
+                    } else {
+                        printUsage(argv[0]);
+                        return 1;
+                    }
+                    break;
+                case 'S':
+                    if (!strcmp(argv[i + 1], "random")) {
+                        setRayTraceSampler(SAMPLER_RANDOM);
+                    } else if (!strcmp(argv[i + 1], "sobol")) {
+                        setRayTraceSampler(SAMPLER_SOBOL);
+                    } else if (!strcmp(argv[i + 1], "bluenoise")) {
+                        setRayTraceSampler(SAMPLER_BLUE_NOISE);
+                    } else {
+                        printUsage(argv[0]);
+                        return 1;
+                    }
+                    break;
+                case 's': scene_file = argv[i + 1]; break;
+                case 'b': binary_file = argv[i + 1]; break;
+                case 'P': profile_prefix = argv[i + 1]; break;
+                case 'A': animation_file = argv[i + 1]; break;
+                case 'F': number_workers = value; break;
+                default:
+                    printUsage(argv[0]);
+                    return 1;
+            }
+            i++;
+        } else if (argv[i][0] != '-' && !output) {
+            output = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!output || g_width <= 0 || g_height <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (profile_prefix && !getRayTraceProfile()) {
+        printf("Error: -P needs a build with profiling (make CFLAGS=-DRAYTRACE_PROFILE)\n");
+        return 1;
+    }
+
+    if (animation_file && (profile_prefix || !isFramePattern(output))) {
+        printf("Error: -A needs an output name with one %%d for the frame number, and no -P\n");
+        return 1;
+    }
+
+    setRayTraceAntialiasing(g_aa_samples, g_aa_contrast);
+
+    t0 = getTime();
+
+    // Create a scene, or load it from a file
+    if (scene_file) {
+        loadScene(scene_file, &scene);
+    } else {
+        createScene(&scene);
+    }
+
+    t1 = getTime();
+
+    if (binary_file) saveSceneBinary(binary_file, &scene);
+
+    if (animation_file) {
+        loadAnimation(animation_file, &animation);
+
+        // the camera of the first scenes cannot turn
+        useLookAtCamera(&scene._camera, g_height);
+
+        t1 = getTime();
+        renderSequence(&scene, &animation, output, number_workers);
+        t2 = getTime();
+
+        printf("scene:  %d spheres, %d triangles, %d shapes, %d instances, %d lights, "
+               "built in %.3f ms\n",
+               scene._number_spheres, scene._triangles._count, scene._number_shapes,
+               scene._number_instances, scene._number_lights, 1e3 * (t1 - t0));
+        printf("render: %d frames of %dx%d in %.3f s, %.2f frames/s\n",
+               animation._number_frames, g_width, g_height, t2 - t1,
+               animation._number_frames / (t2 - t1));
+        printf("output: %s\n", output);
+
+        freeAnimation(&animation);
+        freeScene(&scene);
+
+        return 0;
+    }
+
+    // Ray-trace the scene straight into the output file
+    openImageWriter(&writer, output, g_width, g_height);
+    rayTraceSceneRows(&scene, g_width, g_height, writeRow, &writer);
+    closeImageWriter(&writer);
+
+    t2 = getTime();
+
+    printf("scene:  %d spheres, %d triangles, %d shapes, %d instances, %d lights, "
+           "built in %.3f ms\n",
+           scene._number_spheres, scene._triangles._count, scene._number_shapes,
+           scene._number_instances, scene._number_lights,
+           1e3 * (t1 - t0));
+    printf("render: %dx%d in %.3f ms, %.2f Mpixels/s\n",
+           g_width, g_height, 1e3 * (t2 - t1),
+           1e-6 * g_width * g_height / (t2 - t1));
+    printf("output: %s\n", output);
+
+    if (profile_prefix) writeProfile(profile_prefix);
+
+    freeScene(&scene);
+
+    return 0;
+}
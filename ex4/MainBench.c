@@ -0,0 +1,656 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#include "Scene.h"
+#include "SceneFile.h"
+#include "RayTrace.h"
+#include "TileScheduler.h"
+#include "ImageWriter.h"
+
+
+// Benchmark of the ray tracer: render reference scenes, generated here
+// except for the bunny, at several resolutions and thread counts, and
+// report the speed and its spread over repeated runs. The images of
+// the scenes can be saved as goldens and later compared with them,
+// and the speeds compared with those of an earlier run, so that both
+// wrong images and slowdowns are caught.
+
+
+// Kinds of reference scenes
+#define BENCH_SPHERES 0
+#define BENCH_LIGHTS 1
+#define BENCH_BUNNY 2
+
+#define MAX_BENCH_SCENES 16
+#define MAX_THREAD_COUNTS 8
+#define MAX_BASELINE_RESULTS 1024
+
+// Resolutions of the timed renders
+#define NUMBER_RESOLUTIONS 3
+static const int g_resolutions[NUMBER_RESOLUTIONS][2] = {
+    {320, 240}, {640, 480}, {1280, 720}
+};
+
+// Size of the images compared with the goldens
+#define GOLDEN_WIDTH 160
+#define GOLDEN_HEIGHT 120
+
+
+struct _BenchScene {
+    char _name[32];
+    int _kind;
+    int _size;
+};
+
+typedef struct _BenchScene BenchScene;
+
+
+// Speed of one configuration, over the runs
+struct _BenchResult {
+    char _scene[32];
+    int _width;
+    int _height;
+    int _threads;
+    double _mean_ms;
+    double _stddev_ms;
+    double _mean_mrays;
+    double _stddev_mrays;
+};
+
+typedef struct _BenchResult BenchResult;
+
+
+static int g_runs = 5;
+static int g_max_spheres = 1000000;
+static int g_number_resolutions = NUMBER_RESOLUTIONS;
+static int g_thread_counts[MAX_THREAD_COUNTS];
+static int g_number_thread_counts = 0;
+static const char* g_bunny_file = "bunny.scene";
+static const char* g_golden_output = NULL;
+static const char* g_golden_input = NULL;
+static float g_max_rmse = 1.0f;
+static int g_max_difference = 16;
+static const char* g_csv_output = NULL;
+static const char* g_baseline = NULL;
+static float g_tolerance = 10.0f;
+
+
+static double getTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+// Number in [0, 1) from a xorshift generator: the scenes are the same
+// from run to run and from machine to machine
+static float randomFloat(unsigned int* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static void setColor(Color* c, float red, float green, float blue)
+{
+    c->_red = red;
+    c->_green = green;
+    c->_blue = blue;
+}
+
+
+static void addFloor(Scene* scene, float y)
+{
+    Shape shape;
+
+    memset(&shape, 0, sizeof(shape));
+    shape._type = SHAPE_PLANE;
+    shape._geometry._plane._normal._y = 1.0f;
+    shape._geometry._plane._offset = y;
+    setColor(&shape._material._color, 0.4f, 0.4f, 0.4f);
+    addShape(scene, &shape);
+}
+
+
+// Camera at position looking at the origin
+static void lookAtOrigin(Scene* scene, float x, float y, float z, float fov)
+{
+    initCamera(&scene->_camera);
+    scene->_camera._position._x = x;
+    scene->_camera._position._y = y;
+    scene->_camera._position._z = z;
+    scene->_camera._fov = fov;
+}
+
+
+// n spheres of random sizes and colors in a cube that grows with n, so
+// that they are as packed for every n, over a floor and under two
+// lights
+static void createSpheresScene(Scene* scene, int n)
+{
+    unsigned int state = 12345u;
+    float half = 2.0f * cbrtf((float) n);
+    Sphere sphere;
+    Light light;
+    int k;
+
+    initScene(scene);
+    reserveScene(scene, n, 2);
+
+    memset(&sphere, 0, sizeof(sphere));
+    for (k = 0; k < n; k++) {
+        sphere._center._x = half * (2.0f * randomFloat(&state) - 1.0f);
+        sphere._center._y = half * (2.0f * randomFloat(&state) - 1.0f);
+        sphere._center._z = half * (2.0f * randomFloat(&state) - 1.0f);
+        sphere._radius = 0.4f + 0.6f * randomFloat(&state);
+        setColor(&sphere._color, 0.3f + 0.6f * randomFloat(&state),
+                 0.3f + 0.6f * randomFloat(&state), 0.3f + 0.6f * randomFloat(&state));
+        setColor(&sphere._color_spec, 0.5f, 0.5f, 0.5f);
+        addSphere(scene, &sphere);
+    }
+    addFloor(scene, -half - 1.0f);
+
+    memset(&light, 0, sizeof(light));
+    setColor(&light._light_color, 0.8f, 0.8f, 0.8f);
+    light._light_pos._x = -half;
+    light._light_pos._y = 3.0f * half;
+    light._light_pos._z = half;
+    addLight(scene, &light);
+    light._light_pos._x = 2.0f * half;
+    light._light_pos._z = 2.0f * half;
+    addLight(scene, &light);
+
+    setColor(&scene->_background_color, 0.1f, 0.1f, 0.15f);
+    setColor(&scene->_ambient, 0.1f, 0.1f, 0.1f);
+    lookAtOrigin(scene, 0.0f, 0.6f * half, 3.2f * half, 45.0f);
+
+    finalizeScene(scene);
+}
+
+
+// A grid of spheres on a floor, lit by n small colored lights with a
+// range
+static void createLightsScene(Scene* scene, int n)
+{
+    unsigned int state = 54321u;
+    Sphere sphere;
+    Light light;
+    int i;
+    int j;
+    int k;
+
+    initScene(scene);
+    reserveScene(scene, 64, n);
+
+    memset(&sphere, 0, sizeof(sphere));
+    sphere._radius = 0.8f;
+    setColor(&sphere._color, 0.8f, 0.8f, 0.8f);
+    setColor(&sphere._color_spec, 0.5f, 0.5f, 0.5f);
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 8; j++) {
+            sphere._center._x = 3.0f * i - 10.5f;
+            sphere._center._y = -0.2f;
+            sphere._center._z = 3.0f * j - 10.5f;
+            addSphere(scene, &sphere);
+        }
+    }
+    addFloor(scene, -1.0f);
+
+    memset(&light, 0, sizeof(light));
+    for (k = 0; k < n; k++) {
+        light._light_pos._x = 28.0f * randomFloat(&state) - 14.0f;
+        light._light_pos._y = 0.5f + 2.5f * randomFloat(&state);
+        light._light_pos._z = 28.0f * randomFloat(&state) - 14.0f;
+        setColor(&light._light_color, 0.3f * randomFloat(&state), 0.3f * randomFloat(&state),
+                 0.3f * randomFloat(&state));
+        light._range = 4.0f;
+        addLight(scene, &light);
+    }
+
+    setColor(&scene->_background_color, 0.0f, 0.0f, 0.0f);
+    setColor(&scene->_ambient, 0.02f, 0.02f, 0.02f);
+    lookAtOrigin(scene, 0.0f, 14.0f, 22.0f, 50.0f);
+
+    finalizeScene(scene);
+}
+
+
+static void createBenchScene(const BenchScene* bench, Scene* scene)
+{
+    switch (bench->_kind) {
+        case BENCH_SPHERES: createSpheresScene(scene, bench->_size); break;
+        case BENCH_LIGHTS: createLightsScene(scene, bench->_size); break;
+        default:
+            // the view of rtbatch at 512x512, whatever the resolution
+            loadScene(g_bunny_file, scene);
+            scene->_camera._fov = 75.0f;
+            break;
+    }
+}
+
+
+// Spheres scenes from 10 spheres up to g_max_spheres, many lights and
+// the bunny. Return the number of scenes.
+static int listBenchScenes(BenchScene* scenes)
+{
+    int count = 0;
+    int n;
+
+    for (n = 10; n <= g_max_spheres && count < MAX_BENCH_SCENES - 2; n *= 10) {
+        snprintf(scenes[count]._name, sizeof(scenes[count]._name), "spheres_%d", n);
+        scenes[count]._kind = BENCH_SPHERES;
+        scenes[count]._size = n;
+        count++;
+        if (n > g_max_spheres / 10) break;
+    }
+
+    snprintf(scenes[count]._name, sizeof(scenes[count]._name), "lights_1024");
+    scenes[count]._kind = BENCH_LIGHTS;
+    scenes[count]._size = 1024;
+    count++;
+
+    snprintf(scenes[count]._name, sizeof(scenes[count]._name), "bunny");
+    scenes[count]._kind = BENCH_BUNNY;
+    scenes[count]._size = 0;
+    count++;
+
+    return count;
+}
+
+
+// Rays traced by the last frame: every ray if the ray tracer counts
+// them (see Profile.h), else one per pixel
+static double countRays(const FrameBuffer* frame)
+{
+    const FrameProfile* profile = getRayTraceProfile();
+    ProfileCounters total;
+
+    if (!profile) return (double) frame->_width * frame->_height;
+
+    sumFrameProfile(profile, &total);
+    return (double) total._counts[PROFILE_PRIMARY_RAYS] + total._counts[PROFILE_SECONDARY_RAYS]
+           + total._counts[PROFILE_SHADOW_RAYS];
+}
+
+
+// Time g_runs renders of scene (after one more to warm up the caches)
+static void timeScene(const Scene* scene, const char* name, int width, int height,
+                      int threads, FrameBuffer* frame, BenchResult* result)
+{
+    double sum_ms = 0.0, sum2_ms = 0.0;
+    double sum_mrays = 0.0, sum2_mrays = 0.0;
+    int run;
+
+    setRayTraceThreads(threads);
+    resizeFrameBuffer(frame, width, height, FRAMEBUFFER_RGB8);
+    rayTraceSceneToBuffer(scene, frame);
+
+    for (run = 0; run < g_runs; run++) {
+        double t0 = getTime();
+        double ms;
+        double mrays;
+
+        rayTraceSceneToBuffer(scene, frame);
+        ms = 1e3 * (getTime() - t0);
+        mrays = 1e-3 * countRays(frame) / ms;
+
+        sum_ms += ms;
+        sum2_ms += ms * ms;
+        sum_mrays += mrays;
+        sum2_mrays += mrays * mrays;
+    }
+
+    snprintf(result->_scene, sizeof(result->_scene), "%.31s", name);
+    result->_width = width;
+    result->_height = height;
+    result->_threads = threads;
+    result->_mean_ms = sum_ms / g_runs;
+    result->_mean_mrays = sum_mrays / g_runs;
+
+    // sample standard deviations
+    result->_stddev_ms = 0.0;
+    result->_stddev_mrays = 0.0;
+    if (g_runs > 1) {
+        double var_ms = (sum2_ms - sum_ms * result->_mean_ms) / (g_runs - 1);
+        double var_mrays = (sum2_mrays - sum_mrays * result->_mean_mrays) / (g_runs - 1);
+        result->_stddev_ms = var_ms > 0.0 ? sqrt(var_ms) : 0.0;
+        result->_stddev_mrays = var_mrays > 0.0 ? sqrt(var_mrays) : 0.0;
+    }
+}
+
+
+// Golden image file of a scene
+static void goldenFilename(const char* dir, const char* name, char* filename, size_t size)
+{
+    snprintf(filename, size, "%s/%s_%dx%d.ppm", dir, name, GOLDEN_WIDTH, GOLDEN_HEIGHT);
+}
+
+
+static void writeGolden(const char* name, const FrameBuffer* frame)
+{
+    char filename[1024];
+    ImageWriter writer;
+    int i;
+
+    goldenFilename(g_golden_output, name, filename, sizeof(filename));
+    openImageWriter(&writer, filename, frame->_width, frame->_height);
+    for (i = frame->_height - 1; i >= 0; i--) {
+        writeImageRow(&writer, (const unsigned char*) frame->_data + i * frame->_row_size);
+    }
+    closeImageWriter(&writer);
+    printf("  golden: wrote %s\n", filename);
+}
+
+
+// Compare the image of frame with the golden of scene name.
+// Return 1 if it matches: an RMSE up to g_max_rmse levels (rounding
+// differences between machines) and no channel off by more than
+// g_max_difference levels (a few wrong pixels).
+static int checkGolden(const char* name, const FrameBuffer* frame)
+{
+    char filename[1024];
+    FILE* f;
+    int width;
+    int height;
+    int max_value;
+    int max_diff = 0;
+    double sum2 = 0.0;
+    double rmse;
+    unsigned char* row;
+    int i;
+    int j;
+
+    goldenFilename(g_golden_input, name, filename, sizeof(filename));
+    f = fopen(filename, "rb");
+    if (!f) {
+        printf("  golden: FAIL, couldn't open %s\n", filename);
+        return 0;
+    }
+    if (fscanf(f, "P6 %d %d %d", &width, &height, &max_value) != 3 || fgetc(f) == EOF
+        || width != frame->_width || height != frame->_height || max_value != 255) {
+        printf("  golden: FAIL, %s is not a %dx%d PPM image\n", filename,
+               frame->_width, frame->_height);
+        fclose(f);
+        return 0;
+    }
+
+    // the file starts with the top row
+    row = (unsigned char*) malloc(3 * width);
+    if (!row) {
+        printf("Error: Couldn't allocate memory for a row of %d pixels\n", width);
+        exit(1);
+    }
+    for (i = height - 1; i >= 0; i--) {
+        const unsigned char* pixels = (const unsigned char*) frame->_data + i * frame->_row_size;
+
+        if (fread(row, 1, 3 * width, f) != (size_t) (3 * width)) {
+            printf("  golden: FAIL, %s is truncated\n", filename);
+            free(row);
+            fclose(f);
+            return 0;
+        }
+        for (j = 0; j < 3 * width; j++) {
+            int diff = abs((int) row[j] - (int) pixels[j]);
+            if (diff > max_diff) max_diff = diff;
+            sum2 += (double) diff * diff;
+        }
+    }
+    free(row);
+    fclose(f);
+
+    rmse = sqrt(sum2 / (3.0 * width * height));
+    printf("  golden: %s, RMSE %.3f, largest difference %d\n",
+           rmse <= g_max_rmse && max_diff <= g_max_difference ? "ok" : "FAIL", rmse, max_diff);
+
+    return rmse <= g_max_rmse && max_diff <= g_max_difference;
+}
+
+
+// Read the results of an earlier run (CSV written by -o).
+// Return the number of results.
+static int readBaseline(const char* filename, BenchResult* results)
+{
+    char line[512];
+    FILE* f = fopen(filename, "r");
+    int count = 0;
+
+    if (!f) {
+        printf("Error: Couldn't open %s\n", filename);
+        exit(1);
+    }
+
+    while (count < MAX_BASELINE_RESULTS && fgets(line, sizeof(line), f)) {
+        BenchResult* r = &results[count];
+        char* comma = strchr(line, ',');
+        size_t length;
+
+        if (!comma || !strncmp(line, "scene,", 6)) continue;
+
+        length = (size_t) (comma - line);
+        if (length >= sizeof(r->_scene)) length = sizeof(r->_scene) - 1;
+        memcpy(r->_scene, line, length);
+        r->_scene[length] = '\0';
+        if (sscanf(comma + 1, "%d,%d,%d,%*d,%lf,%lf,%lf,%lf", &r->_width, &r->_height,
+                   &r->_threads, &r->_mean_ms, &r->_stddev_ms, &r->_mean_mrays,
+                   &r->_stddev_mrays) == 7) {
+            count++;
+        }
+    }
+    fclose(f);
+
+    return count;
+}
+
+
+// Compare result with the matching one of the baseline.
+// Return 1 if it is slower by more than g_tolerance percent.
+static int isRegression(const BenchResult* result, const BenchResult* baseline, int count)
+{
+    int k;
+
+    for (k = 0; k < count; k++) {
+        const BenchResult* b = &baseline[k];
+
+        if (!strcmp(b->_scene, result->_scene) && b->_width == result->_width
+            && b->_height == result->_height && b->_threads == result->_threads) {
+            double change = 100.0 * (result->_mean_mrays / b->_mean_mrays - 1.0);
+
+            printf("    vs baseline %8.3f Mrays/s: %+.1f%%%s\n", b->_mean_mrays, change,
+                   change < -g_tolerance ? "  REGRESSION" : "");
+            return change < -g_tolerance;
+        }
+    }
+
+    return 0;
+}
+
+
+// Parse a comma-separated list of thread counts
+static int parseThreadCounts(const char* list)
+{
+    const char* p = list;
+
+    g_number_thread_counts = 0;
+    while (*p && g_number_thread_counts < MAX_THREAD_COUNTS) {
+        char* end;
+        long n = strtol(p, &end, 10);
+
+        if (end == p || n < 0) return 0;
+        g_thread_counts[g_number_thread_counts++] = n > 0 ? (int) n : getNumberCores();
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return g_number_thread_counts > 0 && *p == '\0';
+}
+
+
+static void printUsage(const char* name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("  -r runs      timed renders per configuration (default %d)\n", g_runs);
+    printf("  -n spheres   largest sphere scene, from 10 spheres up by tens (default %d)\n",
+           g_max_spheres);
+    printf("  -t list      comma-separated thread counts, 0 for one per core (default 1,0)\n");
+    printf("  -q           quick: %dx%d only, spheres scenes up to 10000\n",
+           g_resolutions[0][0], g_resolutions[0][1]);
+    printf("  -m scene     scene file of the bunny (default %s)\n", g_bunny_file);
+    printf("  -u dir       write the %dx%d images of the scenes to dir as goldens\n",
+           GOLDEN_WIDTH, GOLDEN_HEIGHT);
+    printf("  -g dir       compare the images with the goldens in dir\n");
+    printf("  -e rmse      largest RMSE allowed against a golden, in 8-bit levels (default %g)\n",
+           g_max_rmse);
+    printf("  -d levels    largest difference allowed in a channel (default %d)\n",
+           g_max_difference);
+    printf("  -o file      write the results as CSV\n");
+    printf("  -c file      compare the speeds with an earlier CSV\n");
+    printf("  -x percent   slowdown allowed against the earlier CSV (default %g)\n",
+           g_tolerance);
+    printf("The exit status is 1 if an image or a speed does not match.\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    BenchScene scenes[MAX_BENCH_SCENES];
+    BenchResult* baseline = NULL;
+    int number_baseline = 0;
+    int number_scenes;
+    FrameBuffer frame;
+    FILE* csv = NULL;
+    int failures = 0;
+    int s;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q")) {
+            g_number_resolutions = 1;
+            if (g_max_spheres > 10000) g_max_spheres = 10000;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0'
+                   && i + 1 < argc) {
+            const char* value = argv[i + 1];
+            switch (argv[i][1]) {
+                case 'r': g_runs = atoi(value); break;
+                case 'n': g_max_spheres = atoi(value); break;
+                case 't':
+                    if (!parseThreadCounts(value)) {
+                        printUsage(argv[0]);
+                        return 1;
+                    }
+                    break;
+                case 'm': g_bunny_file = value; break;
+                case 'u': g_golden_output = value; break;
+                case 'g': g_golden_input = value; break;
+                case 'e': g_max_rmse = (float) atof(value); break;
+                case 'd': g_max_difference = atoi(value); break;
+                case 'o': g_csv_output = value; break;
+                case 'c': g_baseline = value; break;
+                case 'x': g_tolerance = (float) atof(value); break;
+                default:
+                    printUsage(argv[0]);
+                    return 1;
+            }
+            i++;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (g_runs < 1) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // one thread, then one per core
+    if (g_number_thread_counts == 0) {
+        g_thread_counts[g_number_thread_counts++] = 1;
+        if (getNumberCores() > 1) g_thread_counts[g_number_thread_counts++] = getNumberCores();
+    }
+
+    if (g_baseline) {
+        baseline = (BenchResult*) malloc(MAX_BASELINE_RESULTS * sizeof(BenchResult));
+        if (!baseline) {
+            printf("Error: Couldn't allocate memory for the baseline\n");
+            exit(1);
+        }
+        number_baseline = readBaseline(g_baseline, baseline);
+    }
+
+    if (g_csv_output) {
+        csv = fopen(g_csv_output, "w");
+        if (!csv) {
+            printf("Error: Couldn't open %s for writing\n", g_csv_output);
+            return 1;
+        }
+        fprintf(csv, "scene,width,height,threads,runs,mean_ms,stddev_ms,mrays_s,stddev_mrays_s\n");
+    }
+
+    // the speed of the ray tracer itself: no anti-aliasing
+    setRayTraceAntialiasing(1, DEFAULT_AA_CONTRAST);
+    initFrameBuffer(&frame);
+
+    printf("%d runs per configuration, %s\n", g_runs,
+           getRayTraceProfile() ? "counting every ray" : "counting primary rays");
+
+    number_scenes = listBenchScenes(scenes);
+    for (s = 0; s < number_scenes; s++) {
+        Scene scene;
+        double t0 = getTime();
+        double build_ms;
+        int r;
+        int t;
+
+        createBenchScene(&scenes[s], &scene);
+        build_ms = 1e3 * (getTime() - t0);
+        printf("%s: %d spheres, %d triangles, %d lights, built in %.1f ms\n",
+               scenes[s]._name, scene._number_spheres, scene._triangles._count,
+               scene._number_lights, build_ms);
+
+        for (r = 0; r < g_number_resolutions; r++) {
+            for (t = 0; t < g_number_thread_counts; t++) {
+                BenchResult result;
+
+                timeScene(&scene, scenes[s]._name, g_resolutions[r][0], g_resolutions[r][1],
+                          g_thread_counts[t], &frame, &result);
+                printf("  %4dx%-4d %3d threads: %9.2f ms +- %7.2f, %8.3f Mrays/s +- %.3f\n",
+                       result._width, result._height, result._threads, result._mean_ms,
+                       result._stddev_ms, result._mean_mrays, result._stddev_mrays);
+
+                if (csv) {
+                    fprintf(csv, "%s,%d,%d,%d,%d,%.3f,%.3f,%.4f,%.4f\n", result._scene,
+                            result._width, result._height, result._threads, g_runs,
+                            result._mean_ms, result._stddev_ms, result._mean_mrays,
+                            result._stddev_mrays);
+                }
+                if (baseline && isRegression(&result, baseline, number_baseline)) failures++;
+            }
+        }
+
+        if (g_golden_output || g_golden_input) {
+            resizeFrameBuffer(&frame, GOLDEN_WIDTH, GOLDEN_HEIGHT, FRAMEBUFFER_RGB8);
+            rayTraceSceneToBuffer(&scene, &frame);
+            if (g_golden_output) writeGolden(scenes[s]._name, &frame);
+            if (g_golden_input && !checkGolden(scenes[s]._name, &frame)) failures++;
+        }
+
+        freeScene(&scene);
+    }
+
+    if (csv) fclose(csv);
+    freeFrameBuffer(&frame);
+    free(baseline);
+
+    if (failures > 0) {
+        printf("%d check%s failed\n", failures, failures > 1 ? "s" : "");
+        return 1;
+    }
+
+    return 0;
+}
@@ -4,26 +4,91 @@
 #include <GL/glut.h>
 #endif
 
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 #include "Scene.h"
+#include "SceneFile.h"
 #include "RayTrace.h"
 
 
 static GLint g_width = 512;
 static GLint g_height = 512;
 static GLuint g_tex_id;
+static const char* g_scene_file = NULL;
 
+// The scene is refined in the background while the window shows the
+// current estimate
+static Scene g_scene;
+static ProgressiveRender g_render;
+static GLubyte* g_texture;
+static int g_samples_shown = 0;
 
-static void initGL()
+// Size of the image in the texture
+static int g_texture_width = 0;
+static int g_texture_height = 0;
+
+// Delay between two checks for a new estimate, in milliseconds
+#define REFRESH_DELAY 30
+
+
+// Moving the camera or a light restarts the render at 1 / PREVIEW_SCALE
+// of the resolution, with one pass; once there is no input for
+// IDLE_DELAY milliseconds, the full resolution is refined again
+#define PREVIEW_SCALE 4
+#define IDLE_DELAY 200
+
+// 1 while the render is a preview
+static int g_preview = 0;
+
+// Time of the last input, in milliseconds
+static int g_last_input = 0;
+
+// Camera and light positions asked for by the input, given to the
+// scene once the render is stopped (its threads read the scene)
+static Camera g_camera;
+static Camera g_first_camera;
+static Vector3* g_light_positions = NULL;
+static int g_camera_changed = 0;
+static int g_lights_changed = 0;
+
+// Light moved by the arrow keys
+static int g_light = 0;
+
+// Mouse button held down and last position of the mouse
+static int g_button = -1;
+static int g_mouse_x;
+static int g_mouse_y;
+
+// Orbit and dolly per pixel of mouse motion, and moves per key stroke,
+// as a fraction of the distance from the camera to what it looks at
+#define ORBIT_SPEED 0.01f
+#define DOLLY_SPEED 0.01f
+#define MOVE_STEP 0.05f
+
+// Wheel buttons of freeglut
+#define WHEEL_UP 3
+#define WHEEL_DOWN 4
+
+
+static void startRender(int preview)
 {
-    // Load the ray traced image as a texture
-    GLubyte* texture;
+    int width = preview ? g_width / PREVIEW_SCALE : g_width;
+    int height = preview ? g_height / PREVIEW_SCALE : g_height;
+
+    g_preview = preview;
+    g_samples_shown = 0;
+    startProgressiveRender(&g_render, &g_scene, width > 0 ? width : 1, height > 0 ? height : 1,
+                           preview ? 1 : 0);
+}
 
-    // Store a scene created in createScene()
-    Scene scene;
 
+static void initGL()
+{
+    int l;
 
     glClearColor(1, 1, 1, 1);
 
@@ -39,11 +104,40 @@ static void initGL()
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
 
-    // Create a scene
-    createScene(&scene);
-
-    // Ray-trace the scene and save it in the texture
-    rayTraceScene(scene, g_width, g_height, &texture);
+    // Create a scene, or load it from a file
+    if (g_scene_file) {
+        loadScene(g_scene_file, &g_scene);
+    } else {
+        createScene(&g_scene);
+    }
+
+    // The camera of the first scenes cannot turn: replace it with the
+    // look-at camera of the same view
+    useLookAtCamera(&g_scene._camera, g_height);
+    g_camera = g_scene._camera;
+    g_first_camera = g_scene._camera;
+
+    if (g_scene._number_lights > 0) {
+        g_light_positions = (Vector3*) malloc(g_scene._number_lights * sizeof(Vector3));
+        if (!g_light_positions) {
+            printf("Error: Couldn't allocate memory for %d lights\n", g_scene._number_lights);
+            exit(1);
+        }
+        for (l = 0; l < g_scene._number_lights; l++) {
+            g_light_positions[l] = g_scene._lights[l]._light_pos;
+        }
+    }
+
+    // Start ray-tracing the scene; the texture is white until the
+    // first pass is done
+    g_texture = (GLubyte*) malloc(3 * g_width * g_height);
+    if (!g_texture) {
+        printf("Error: Couldn't allocate memory for the texture\n");
+        exit(1);
+    }
+    memset(g_texture, 255, 3 * g_width * g_height);
+
+    startRender(0);
 
 
     glGenTextures(1, &g_tex_id);
@@ -55,15 +149,137 @@ static void initGL()
     glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
     glEnable(GL_TEXTURE_2D);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, g_width, g_height, 0, GL_RGB, GL_UNSIGNED_BYTE, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, g_width, g_height, 0, GL_RGB, GL_UNSIGNED_BYTE, g_texture);
+    g_texture_width = g_width;
+    g_texture_height = g_height;
+}
 
 
-    free(texture);
+// Show the state of the viewer in the window title: preview or number
+// of samples, and the light moved by the arrow keys
+static void showTitle(void)
+{
+    char title[64];
+    int n;
+
+    if (g_preview) {
+        n = sprintf(title, "ray casting (preview");
+    } else {
+        n = sprintf(title, "ray casting (%d samples", g_samples_shown);
+    }
+    if (g_scene._number_lights > 0) {
+        sprintf(title + n, ", light %d)", g_light);
+    } else {
+        sprintf(title + n, ")");
+    }
+    glutSetWindowTitle(title);
+}
+
+
+// Upload the estimate to the texture (stretched over the window when
+// it is a preview)
+static void showEstimate(void)
+{
+    g_samples_shown = getProgressiveEstimate(&g_render, g_texture);
+
+    glBindTexture(GL_TEXTURE_2D, g_tex_id);
+    if (g_render._width == g_texture_width && g_render._height == g_texture_height) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, g_render._width, g_render._height,
+                        GL_RGB, GL_UNSIGNED_BYTE, g_texture);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, g_render._width, g_render._height, 0,
+                     GL_RGB, GL_UNSIGNED_BYTE, g_texture);
+        g_texture_width = g_render._width;
+        g_texture_height = g_render._height;
+    }
+
+    showTitle();
+
+    glutPostRedisplay();
+}
+
+
+// Restart the render with the camera and lights asked for by the
+// input. A refining render is stopped at once (its tiles not started
+// yet are skipped); a preview is first finished and shown, so that
+// the window follows a continuous motion. Only what changed is
+// updated: moving the camera rebuilds nothing, moving lights rebuilds
+// the light hierarchy but not those of the objects.
+static void applyInput(void)
+{
+    int l;
+
+    if (!g_camera_changed && !g_lights_changed) return;
+    if (g_preview && getProgressiveSamples(&g_render) == 0) return;
+
+    if (g_preview && g_samples_shown == 0) showEstimate();
+    stopProgressiveRender(&g_render);
+
+    if (g_camera_changed) {
+        g_scene._camera = g_camera;
+    }
+    if (g_lights_changed) {
+        for (l = 0; l < g_scene._number_lights; l++) {
+            g_scene._lights[l]._light_pos = g_light_positions[l];
+        }
+        updateSceneLights(&g_scene);
+    }
+    g_camera_changed = 0;
+    g_lights_changed = 0;
+
+    startRender(1);
+}
+
+
+// Note an input: previews are rendered until the input stops
+static void touch(void)
+{
+    g_last_input = glutGet(GLUT_ELAPSED_TIME);
+    applyInput();
+}
+
+
+// Upload the estimate to the texture when new passes are done, and go
+// back to full resolution once the input stops
+static void refresh(int value)
+{
+    if (getProgressiveSamples(&g_render) != g_samples_shown) showEstimate();
+
+    applyInput();
+
+    if (g_preview && !g_camera_changed && !g_lights_changed && g_samples_shown > 0 &&
+        glutGet(GLUT_ELAPSED_TIME) - g_last_input >= IDLE_DELAY) {
+        stopProgressiveRender(&g_render);
+        startRender(0);
+    }
+
+    glutTimerFunc(REFRESH_DELAY, refresh, 0);
 }
 
 
 static void reshape(int width, int height)
-{}
+{
+    if (width <= 0 || height <= 0) return;
+    if (width == g_width && height == g_height) return;
+
+    glViewport(0, 0, width, height);
+
+    // the render writes the estimate at its own size: stop it before
+    // the texture memory changes
+    stopProgressiveRender(&g_render);
+
+    g_width = width;
+    g_height = height;
+    free(g_texture);
+    g_texture = (GLubyte*) malloc(3 * g_width * g_height);
+    if (!g_texture) {
+        printf("Error: Couldn't allocate memory for the texture\n");
+        exit(1);
+    }
+
+    g_last_input = glutGet(GLUT_ELAPSED_TIME);
+    startRender(1);
+}
 
 
 static void display(void)
@@ -95,15 +311,205 @@ static void display(void)
 }
 
 
+// Distance from the camera to what it looks at
+static float viewDistance(void)
+{
+    Vector3 offset;
+    float distance;
+
+    sub(g_camera._position, g_camera._look_at, &offset);
+    computeNorm(offset, &distance);
+
+    return distance;
+}
+
+
+// Turn the camera around what it looks at, by yaw radians around the
+// vertical and pitch radians up or down (not past the poles)
+static void orbitCamera(float yaw, float pitch)
+{
+    Vector3 offset;
+    float distance = viewDistance();
+    float theta;
+    float phi;
+    float limit = 0.49f * (float) M_PI;
+
+    if (distance <= 0.0f) return;
+
+    sub(g_camera._position, g_camera._look_at, &offset);
+    theta = atan2f(offset._x, offset._z) + yaw;
+    phi = asinf(offset._y / distance) + pitch;
+    if (phi > limit) phi = limit;
+    if (phi < -limit) phi = -limit;
+
+    offset._x = distance * cosf(phi) * sinf(theta);
+    offset._y = distance * sinf(phi);
+    offset._z = distance * cosf(phi) * cosf(theta);
+    add(g_camera._look_at, offset, &g_camera._position);
+
+    g_camera_changed = 1;
+}
+
+
+// Move the camera closer to what it looks at (factor < 1) or away
+static void dollyCamera(float factor)
+{
+    Vector3 offset;
+
+    sub(g_camera._position, g_camera._look_at, &offset);
+    mulAV(factor, offset, &offset);
+    add(g_camera._look_at, offset, &g_camera._position);
+
+    g_camera_changed = 1;
+}
+
+
+// Move the camera and what it looks at by forward, right and up steps
+// (in the directions of the view)
+static void moveCamera(float forward, float right, float up)
+{
+    Vector3 front;
+    Vector3 side;
+    Vector3 move;
+    Vector3 v;
+    float step = MOVE_STEP * viewDistance();
+
+    sub(g_camera._look_at, g_camera._position, &front);
+    normalize(front, &front);
+    computeCrossProduct(front, g_camera._up, &side);
+    normalize(side, &side);
+
+    mulAV(forward * step, front, &move);
+    mulAV(right * step, side, &v);
+    add(move, v, &move);
+    mulAV(up * step, g_camera._up, &v);
+    add(move, v, &move);
+
+    add(g_camera._position, move, &g_camera._position);
+    add(g_camera._look_at, move, &g_camera._look_at);
+
+    g_camera_changed = 1;
+}
+
+
+// Move the selected light by x, y and z steps
+static void moveLight(float x, float y, float z)
+{
+    float step = MOVE_STEP * viewDistance();
+    Vector3* position;
+
+    if (g_scene._number_lights == 0) return;
+
+    position = &g_light_positions[g_light];
+    position->_x += x * step;
+    position->_y += y * step;
+    position->_z += z * step;
+
+    g_lights_changed = 1;
+}
+
+
+static void handleMouseButtons(int button, int state, int x, int y)
+{
+    if (button == WHEEL_UP || button == WHEEL_DOWN) {
+        if (state == GLUT_DOWN) {
+            dollyCamera(button == WHEEL_UP ? 0.9f : 1.0f / 0.9f);
+            touch();
+        }
+        return;
+    }
+
+    g_button = state == GLUT_DOWN ? button : -1;
+    g_mouse_x = x;
+    g_mouse_y = y;
+}
+
+
+// Dragging with the left button turns the camera around what it looks
+// at, with the right button moves it closer or away
+static void handleMouseMotion(int x, int y)
+{
+    int dx = x - g_mouse_x;
+    int dy = y - g_mouse_y;
+
+    g_mouse_x = x;
+    g_mouse_y = y;
+    if (dx == 0 && dy == 0) return;
+
+    if (g_button == GLUT_LEFT_BUTTON) {
+        orbitCamera(-ORBIT_SPEED * dx, ORBIT_SPEED * dy);
+    } else if (g_button == GLUT_RIGHT_BUTTON) {
+        dollyCamera(expf(DOLLY_SPEED * dy));
+    } else {
+        return;
+    }
+    touch();
+}
+
+
+// w, s, a, d, q, e move the camera forward, back, left, right, down
+// and up; r brings back the camera of the scene; l selects the next
+// light
 static void handleKeyEvents(unsigned char key, int x, int y)
 {
-    if (key == 27) exit(0);
+    switch (key) {
+    case 27:
+        stopProgressiveRender(&g_render);
+        freeScene(&g_scene);
+        free(g_light_positions);
+        free(g_texture);
+        exit(0);
+    case 'w': moveCamera(1.0f, 0.0f, 0.0f); break;
+    case 's': moveCamera(-1.0f, 0.0f, 0.0f); break;
+    case 'a': moveCamera(0.0f, -1.0f, 0.0f); break;
+    case 'd': moveCamera(0.0f, 1.0f, 0.0f); break;
+    case 'q': moveCamera(0.0f, 0.0f, -1.0f); break;
+    case 'e': moveCamera(0.0f, 0.0f, 1.0f); break;
+    case 'r':
+        g_camera = g_first_camera;
+        g_camera_changed = 1;
+        break;
+    case 'l':
+        if (g_scene._number_lights > 0) {
+            g_light = (g_light + 1) % g_scene._number_lights;
+            showTitle();
+        }
+        return;
+    default:
+        return;
+    }
+    touch();
+}
+
+
+// The arrow keys move the selected light in x and z, page up and page
+// down in y
+static void handleSpecialKeys(int key, int x, int y)
+{
+    switch (key) {
+    case GLUT_KEY_LEFT: moveLight(-1.0f, 0.0f, 0.0f); break;
+    case GLUT_KEY_RIGHT: moveLight(1.0f, 0.0f, 0.0f); break;
+    case GLUT_KEY_UP: moveLight(0.0f, 0.0f, -1.0f); break;
+    case GLUT_KEY_DOWN: moveLight(0.0f, 0.0f, 1.0f); break;
+    case GLUT_KEY_PAGE_UP: moveLight(0.0f, 1.0f, 0.0f); break;
+    case GLUT_KEY_PAGE_DOWN: moveLight(0.0f, -1.0f, 0.0f); break;
+    default:
+        return;
+    }
+    touch();
 }
 
 
 int main(int argc, char** argv)
 {
     glutInit(&argc, argv);
+
+    // optional argument: number of render threads (0: one per core)
+    if (argc > 1) setRayTraceThreads(atoi(argv[1]));
+
+    // optional argument: scene file (text or binary)
+    if (argc > 2) g_scene_file = argv[2];
+
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
     glutInitWindowSize(g_width, g_height);
     glutCreateWindow("ray casting");
@@ -113,6 +519,10 @@ int main(int argc, char** argv)
     glutReshapeFunc(reshape);
     glutDisplayFunc(display);
     glutKeyboardFunc(handleKeyEvents);
+    glutSpecialFunc(handleSpecialKeys);
+    glutMouseFunc(handleMouseButtons);
+    glutMotionFunc(handleMouseMotion);
+    glutTimerFunc(REFRESH_DELAY, refresh, 0);
 
     glutMainLoop();
 
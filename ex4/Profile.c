@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Profile.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <x86intrin.h>
+#endif
+
+
+__thread ProfileCounters g_profile_thread;
+
+
+// Names of the counters and timers in the reports
+static const char* const g_counter_names[PROFILE_NUMBER_COUNTERS] = {
+    "primary_rays", "secondary_rays", "shadow_rays",
+    "sphere_tests", "triangle_tests", "shape_tests", "bvh_nodes"
+};
+
+static const char* const g_timer_names[PROFILE_NUMBER_TIMERS] = {
+    "tile_seconds", "shading_seconds", "post_process_seconds"
+};
+
+
+unsigned long long getProfileTicks(void) {
+#ifdef HAVE_X86_KERNELS
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+
+static double getSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+void initFrameProfile(FrameProfile* profile) {
+    memset(profile, 0, sizeof(FrameProfile));
+}
+
+
+void beginFrameProfile(FrameProfile* profile, int width, int height,
+                       int number_workers, int number_tiles) {
+    if (number_workers > profile->_number_workers) {
+        free(profile->_workers);
+        profile->_workers = (ProfileCounters*) malloc(number_workers * sizeof(ProfileCounters));
+    }
+    if (number_tiles > profile->_capacity_tiles) {
+        free(profile->_tiles);
+        profile->_tiles = (TileProfile*) malloc(number_tiles * sizeof(TileProfile));
+        profile->_capacity_tiles = number_tiles;
+    }
+    if (!profile->_workers || !profile->_tiles) {
+        printf("Error: Couldn't allocate memory for the profile of %d tiles\n", number_tiles);
+        exit(1);
+    }
+
+    profile->_width = width;
+    profile->_height = height;
+    profile->_number_workers = number_workers;
+    memset(profile->_workers, 0, number_workers * sizeof(ProfileCounters));
+    profile->_number_tiles = 0;
+
+    profile->_ticks = 0;
+    profile->_seconds = 0.0;
+    profile->_start_seconds = getSeconds();
+    profile->_start_ticks = getProfileTicks();
+}
+
+
+void endFrameProfile(FrameProfile* profile) {
+    profile->_ticks = getProfileTicks() - profile->_start_ticks;
+    profile->_seconds = getSeconds() - profile->_start_seconds;
+}
+
+
+void beginTileProfile(ProfileCounters* start) {
+    *start = g_profile_thread;
+}
+
+
+void endTileProfile(FrameProfile* profile, const Tile* tile, const ProfileCounters* start) {
+    ProfileCounters counters;
+    int worker_id = getTileWorker();
+    int idx = __sync_fetch_and_add(&profile->_number_tiles, 1);
+    int k;
+
+    for (k = 0; k < PROFILE_NUMBER_COUNTERS; k++) {
+        counters._counts[k] = g_profile_thread._counts[k] - start->_counts[k];
+    }
+    for (k = 0; k < PROFILE_NUMBER_TIMERS; k++) {
+        counters._ticks[k] = g_profile_thread._ticks[k] - start->_ticks[k];
+    }
+
+    // more workers or tiles than announced are left out of the report
+    if (worker_id < profile->_number_workers) {
+        ProfileCounters* worker = &profile->_workers[worker_id];
+
+        for (k = 0; k < PROFILE_NUMBER_COUNTERS; k++) worker->_counts[k] += counters._counts[k];
+        for (k = 0; k < PROFILE_NUMBER_TIMERS; k++) worker->_ticks[k] += counters._ticks[k];
+    }
+    if (idx < profile->_capacity_tiles) {
+        profile->_tiles[idx]._tile = *tile;
+        profile->_tiles[idx]._worker = worker_id;
+        profile->_tiles[idx]._counters = counters;
+    }
+}
+
+
+void sumFrameProfile(const FrameProfile* profile, ProfileCounters* total) {
+    int w;
+    int k;
+
+    memset(total, 0, sizeof(ProfileCounters));
+    for (w = 0; w < profile->_number_workers; w++) {
+        for (k = 0; k < PROFILE_NUMBER_COUNTERS; k++) {
+            total->_counts[k] += profile->_workers[w]._counts[k];
+        }
+        for (k = 0; k < PROFILE_NUMBER_TIMERS; k++) {
+            total->_ticks[k] += profile->_workers[w]._ticks[k];
+        }
+    }
+}
+
+
+// Number of tiles recorded (endTileProfile counts the ones it drops)
+static int recordedTiles(const FrameProfile* profile) {
+    return profile->_number_tiles < profile->_capacity_tiles ? profile->_number_tiles
+                                                             : profile->_capacity_tiles;
+}
+
+
+static double secondsPerTick(const FrameProfile* profile) {
+    return profile->_ticks > 0 ? profile->_seconds / profile->_ticks : 0.0;
+}
+
+
+// Counters as the members of a JSON object
+static void writeCountersJSON(const FrameProfile* profile, const ProfileCounters* counters,
+                              FILE* f) {
+    double scale = secondsPerTick(profile);
+    int k;
+
+    for (k = 0; k < PROFILE_NUMBER_COUNTERS; k++) {
+        fprintf(f, "%s\"%s\": %llu", k > 0 ? ", " : "", g_counter_names[k], counters->_counts[k]);
+    }
+    for (k = 0; k < PROFILE_NUMBER_TIMERS; k++) {
+        fprintf(f, ", \"%s\": %.6f", g_timer_names[k], scale * counters->_ticks[k]);
+    }
+}
+
+
+void writeProfileJSON(const FrameProfile* profile, FILE* f) {
+    ProfileCounters total;
+    int number_tiles = recordedTiles(profile);
+    int w;
+    int t;
+
+    sumFrameProfile(profile, &total);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n", profile->_width, profile->_height);
+    fprintf(f, "  \"seconds\": %.6f,\n", profile->_seconds);
+    fprintf(f, "  \"ticks_per_second\": %.0f,\n",
+            profile->_seconds > 0.0 ? profile->_ticks / profile->_seconds : 0.0);
+
+    fprintf(f, "  \"total\": {");
+    writeCountersJSON(profile, &total, f);
+    fprintf(f, "},\n");
+
+    fprintf(f, "  \"workers\": [\n");
+    for (w = 0; w < profile->_number_workers; w++) {
+        fprintf(f, "    {\"worker\": %d, ", w);
+        writeCountersJSON(profile, &profile->_workers[w], f);
+        fprintf(f, "}%s\n", w + 1 < profile->_number_workers ? "," : "");
+    }
+    fprintf(f, "  ],\n");
+
+    fprintf(f, "  \"tiles\": [\n");
+    for (t = 0; t < number_tiles; t++) {
+        const TileProfile* record = &profile->_tiles[t];
+
+        fprintf(f, "    {\"x0\": %d, \"y0\": %d, \"x1\": %d, \"y1\": %d, \"worker\": %d, ",
+                record->_tile._x0, record->_tile._y0, record->_tile._x1, record->_tile._y1,
+                record->_worker);
+        writeCountersJSON(profile, &record->_counters, f);
+        fprintf(f, "}%s\n", t + 1 < number_tiles ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+}
+
+
+// Counters as the last fields of a CSV line
+static void writeCountersCSV(const FrameProfile* profile, const ProfileCounters* counters,
+                             FILE* f) {
+    double scale = secondsPerTick(profile);
+    int k;
+
+    for (k = 0; k < PROFILE_NUMBER_COUNTERS; k++) {
+        fprintf(f, ",%llu", counters->_counts[k]);
+    }
+    for (k = 0; k < PROFILE_NUMBER_TIMERS; k++) {
+        fprintf(f, ",%.6f", scale * counters->_ticks[k]);
+    }
+    fprintf(f, "\n");
+}
+
+
+void writeProfileCSV(const FrameProfile* profile, FILE* f) {
+    ProfileCounters total;
+    int number_tiles = recordedTiles(profile);
+    int k;
+    int w;
+    int t;
+
+    sumFrameProfile(profile, &total);
+
+    // the frame and the workers cover the whole image
+    fprintf(f, "kind,worker,x0,y0,x1,y1");
+    for (k = 0; k < PROFILE_NUMBER_COUNTERS; k++) fprintf(f, ",%s", g_counter_names[k]);
+    for (k = 0; k < PROFILE_NUMBER_TIMERS; k++) fprintf(f, ",%s", g_timer_names[k]);
+    fprintf(f, "\n");
+
+    fprintf(f, "frame,,0,0,%d,%d", profile->_width, profile->_height);
+    writeCountersCSV(profile, &total, f);
+    for (w = 0; w < profile->_number_workers; w++) {
+        fprintf(f, "worker,%d,0,0,%d,%d", w, profile->_width, profile->_height);
+        writeCountersCSV(profile, &profile->_workers[w], f);
+    }
+    for (t = 0; t < number_tiles; t++) {
+        const TileProfile* record = &profile->_tiles[t];
+
+        fprintf(f, "tile,%d,%d,%d,%d,%d", record->_worker,
+                record->_tile._x0, record->_tile._y0, record->_tile._x1, record->_tile._y1);
+        writeCountersCSV(profile, &record->_counters, f);
+    }
+}
+
+
+// Time per pixel of a tile, in ticks
+static double tileCost(const TileProfile* record) {
+    int pixels = (record->_tile._x1 - record->_tile._x0) * (record->_tile._y1 - record->_tile._y0);
+
+    return pixels > 0 ? (double) record->_counters._ticks[PROFILE_TILE_TIME] / pixels : 0.0;
+}
+
+
+void drawProfileHeatmap(const FrameProfile* profile, unsigned char* rgb) {
+    int number_tiles = recordedTiles(profile);
+    double max_cost = 0.0;
+    int t;
+
+    memset(rgb, 0, (size_t) 3 * profile->_width * profile->_height);
+
+    for (t = 0; t < number_tiles; t++) {
+        double cost = tileCost(&profile->_tiles[t]);
+        if (cost > max_cost) max_cost = cost;
+    }
+    if (max_cost <= 0.0) return;
+
+    for (t = 0; t < number_tiles; t++) {
+        const Tile* tile = &profile->_tiles[t]._tile;
+        // black to red, red to yellow, yellow to white
+        double x = 3.0 * tileCost(&profile->_tiles[t]) / max_cost;
+        unsigned char r = (unsigned char) (255.0 * (x < 1.0 ? x : 1.0));
+        unsigned char g = (unsigned char) (255.0 * (x < 1.0 ? 0.0 : x < 2.0 ? x - 1.0 : 1.0));
+        unsigned char b = (unsigned char) (255.0 * (x < 2.0 ? 0.0 : x - 2.0));
+        int i;
+        int j;
+
+        for (i = tile->_y0; i < tile->_y1 && i < profile->_height; i++) {
+            unsigned char* row = rgb + (size_t) 3 * (profile->_height - 1 - i) * profile->_width;
+
+            for (j = tile->_x0; j < tile->_x1 && j < profile->_width; j++) {
+                row[3 * j] = r;
+                row[3 * j + 1] = g;
+                row[3 * j + 2] = b;
+            }
+        }
+    }
+}
+
+
+void freeFrameProfile(FrameProfile* profile) {
+    free(profile->_workers);
+    free(profile->_tiles);
+    initFrameProfile(profile);
+}
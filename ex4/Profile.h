@@ -0,0 +1,142 @@
+#include <stdio.h>
+
+#include "TileScheduler.h"
+
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+
+// Profiling counters of the ray tracer, to see where a frame spends its
+// time. They are only compiled in with -DRAYTRACE_PROFILE (make
+// CFLAGS=-DRAYTRACE_PROFILE): otherwise the PROFILE_ macros expand to
+// nothing and the renders run as fast as before.
+// Each thread counts into its own counters, with no locks or shared
+// cache lines. At the end of each tile, the counts of the tile are
+// added to those of the worker that rendered it (see getTileWorker)
+// and kept with the tile.
+
+
+// Counters. Primary rays include the anti-aliasing samples; tests
+// count one ray against one object. A BVH node visited by a packet of
+// primary rays counts once.
+#define PROFILE_PRIMARY_RAYS 0
+#define PROFILE_SECONDARY_RAYS 1
+#define PROFILE_SHADOW_RAYS 2
+#define PROFILE_SPHERE_TESTS 3
+#define PROFILE_TRIANGLE_TESTS 4
+#define PROFILE_SHAPE_TESTS 5
+#define PROFILE_BVH_NODES 6
+#define PROFILE_NUMBER_COUNTERS 7
+
+// Timers: whole tiles, shading (lighting and shadow rays) and post
+// processing (tone mapping and storing the pixels), in ticks of
+// getProfileTicks
+#define PROFILE_TILE_TIME 0
+#define PROFILE_SHADING_TIME 1
+#define PROFILE_POST_PROCESS_TIME 2
+#define PROFILE_NUMBER_TIMERS 3
+
+
+struct _ProfileCounters {
+    unsigned long long _counts[PROFILE_NUMBER_COUNTERS];
+    unsigned long long _ticks[PROFILE_NUMBER_TIMERS];
+};
+
+typedef struct _ProfileCounters ProfileCounters;
+
+
+// Counters of one tile (in frame coordinates, row 0 at the bottom)
+struct _TileProfile {
+    Tile _tile;
+    int _worker;
+    ProfileCounters _counters;
+};
+
+typedef struct _TileProfile TileProfile;
+
+
+// Counters of one frame: per worker and per tile, with the frame time
+// on the tick clock and on the wall clock (their ratio converts ticks
+// to seconds)
+struct _FrameProfile {
+    int _width;
+    int _height;
+
+    int _number_workers;
+    ProfileCounters* _workers;
+
+    // Filled concurrently by the workers
+    int _number_tiles;
+    int _capacity_tiles;
+    TileProfile* _tiles;
+
+    unsigned long long _ticks;
+    double _seconds;
+    unsigned long long _start_ticks;
+    double _start_seconds;
+};
+
+typedef struct _FrameProfile FrameProfile;
+
+
+// Counters of the calling thread
+extern __thread ProfileCounters g_profile_thread;
+
+#ifdef RAYTRACE_PROFILE
+
+#define PROFILE_COUNT(counter, n) (g_profile_thread._counts[counter] += (n))
+#define PROFILE_START(name) unsigned long long name = getProfileTicks()
+#define PROFILE_STOP(timer, name) (g_profile_thread._ticks[timer] += getProfileTicks() - (name))
+
+#else
+
+#define PROFILE_COUNT(counter, n) ((void) 0)
+#define PROFILE_START(name)
+#define PROFILE_STOP(timer, name) ((void) 0)
+
+#endif
+
+
+// Current time in ticks: CPU cycles where the time stamp counter can
+// be read, nanoseconds otherwise
+unsigned long long getProfileTicks(void);
+
+// Empty profile
+void initFrameProfile(FrameProfile* profile);
+
+// Clear the counters and start the clocks of a width by height frame
+// rendered by at most number_workers workers in at most number_tiles
+// tiles
+void beginFrameProfile(FrameProfile* profile, int width, int height,
+                       int number_workers, int number_tiles);
+
+// Stop the clocks
+void endFrameProfile(FrameProfile* profile);
+
+// Snapshot of the counters of the calling thread, to be given to
+// endTileProfile
+void beginTileProfile(ProfileCounters* start);
+
+// Add the counts of the calling thread since beginTileProfile to the
+// worker running it and record them for tile (safe to call from every
+// worker at once)
+void endTileProfile(FrameProfile* profile, const Tile* tile, const ProfileCounters* start);
+
+// Sum of the counters of every worker
+void sumFrameProfile(const FrameProfile* profile, ProfileCounters* total);
+
+// Write the report of the frame: totals, workers and tiles as JSON, or
+// one line per worker and per tile as CSV. Times are in seconds.
+void writeProfileJSON(const FrameProfile* profile, FILE* f);
+void writeProfileCSV(const FrameProfile* profile, FILE* f);
+
+// Draw the time spent per pixel in each tile, from black (none) to
+// white (the most expensive tile) through red and yellow, as 3 *
+// width * height bytes of RGB, row 0 at the top
+void drawProfileHeatmap(const FrameProfile* profile, unsigned char* rgb);
+
+// Free memory used by the profile
+void freeFrameProfile(FrameProfile* profile);
+
+#endif
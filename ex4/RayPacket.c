@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "RayPacket.h"
+#include "Profile.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+#ifdef HAVE_X86_KERNELS
+
+// The kernels are compiled for their own instruction set with the
+// target attribute; the rest of the program keeps the default flags.
+// AVX-512 implies FMA: contracting a * b + c would change the rounding
+// and break the equality with the scalar code, so it is turned off.
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// 4 rays (2x2), SSE4.1
+#define KERNEL_NAME tracePacketSSE
+#define KERNEL_TARGET __attribute__((target("sse4.1")))
+#define VF __m128
+#define VI __m128i
+#define MASK __m128
+#define SET1(x) _mm_set1_ps(x)
+#define ISET1(x) _mm_set1_epi32(x)
+#define LOADU(p) _mm_loadu_ps(p)
+#define STOREU(p, a) _mm_storeu_ps(p, a)
+#define ISTOREU(p, a) _mm_storeu_si128((__m128i*) (p), a)
+#define ADD(a, b) _mm_add_ps(a, b)
+#define SUB(a, b) _mm_sub_ps(a, b)
+#define MUL(a, b) _mm_mul_ps(a, b)
+#define DIV(a, b) _mm_div_ps(a, b)
+#define SQRT(a) _mm_sqrt_ps(a)
+#define MIN(a, b) _mm_min_ps(a, b)
+#define MAX(a, b) _mm_max_ps(a, b)
+#define CMP_LT(a, b) _mm_cmplt_ps(a, b)
+#define CMP_LE(a, b) _mm_cmple_ps(a, b)
+#define CMP_GE(a, b) _mm_cmpge_ps(a, b)
+#define CMP_EQ(a, b) _mm_cmpeq_ps(a, b)
+#define ICMP_LT(a, b) _mm_castsi128_ps(_mm_cmplt_epi32(a, b))
+#define MASK_AND(a, b) _mm_and_ps(a, b)
+#define MASK_OR(a, b) _mm_or_ps(a, b)
+#define MASK_ANY(m) (_mm_movemask_ps(m) != 0)
+#define BLEND(m, a, b) _mm_blendv_ps(a, b, m)
+#define IBLEND(m, a, b) _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), m))
+#include "RayPacketKernel.h"
+
+
+// 8 rays (4x2), AVX2
+#define KERNEL_NAME tracePacketAVX2
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#define VF __m256
+#define VI __m256i
+#define MASK __m256
+#define SET1(x) _mm256_set1_ps(x)
+#define ISET1(x) _mm256_set1_epi32(x)
+#define LOADU(p) _mm256_loadu_ps(p)
+#define STOREU(p, a) _mm256_storeu_ps(p, a)
+#define ISTOREU(p, a) _mm256_storeu_si256((__m256i*) (p), a)
+#define ADD(a, b) _mm256_add_ps(a, b)
+#define SUB(a, b) _mm256_sub_ps(a, b)
+#define MUL(a, b) _mm256_mul_ps(a, b)
+#define DIV(a, b) _mm256_div_ps(a, b)
+#define SQRT(a) _mm256_sqrt_ps(a)
+#define MIN(a, b) _mm256_min_ps(a, b)
+#define MAX(a, b) _mm256_max_ps(a, b)
+#define CMP_LT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define CMP_LE(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define CMP_GE(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define CMP_EQ(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define ICMP_LT(a, b) _mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a))
+#define MASK_AND(a, b) _mm256_and_ps(a, b)
+#define MASK_OR(a, b) _mm256_or_ps(a, b)
+#define MASK_ANY(m) (_mm256_movemask_ps(m) != 0)
+#define BLEND(m, a, b) _mm256_blendv_ps(a, b, m)
+#define IBLEND(m, a, b) _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), m))
+#include "RayPacketKernel.h"
+
+
+// 16 rays (4x4), AVX-512
+#define KERNEL_NAME tracePacketAVX512
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#define VF __m512
+#define VI __m512i
+#define MASK __mmask16
+#define SET1(x) _mm512_set1_ps(x)
+#define ISET1(x) _mm512_set1_epi32(x)
+#define LOADU(p) _mm512_loadu_ps(p)
+#define STOREU(p, a) _mm512_storeu_ps(p, a)
+#define ISTOREU(p, a) _mm512_storeu_si512((void*) (p), a)
+#define ADD(a, b) _mm512_add_ps(a, b)
+#define SUB(a, b) _mm512_sub_ps(a, b)
+#define MUL(a, b) _mm512_mul_ps(a, b)
+#define DIV(a, b) _mm512_div_ps(a, b)
+#define SQRT(a) _mm512_sqrt_ps(a)
+#define MIN(a, b) _mm512_min_ps(a, b)
+#define MAX(a, b) _mm512_max_ps(a, b)
+#define CMP_LT(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#define CMP_LE(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ)
+#define CMP_GE(a, b) _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ)
+#define CMP_EQ(a, b) _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ)
+#define ICMP_LT(a, b) _mm512_cmplt_epi32_mask(a, b)
+#define MASK_AND(a, b) ((__mmask16) ((a) & (b)))
+#define MASK_OR(a, b) ((__mmask16) ((a) | (b)))
+#define MASK_ANY(m) ((m) != 0)
+#define BLEND(m, a, b) _mm512_mask_blend_ps(m, a, b)
+#define IBLEND(m, a, b) _mm512_mask_blend_epi32(m, a, b)
+#include "RayPacketKernel.h"
+
+#endif
+
+
+int getBestPacketSize(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return PACKET_AVX512;
+    if (__builtin_cpu_supports("avx2")) return PACKET_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return PACKET_SSE;
+#endif
+    return PACKET_SCALAR;
+}
+
+
+void tracePacket(const Scene* scene, int size, Vector3 origin,
+                 const float* dir_x, const float* dir_y, const float* dir_z,
+                 int* hit_k, float* hit_t) {
+#ifdef HAVE_X86_KERNELS
+    switch (size) {
+        case PACKET_SSE:
+            tracePacketSSE(scene, origin, dir_x, dir_y, dir_z, hit_k, hit_t);
+            return;
+        case PACKET_AVX2:
+            tracePacketAVX2(scene, origin, dir_x, dir_y, dir_z, hit_k, hit_t);
+            return;
+        case PACKET_AVX512:
+            tracePacketAVX512(scene, origin, dir_x, dir_y, dir_z, hit_k, hit_t);
+            return;
+    }
+#endif
+    printf("Error: Packets of %d rays are not supported on this CPU\n", size);
+    exit(1);
+}
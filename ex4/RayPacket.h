@@ -0,0 +1,38 @@
+#include "Scene.h"
+
+
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+
+// Number of rays traced together by the packet kernels.
+// The rays of a packet cover a block of PACKET_WIDTH_X(w) by
+// PACKET_WIDTH_Y(w) pixels.
+#define PACKET_SCALAR 1   // one ray at a time
+#define PACKET_SSE 4      // 2x2 rays, SSE4.1
+#define PACKET_AVX2 8     // 4x2 rays, AVX2
+#define PACKET_AVX512 16  // 4x4 rays, AVX-512
+
+#define MAX_PACKET_SIZE 16
+
+#define PACKET_WIDTH_X(w) ((w) >= 8 ? 4 : ((w) >= 4 ? 2 : 1))
+#define PACKET_WIDTH_Y(w) ((w) / PACKET_WIDTH_X(w))
+
+
+// Return the widest packet supported by the CPU we are running on
+int getBestPacketSize(void);
+
+// Find the closest sphere hit by each ray of a packet of size rays
+// (PACKET_SSE, PACKET_AVX2 or PACKET_AVX512, supported by the CPU)
+// sharing the same origin. Directions are given as separate x/y/z
+// arrays of size floats.
+// hit_t[l] gives the distance up to which ray l looks for hits
+// (FLT_MAX for no limit, shorter for shadow rays). For ray l, hit_k[l]
+// is then the entry of the sphere in scene->_soa (-1 if there is no
+// hit) and hit_t[l] the distance to the hit (unchanged if there is
+// none). The result is the same as tracing the rays one by one.
+void tracePacket(const Scene* scene, int size, Vector3 origin,
+                 const float* dir_x, const float* dir_y, const float* dir_z,
+                 int* hit_k, float* hit_t);
+
+#endif
@@ -0,0 +1,130 @@
+// Body of a packet kernel, included once per instruction set by
+// RayPacket.c. The includer defines KERNEL_NAME, KERNEL_TARGET and the
+// vector macros (VF, VI, MASK, SET1, ADD, ...) before including it.
+//
+// Every lane repeats the operations of hitSphere (SphereSoA.c) and
+// hitBox (RayTrace.c) in the same order, so each ray gets exactly the
+// hit the scalar code would find.
+
+
+static KERNEL_TARGET void
+KERNEL_NAME(const Scene* scene, Vector3 origin,
+            const float* dir_x, const float* dir_y, const float* dir_z,
+            int* hit_k, float* hit_t) {
+    const BVH* bvh = &scene->_bvh;
+    const SphereSoA* soa = &scene->_soa;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    int dir_neg[3];
+
+    VF zero = SET1(0.0f);
+    VF dx = LOADU(dir_x);
+    VF dy = LOADU(dir_y);
+    VF dz = LOADU(dir_z);
+
+    VF inv_x = DIV(SET1(1.0f), dx);
+    VF inv_y = DIV(SET1(1.0f), dy);
+    VF inv_z = DIV(SET1(1.0f), dz);
+
+    VF best_t = LOADU(hit_t);
+    VI best_i = ISET1(-1);
+    VI best_k = ISET1(-1);
+
+    // the rays are coherent: order the children using the first ray
+    dir_neg[0] = dir_x[0] < 0.0f;
+    dir_neg[1] = dir_y[0] < 0.0f;
+    dir_neg[2] = dir_z[0] < 0.0f;
+
+    if (bvh->_number_nodes > 0) stack[top++] = 0;
+
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode* node = &bvh->_nodes[node_idx];
+
+        // visit the node if at least one ray enters its box
+        VF tx0 = MUL(SET1(node->_lower_bound._x - origin._x), inv_x);
+        VF tx1 = MUL(SET1(node->_upper_bound._x - origin._x), inv_x);
+        VF ty0 = MUL(SET1(node->_lower_bound._y - origin._y), inv_y);
+        VF ty1 = MUL(SET1(node->_upper_bound._y - origin._y), inv_y);
+        VF tz0 = MUL(SET1(node->_lower_bound._z - origin._z), inv_z);
+        VF tz1 = MUL(SET1(node->_upper_bound._z - origin._z), inv_z);
+
+        VF t_near = MAX(MAX(MIN(tx0, tx1), MIN(ty0, ty1)), MIN(tz0, tz1));
+        VF t_far = MIN(MIN(MAX(tx0, tx1), MAX(ty0, ty1)), MAX(tz0, tz1));
+
+        MASK enter = MASK_AND(MASK_AND(CMP_LE(t_near, t_far), CMP_GE(t_far, zero)),
+                              CMP_LE(t_near, best_t));
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!MASK_ANY(enter)) continue;
+
+        if (node->_count > 0) {
+            int k;
+            PROFILE_COUNT(PROFILE_SPHERE_TESTS, node->_count * (int) (sizeof(VF) / sizeof(float)));
+            for (k = node->_offset; k < node->_offset + node->_count; k++) {
+                // the rays share their origin: so does oc
+                VF ocx = SET1(soa->_center_x[k] - origin._x);
+                VF ocy = SET1(soa->_center_y[k] - origin._y);
+                VF ocz = SET1(soa->_center_z[k] - origin._z);
+
+                VF tca = ADD(ADD(MUL(ocx, dx), MUL(ocy, dy)), MUL(ocz, dz));
+                VF lx = SUB(ocx, MUL(tca, dx));
+                VF ly = SUB(ocy, MUL(tca, dy));
+                VF lz = SUB(ocz, MUL(tca, dz));
+                VF l2 = ADD(ADD(MUL(lx, lx), MUL(ly, ly)), MUL(lz, lz));
+
+                VF thc = SQRT(SUB(SET1(soa->_radius_squared[k]), l2));
+                VF t0 = SUB(tca, thc);
+                VF t1 = ADD(tca, thc);
+                VF t = BLEND(CMP_GE(t0, zero), t1, t0);
+                VI idx = ISET1(soa->_index[k]);
+
+                // on a tie keep the lowest index, as hitScene does
+                MASK closer = MASK_OR(CMP_LT(t, best_t),
+                                      MASK_AND(CMP_EQ(t, best_t), ICMP_LT(idx, best_i)));
+                MASK update = MASK_AND(CMP_GE(t, zero), closer);
+
+                best_t = BLEND(update, best_t, t);
+                best_i = IBLEND(update, best_i, idx);
+                best_k = IBLEND(update, best_k, ISET1(k));
+            }
+        } else if (dir_neg[node->_axis]) {
+            stack[top++] = node_idx + 1;
+            stack[top++] = node->_offset;
+        } else {
+            stack[top++] = node->_offset;
+            stack[top++] = node_idx + 1;
+        }
+    }
+
+    STOREU(hit_t, best_t);
+    ISTOREU(hit_k, best_k);
+}
+
+
+#undef KERNEL_NAME
+#undef KERNEL_TARGET
+#undef VF
+#undef VI
+#undef MASK
+#undef SET1
+#undef ISET1
+#undef LOADU
+#undef STOREU
+#undef ISTOREU
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef SQRT
+#undef MIN
+#undef MAX
+#undef CMP_LT
+#undef CMP_LE
+#undef CMP_GE
+#undef CMP_EQ
+#undef ICMP_LT
+#undef MASK_AND
+#undef MASK_OR
+#undef MASK_ANY
+#undef BLEND
+#undef IBLEND
@@ -1,320 +1,2474 @@
-#ifdef __APPLE__
-
-#include <GLUT/glut.h>
-
-#else
-
-#include <GL/glut.h>
-
-#endif
-
 #include <math.h>
 #include <float.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "Scene.h"
 #include "RayTrace.h"
 #include "Geometry.h"
+#include "TileScheduler.h"
+#include "Camera.h"
+#include "RayPacket.h"
+#include "ToneMap.h"
+#include "Profile.h"
+
 
+// Check if the ray (origin, 1 / inv_direction) enters the box of node
+// at a distance in [0, t_max].
+static int
+hitBox(Vector3 origin, Vector3 inv_direction, const BVHNode *node, float t_max) {
+    float tx0 = (node->_lower_bound._x - origin._x) * inv_direction._x;
+    float tx1 = (node->_upper_bound._x - origin._x) * inv_direction._x;
+    float ty0 = (node->_lower_bound._y - origin._y) * inv_direction._y;
+    float ty1 = (node->_upper_bound._y - origin._y) * inv_direction._y;
+    float tz0 = (node->_lower_bound._z - origin._z) * inv_direction._z;
+    float tz1 = (node->_upper_bound._z - origin._z) * inv_direction._z;
+
+    float t_near = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fminf(tz0, tz1));
+    float t_far = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fmaxf(tz0, tz1));
 
-// Clamp c's entries between low and high.
-static void clamp(Color *c, float low, float high) {
-    c->_red = fminf(fmaxf(c->_red, low), high);
-    c->_green = fminf(fmaxf(c->_green, low), high);
-    c->_blue = fminf(fmaxf(c->_blue, low), high);
+    return t_near <= t_far && t_far >= 0.0f && t_near <= t_max;
 }
 
 
-// Complete
-// Given a ray (origin, direction), check if it intersects a given
-// sphere.
-// Return 1 if there is an intersection, 0 otherwise.
-// *t contains the distance to the closest intersection point, if any.
+// Find the closest sphere hit by the ray (origin, direction) at a
+// distance below *t_min.
+// Return its entry in scene->_soa (and scene->_materials), or -1 if
+// there is no such hit.
+// *t_min is set to the distance to the intersection point, if any.
 static int
-hitSphere(Vector3 origin, Vector3 direction, Sphere sphere, float *t) {
+closestHitSpheres(Vector3 origin, Vector3 direction, const Scene *scene, float *t_min) {
     Vector3 o = origin;
     Vector3 d = direction;
-    Vector3 c = sphere._center;
-    float r = sphere._radius;
-
-    float oDotd ;
-    computeDotProduct(o,d, &oDotd);
-    float dDotc;
-    computeDotProduct(d,c, &dDotc);
-    float oDotc;
-    computeDotProduct(o,c, &oDotc);
-    float oDoto;
-    computeDotProduct(o,o, &oDoto);
-    float cDotc;
-    computeDotProduct(c,c, &cDotc);
-    float rDotr = r*r;
-    float a;
-    a= sqrtf((oDotd-dDotc)*(oDotd-dDotc) + 2 * oDotc - oDoto - cDotc + rDotr);
-    *t = -oDotd + dDotc - a;
-    if(*t>=0) {
-        return 1;
+
+    int hit_k = -1;
+
+    const BVH *bvh = &scene->_bvh;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+
+    if (bvh->_number_nodes == 0) return -1;
+
+    Vector3 inv_d;
+    inv_d._x = 1.0f / d._x;
+    inv_d._y = 1.0f / d._y;
+    inv_d._z = 1.0f / d._z;
+
+    // Walk the hierarchy, nearest child first, and test the spheres
+    // of the leaves whose box is hit before the closest hit so far
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode *node = &bvh->_nodes[node_idx];
+
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!hitBox(o, inv_d, node, *t_min)) continue;
+
+        if (node->_count > 0) {
+            int end = node->_offset + node->_count;
+            int k;
+            PROFILE_COUNT(PROFILE_SPHERE_TESTS, node->_count);
+            for (k = node->_offset; k < end; k += SOA_WIDTH) {
+                int count = end - k < SOA_WIDTH ? end - k : SOA_WIDTH;
+                closestHitSphereSoA(&scene->_soa, o, d, k, count, t_min, &hit_k);
+            }
+        } else {
+            float d_axis = node->_axis == 0 ? d._x : (node->_axis == 1 ? d._y : d._z);
+            if (d_axis < 0.0f) {
+                stack[top++] = node_idx + 1;
+                stack[top++] = node->_offset;
+            } else {
+                stack[top++] = node->_offset;
+                stack[top++] = node_idx + 1;
+            }
+        }
+    }
+
+    return hit_k;
+}
+
+
+// Find the closest triangle hit by the ray (origin, direction) at a
+// distance below *t_min, as closestHitSpheres.
+// Return its entry in scene->_triangles, or -1 if there is no such hit.
+static int
+closestHitTriangles(Vector3 origin, Vector3 direction, const Scene *scene, float *t_min) {
+    const BVH *bvh = &scene->_triangle_bvh;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    int hit_k = -1;
+
+    if (bvh->_number_nodes == 0) return -1;
+
+    TriangleRay ray;
+    initTriangleRay(&ray, origin, direction);
+
+    Vector3 inv_d;
+    inv_d._x = 1.0f / direction._x;
+    inv_d._y = 1.0f / direction._y;
+    inv_d._z = 1.0f / direction._z;
+
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode *node = &bvh->_nodes[node_idx];
+
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!hitBox(origin, inv_d, node, *t_min)) continue;
+
+        if (node->_count > 0) {
+            int end = node->_offset + node->_count;
+            int k;
+            PROFILE_COUNT(PROFILE_TRIANGLE_TESTS, node->_count);
+            for (k = node->_offset; k < end; k += SOA_WIDTH) {
+                int count = end - k < SOA_WIDTH ? end - k : SOA_WIDTH;
+                closestHitTriangleSoA(&scene->_triangles, &ray, k, count, t_min, &hit_k);
+            }
+        } else {
+            float d_axis = node->_axis == 0 ? direction._x
+                                            : (node->_axis == 1 ? direction._y : direction._z);
+            if (d_axis < 0.0f) {
+                stack[top++] = node_idx + 1;
+                stack[top++] = node->_offset;
+            } else {
+                stack[top++] = node->_offset;
+                stack[top++] = node_idx + 1;
+            }
+        }
+    }
+
+    return hit_k;
+}
+
+
+// Distance along the ray (origin, direction) to shape, negative if
+// the ray misses it. A ray starting inside a box hits it on the way
+// out.
+static float
+hitShape(const Shape *shape, Vector3 origin, Vector3 direction) {
+    if (shape->_type == SHAPE_PLANE) {
+        const Plane *plane = &shape->_geometry._plane;
+        float n_dot_d;
+        float n_dot_o;
+
+        computeDotProduct(plane->_normal, direction, &n_dot_d);
+        if (n_dot_d == 0.0f) return -1.0f;
+        computeDotProduct(plane->_normal, origin, &n_dot_o);
+
+        return (plane->_offset - n_dot_o) / n_dot_d;
     } else {
-        return 0;
+        const AABB *box = &shape->_geometry._box;
+        float inv_x = 1.0f / direction._x;
+        float inv_y = 1.0f / direction._y;
+        float inv_z = 1.0f / direction._z;
+        float tx0 = (box->_lower_bound._x - origin._x) * inv_x;
+        float tx1 = (box->_upper_bound._x - origin._x) * inv_x;
+        float ty0 = (box->_lower_bound._y - origin._y) * inv_y;
+        float ty1 = (box->_upper_bound._y - origin._y) * inv_y;
+        float tz0 = (box->_lower_bound._z - origin._z) * inv_z;
+        float tz1 = (box->_upper_bound._z - origin._z) * inv_z;
+
+        float t_near = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fminf(tz0, tz1));
+        float t_far = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fmaxf(tz0, tz1));
+
+        if (t_near > t_far) return -1.0f;
+        return t_near >= 0.0f ? t_near : t_far;
+    }
+}
+
+
+// Find the closest shape hit by the ray (origin, direction) at a
+// distance below *t_min, as closestHitSpheres.
+// Return its index in scene->_shapes, or -1 if there is no such hit.
+static int
+closestHitShapes(Vector3 origin, Vector3 direction, const Scene *scene, float *t_min) {
+    int hit_k = -1;
+    int k;
+
+    PROFILE_COUNT(PROFILE_SHAPE_TESTS, scene->_number_shapes);
+    for (k = 0; k < scene->_number_shapes; k++) {
+        float t = hitShape(&scene->_shapes[k], origin, direction);
+        if (t >= 0.0f && t < *t_min) {
+            *t_min = t;
+            hit_k = k;
+        }
+    }
+
+    return hit_k;
+}
+
+
+// closestHitShapes for the size rays of a packet sharing their origin:
+// the part of the plane tests that only depends on the origin is done
+// once. Hits update hit_k (as an entry of closestHit) and hit_t.
+static void
+closestHitShapesPacket(const Scene *scene, int size, Vector3 origin,
+                       const float *dir_x, const float *dir_y, const float *dir_z,
+                       int *hit_k, float *hit_t) {
+    int first_entry = scene->_soa._count + scene->_triangles._count;
+    int k;
+    int l;
+
+    PROFILE_COUNT(PROFILE_SHAPE_TESTS, size * scene->_number_shapes);
+
+    for (k = 0; k < scene->_number_shapes; k++) {
+        const Shape *shape = &scene->_shapes[k];
+
+        if (shape->_type == SHAPE_PLANE) {
+            const Plane *plane = &shape->_geometry._plane;
+            float n_dot_o;
+
+            computeDotProduct(plane->_normal, origin, &n_dot_o);
+            for (l = 0; l < size; l++) {
+                float n_dot_d = plane->_normal._x * dir_x[l] + plane->_normal._y * dir_y[l]
+                                + plane->_normal._z * dir_z[l];
+                float t = (plane->_offset - n_dot_o) / n_dot_d;
+
+                if (n_dot_d != 0.0f && t >= 0.0f && t < hit_t[l]) {
+                    hit_t[l] = t;
+                    hit_k[l] = first_entry + k;
+                }
+            }
+        } else {
+            for (l = 0; l < size; l++) {
+                Vector3 direction;
+                float t;
+
+                direction._x = dir_x[l];
+                direction._y = dir_y[l];
+                direction._z = dir_z[l];
+                t = hitShape(shape, origin, direction);
+                if (t >= 0.0f && t < hit_t[l]) {
+                    hit_t[l] = t;
+                    hit_k[l] = first_entry + k;
+                }
+            }
+        }
     }
+}
 
 
+// The ray (origin, direction) in the object space of instance: its
+// origin, its unit direction, and the object length of a unit of world
+// length along it (distances along the ray are multiplied by scale)
+static void
+toObjectSpace(const Instance *instance, Vector3 origin, Vector3 direction,
+              Vector3 *object_origin, Vector3 *object_direction, float *scale) {
+    transformPoint(&instance->_inverse, origin, object_origin);
+    transformVector(&instance->_inverse, direction, object_direction);
+    computeNorm(*object_direction, scale);
+    mulAV(1.0f / *scale, *object_direction, object_direction);
 }
 
 
-// Check if the ray defined by (scene._camera, direction) is intersecting
-// any of the spheres defined in the scene.
-// Return 0 if there is no intersection, and 1 otherwise.
-//
-// If there is an intersection:
-// - the position of the intersection with the closest sphere is computed
-// in hit_pos
-// - the normal to the surface at the intersection point in hit_normal
-// - the diffuse color and specular color of the intersected sphere
-// in hit_color and hit_spec
+// Find the closest instance hit by the ray (origin, direction) at a
+// distance below *t_min, as closestHitSpheres: walk the top level
+// hierarchy, and the hierarchies of the prototype of each instance
+// whose box is hit, with the ray in object space.
+// Return its index in scene->_instances, or -1 if there is no such
+// hit. *hit_sub is set to the entry hit in the prototype (see
+// closestHit).
 static int
-hitScene(Vector3 origin, Vector3 direction, Scene scene,
-         Vector3 *hit_pos, Vector3 *hit_normal,
-         Color *hit_color, Color *hit_spec) {
-    Vector3 o = origin;
-    Vector3 d = direction;
+closestHitInstances(Vector3 origin, Vector3 direction, const Scene *scene, float *t_min,
+                    int *hit_sub) {
+    const BVH *bvh = &scene->_instance_bvh;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    int hit_i = -1;
+
+    if (bvh->_number_nodes == 0) return -1;
+
+    Vector3 inv_d;
+    inv_d._x = 1.0f / direction._x;
+    inv_d._y = 1.0f / direction._y;
+    inv_d._z = 1.0f / direction._z;
+
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode *node = &bvh->_nodes[node_idx];
+
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!hitBox(origin, inv_d, node, *t_min)) continue;
+
+        if (node->_count > 0) {
+            int k;
+            for (k = node->_offset; k < node->_offset + node->_count; k++) {
+                int i = bvh->_indices[k];
+                const Instance *instance = &scene->_instances[i];
+                const Scene *prototype = &scene->_prototypes[instance->_prototype];
+                Vector3 o;
+                Vector3 d;
+                float scale;
+                float t;
+                int sub;
+                int triangle_k;
+
+                toObjectSpace(instance, origin, direction, &o, &d, &scale);
+                t = *t_min * scale;
+                sub = closestHitSpheres(o, d, prototype, &t);
+                triangle_k = closestHitTriangles(o, d, prototype, &t);
+                if (triangle_k >= 0) sub = prototype->_soa._count + triangle_k;
+
+                if (sub >= 0) {
+                    *t_min = t / scale;
+                    *hit_sub = sub;
+                    hit_i = i;
+                }
+            }
+        } else {
+            float d_axis = node->_axis == 0 ? direction._x
+                                            : (node->_axis == 1 ? direction._y : direction._z);
+            if (d_axis < 0.0f) {
+                stack[top++] = node_idx + 1;
+                stack[top++] = node->_offset;
+            } else {
+                stack[top++] = node->_offset;
+                stack[top++] = node_idx + 1;
+            }
+        }
+    }
+
+    return hit_i;
+}
+
+
+// Find the closest object hit by the ray (origin, direction).
+// Return -1 if there is no hit. Otherwise, in order:
+// - entries [0, S) are spheres (entries in scene->_soa and
+//   scene->_materials), with S = scene->_soa._count
+// - entries [S, S + T) are triangles (entry S + k is entry k of
+//   scene->_triangles), with T = scene->_triangles._count
+// - entry S + T + k is shape k of scene->_shapes
+// - entry S + T + H + k is instance k of scene->_instances, with
+//   H = scene->_number_shapes; *hit_sub is then the entry hit in its
+//   prototype (a sphere or a triangle)
+// *t_hit contains the distance to the intersection point, if any.
+static int
+closestHit(Vector3 origin, Vector3 direction, const Scene *scene, float *t_hit,
+           int *hit_sub) {
+    int hit_k;
+    int triangle_k;
+    int shape_k;
+    int instance_k;
+
+    *t_hit = FLT_MAX;
+    hit_k = closestHitSpheres(origin, direction, scene, t_hit);
+
+    // later kinds must be strictly closer: ties go to the earlier kind
+    triangle_k = closestHitTriangles(origin, direction, scene, t_hit);
+    if (triangle_k >= 0) hit_k = scene->_soa._count + triangle_k;
+
+    shape_k = closestHitShapes(origin, direction, scene, t_hit);
+    if (shape_k >= 0) hit_k = scene->_soa._count + scene->_triangles._count + shape_k;
+
+    instance_k = closestHitInstances(origin, direction, scene, t_hit, hit_sub);
+    if (instance_k >= 0) {
+        hit_k = scene->_soa._count + scene->_triangles._count + scene->_number_shapes + instance_k;
+    }
+
+    return hit_k;
+}
+
 
-    float t_min = FLT_MAX;
-    int hit_idx = -1;
-    Sphere hit_sph;
+// Move hit_pos off the surface along normal (facing the ray) so that
+// rays leaving the surface do not hit it again; the move is saved in
+// offset
+static void offsetHitPosition(Vector3 *hit_pos, Vector3 normal, Vector3 *offset) {
+    float extent = fmaxf(fmaxf(fabsf(hit_pos->_x), fabsf(hit_pos->_y)), fabsf(hit_pos->_z));
 
-    // For each sphere in the scene
+    mulAV(1e-4f * (1.0f + extent), normal, offset);
+    add(*hit_pos, *offset, hit_pos);
+}
+
+
+// Same as computeHit for triangle k of scene->_triangles.
+// The normal interpolates the vertex normals of the mesh and faces the
+// ray: both sides of a triangle are lit. The position is moved off the
+// triangle along its geometric normal. The back side is the one the
+// winding of the vertices turns clockwise.
+static int
+computeTriangleHit(Vector3 origin, Vector3 direction, const Scene *scene,
+                   int k, float t,
+                   Vector3 *hit_pos, Vector3 *hit_normal, Vector3 *hit_offset,
+                   const Material **hit_material) {
+    const TriangleSoA *soa = &scene->_triangles;
+    const SceneMesh *scene_mesh = &scene->_meshes[soa->_mesh[k]];
+    const TriangleMesh *mesh = &scene_mesh->_mesh;
+    const Triple *triangle = &mesh->_triangles[soa->_triangle[k]];
+
+    TriangleRay ray;
+    float weights[3];
+    initTriangleRay(&ray, origin, direction);
+    getTriangleHitWeights(soa, &ray, k, weights);
+
+    Vector3 td;
+    mulAV(t, direction, &td);
+    add(origin, td, hit_pos);
+
+    // geometric normal, facing the ray
+    Vector3 p[3];
     int i;
-    for (i = 0; i < scene._number_spheres; ++i) {
-        Sphere curr = scene._spheres[i];
-        float t = 0.0f;
-        if (hitSphere(o, d, curr, &t)) {
-            if (t < t_min) {
-                hit_idx = i;
-                t_min = t;
-                hit_sph = curr;
+    for (i = 0; i < 3; i++) {
+        p[i]._x = soa->_vertices[i][0][k];
+        p[i]._y = soa->_vertices[i][1][k];
+        p[i]._z = soa->_vertices[i][2][k];
+    }
+
+    Vector3 e1, e2, g;
+    float d_dot_g;
+    sub(p[1], p[0], &e1);
+    sub(p[2], p[0], &e2);
+    computeCrossProduct(e1, e2, &g);
+    normalize(g, &g);
+    computeDotProduct(direction, g, &d_dot_g);
+    if (d_dot_g > 0.0f) mulAV(-1.0f, g, &g);
+
+    // shading normal, on the same side
+    Vector3 n0, n1, n2, n;
+    float n_dot_g;
+    mulAV(weights[0], mesh->_vertex_normals[triangle->_v0], &n0);
+    mulAV(weights[1], mesh->_vertex_normals[triangle->_v1], &n1);
+    mulAV(weights[2], mesh->_vertex_normals[triangle->_v2], &n2);
+    add(n0, n1, &n);
+    add(n, n2, &n);
+    normalize(n, &n);
+    computeDotProduct(n, g, &n_dot_g);
+    if (n_dot_g < 0.0f) mulAV(-1.0f, n, &n);
+    *hit_normal = n;
+
+    offsetHitPosition(hit_pos, g, hit_offset);
+
+    *hit_material = &scene_mesh->_material;
+
+    return d_dot_g > 0.0f;
+}
+
+
+// Same as computeTriangleHit for shape k of scene->_shapes. The normal
+// of a box is the one of the face closest to the hit point.
+static int
+computeShapeHit(Vector3 origin, Vector3 direction, const Scene *scene,
+                int k, float t,
+                Vector3 *hit_pos, Vector3 *hit_normal, Vector3 *hit_offset,
+                const Material **hit_material) {
+    const Shape *shape = &scene->_shapes[k];
+
+    Vector3 td;
+    mulAV(t, direction, &td);
+    add(origin, td, hit_pos);
+
+    Vector3 n;
+    if (shape->_type == SHAPE_PLANE) {
+        n = shape->_geometry._plane._normal;
+    } else {
+        const AABB *box = &shape->_geometry._box;
+        float lower[3];
+        float upper[3];
+        float p[3];
+        float best = FLT_MAX;
+        float normal[3] = {0.0f, 0.0f, 0.0f};
+        int a;
+
+        lower[0] = box->_lower_bound._x;
+        lower[1] = box->_lower_bound._y;
+        lower[2] = box->_lower_bound._z;
+        upper[0] = box->_upper_bound._x;
+        upper[1] = box->_upper_bound._y;
+        upper[2] = box->_upper_bound._z;
+        p[0] = hit_pos->_x;
+        p[1] = hit_pos->_y;
+        p[2] = hit_pos->_z;
+
+        for (a = 0; a < 3; a++) {
+            if (fabsf(p[a] - lower[a]) < best) {
+                best = fabsf(p[a] - lower[a]);
+                normal[0] = normal[1] = normal[2] = 0.0f;
+                normal[a] = -1.0f;
+            }
+            if (fabsf(p[a] - upper[a]) < best) {
+                best = fabsf(p[a] - upper[a]);
+                normal[0] = normal[1] = normal[2] = 0.0f;
+                normal[a] = 1.0f;
             }
         }
+
+        n._x = normal[0];
+        n._y = normal[1];
+        n._z = normal[2];
+    }
+
+    // face the ray
+    float d_dot_n;
+    computeDotProduct(direction, n, &d_dot_n);
+    if (d_dot_n > 0.0f) mulAV(-1.0f, n, &n);
+    *hit_normal = n;
+
+    offsetHitPosition(hit_pos, n, hit_offset);
+
+    *hit_material = &shape->_material;
+
+    return d_dot_n > 0.0f;
+}
+
+
+static int
+computeHit(Vector3 origin, Vector3 direction, const Scene *scene,
+           int hit_k, int hit_sub, float t,
+           Vector3 *hit_pos, Vector3 *hit_normal, Vector3 *hit_offset,
+           const Material **hit_material);
+
+
+// Same as computeTriangleHit for entry sub of the prototype of
+// instance k of scene->_instances: the hit is computed in object
+// space, and its normals taken back to the world
+static int
+computeInstanceHit(Vector3 origin, Vector3 direction, const Scene *scene,
+                   int k, int sub, float t,
+                   Vector3 *hit_pos, Vector3 *hit_normal, Vector3 *hit_offset,
+                   const Material **hit_material) {
+    const Instance *instance = &scene->_instances[k];
+    const Scene *prototype = &scene->_prototypes[instance->_prototype];
+    Vector3 o;
+    Vector3 d;
+    Vector3 object_pos;
+    Vector3 object_normal;
+    Vector3 object_offset;
+    Vector3 g;
+    float scale;
+    int back_side;
+
+    toObjectSpace(instance, origin, direction, &o, &d, &scale);
+    back_side = computeHit(o, d, prototype, sub, -1, t * scale,
+                           &object_pos, &object_normal, &object_offset, hit_material);
+
+    Vector3 td;
+    mulAV(t, direction, &td);
+    add(origin, td, hit_pos);
+
+    // normals (and the offset, along the geometric normal) go through
+    // the inverse transpose, which keeps them facing the ray
+    transformNormal(&instance->_inverse, object_normal, hit_normal);
+    normalize(*hit_normal, hit_normal);
+    transformNormal(&instance->_inverse, object_offset, &g);
+    normalize(g, &g);
+    offsetHitPosition(hit_pos, g, hit_offset);
+
+    return back_side;
+}
+
+
+// Given the entry hit_k (and hit_sub, see closestHit) hit by the ray
+// (origin, direction) at distance t, compute:
+// - the position of the intersection in hit_pos, moved off the surface
+//   towards the ray by hit_offset (rays going through the surface start
+//   from hit_pos - 2 * hit_offset)
+// - the normal to the surface at the intersection point, facing the
+//   ray, in hit_normal
+// - the material of the intersected object in hit_material
+// Return 1 if the ray hits the back side of the surface (from inside a
+// closed object), 0 otherwise.
+static int
+computeHit(Vector3 origin, Vector3 direction, const Scene *scene,
+           int hit_k, int hit_sub, float t,
+           Vector3 *hit_pos, Vector3 *hit_normal, Vector3 *hit_offset,
+           const Material **hit_material) {
+    const SphereSoA *soa = &scene->_soa;
+    int first_instance = soa->_count + scene->_triangles._count + scene->_number_shapes;
+
+    if (hit_k >= first_instance) {
+        return computeInstanceHit(origin, direction, scene, hit_k - first_instance, hit_sub, t,
+                                  hit_pos, hit_normal, hit_offset, hit_material);
+    }
+    if (hit_k >= soa->_count + scene->_triangles._count) {
+        return computeShapeHit(origin, direction, scene,
+                               hit_k - soa->_count - scene->_triangles._count, t,
+                               hit_pos, hit_normal, hit_offset, hit_material);
+    }
+    if (hit_k >= soa->_count) {
+        return computeTriangleHit(origin, direction, scene, hit_k - soa->_count, t,
+                                  hit_pos, hit_normal, hit_offset, hit_material);
     }
 
-    if (hit_idx == -1) return 0;
+    Vector3 center;
+    center._x = soa->_center_x[hit_k];
+    center._y = soa->_center_y[hit_k];
+    center._z = soa->_center_z[hit_k];
 
     Vector3 td;
-    mulAV(t_min, d, &td);
-    add(o, td, hit_pos);
+    mulAV(t, direction, &td);
+    add(origin, td, hit_pos);
 
     Vector3 n;
-    sub(*hit_pos, hit_sph._center, &n);
-    mulAV(1.0f / hit_sph._radius, n, hit_normal);
+    sub(*hit_pos, center, &n);
+    mulAV(1.0f / soa->_radius[hit_k], n, hit_normal);
+
+    // a ray from inside the sphere sees its inner side; rays leaving
+    // the hit point may hit the sphere on their way out, so move it
+    // off the surface
+    float d_dot_n;
+    computeDotProduct(direction, *hit_normal, &d_dot_n);
+    if (d_dot_n > 0.0f) mulAV(-1.0f, *hit_normal, hit_normal);
+    offsetHitPosition(hit_pos, *hit_normal, hit_offset);
 
-    // Save the color of the intersected sphere in hit_color and hit_spec
-    *hit_color = hit_sph._color;
-    *hit_spec = hit_sph._color_spec;
+    *hit_material = &scene->_materials[hit_k];
 
-    return 1;
+    return d_dot_n > 0.0f;
 }
 
 
-// Save the image in a raw buffer (texture)
-// The memory for texture is allocated in this function. It needs to
-// be freed in the caller.
-static void saveRaw(Color **image, int width, int height, GLubyte **texture) {
-    int count = 0;
-    int i;
-    int j;
-    *texture = (GLubyte *) malloc(sizeof(GLubyte) * 3 * width * height);
+// Check if a triangle blocks the ray (origin, direction) at a distance
+// in [0, t_max), as occluded
+static int
+occludedByTriangles(Vector3 origin, Vector3 direction, const Scene *scene, float t_max) {
+    const BVH *bvh = &scene->_triangle_bvh;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+
+    if (bvh->_number_nodes == 0) return 0;
 
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++) {
-            unsigned char red = (unsigned char) (image[i][j]._red * 255.0f);
-            unsigned char green = (unsigned char) (image[i][j]._green * 255.0f);
-            unsigned char blue = (unsigned char) (image[i][j]._blue * 255.0f);
+    TriangleRay ray;
+    initTriangleRay(&ray, origin, direction);
 
-            (*texture)[count] = red;
-            count++;
+    Vector3 inv_d;
+    inv_d._x = 1.0f / direction._x;
+    inv_d._y = 1.0f / direction._y;
+    inv_d._z = 1.0f / direction._z;
 
-            (*texture)[count] = green;
-            count++;
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode *node = &bvh->_nodes[node_idx];
 
-            (*texture)[count] = blue;
-            count++;
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!hitBox(origin, inv_d, node, t_max)) continue;
+
+        if (node->_count > 0) {
+            int end = node->_offset + node->_count;
+            int k;
+            for (k = node->_offset; k < end; k += SOA_WIDTH) {
+                int count = end - k < SOA_WIDTH ? end - k : SOA_WIDTH;
+                PROFILE_COUNT(PROFILE_TRIANGLE_TESTS, count);
+                if (anyHitTriangleSoA(&scene->_triangles, &ray, k, count, t_max)) {
+                    return 1;
+                }
+            }
+        } else {
+            stack[top++] = node->_offset;
+            stack[top++] = node_idx + 1;
         }
     }
+
+    return 0;
 }
 
 
-// Complete
-// Given an intersection point (hit_pos),
-// the normal to the surface at the intersection point (hit_normal),
-// and the color (diffuse and specular) terms at the intersection point,
-// compute the colot intensity at the point by applying the Phong
-// shading model.
-// Return the color intensity in *color.
-static void
-shade(Vector3 hit_pos, Vector3 hit_normal,
-      Color hit_color, Color hit_spec, Scene scene, Color *color) {
-    // Complete
-    // ambient component
-    color->_red += scene._ambient._red * hit_color._red;
-    color->_green += scene._ambient._green * hit_color._green;
-    color->_blue += scene._ambient._blue * hit_color._blue;
+// Check if a shape blocks the ray (origin, direction) at a distance in
+// [0, t_max), as occluded. If the ray ends at light number light, a
+// plane blocks it when origin and the light are on different sides:
+// one dot product.
+static int
+occludedByShapes(Vector3 origin, Vector3 direction, const Scene *scene, float t_max,
+                 int light) {
+    const float *light_sides = NULL;
+    int k;
 
-    // for each light in the scene
-    int l;
-    for (l = 0; l < scene._number_lights; l++) {
-        // Complete
-        // Form a shadow ray and check if the hit point is under
-        // direct illumination from the light source
-        Vector3 shadow_ray_direction;
-        sub(scene._lights[l]._light_pos, hit_pos, &shadow_ray_direction);
-        normalize(shadow_ray_direction, &shadow_ray_direction);
+    if (scene->_number_shapes == 0) return 0;
+    if (light >= 0) light_sides = &scene->_light_sides[light * scene->_number_shapes];
 
-        Vector3 shadow_hit_pos, shadow_hit_normal;
-        Color shadow_hit_color, shadow_hit_spec;
-        int in_shadow = hitScene(hit_pos, shadow_ray_direction, scene, &shadow_hit_pos, &shadow_hit_normal, &shadow_hit_color, &shadow_hit_spec);
+    for (k = 0; k < scene->_number_shapes; k++) {
+        const Shape *shape = &scene->_shapes[k];
 
-        if (in_shadow) {
-            continue; // Skip the diffuse and specular calculations if in shadow
+        PROFILE_COUNT(PROFILE_SHAPE_TESTS, 1);
+        if (shape->_type == SHAPE_PLANE && light_sides) {
+            float side;
+            computeDotProduct(shape->_geometry._plane._normal, origin, &side);
+            side -= shape->_geometry._plane._offset;
+            if (side * light_sides[k] < 0.0f) return 1;
+        } else {
+            float t = hitShape(shape, origin, direction);
+            if (t >= 0.0f && t < t_max) return 1;
         }
+    }
 
-        // Complete
-        // diffuse component
-        Vector3 li;
-        li._x = (scene._lights[l])._light_pos._x - hit_pos._x;
-        li._y = (scene._lights[l])._light_pos._y - hit_pos._y;
-        li._z = (scene._lights[l])._light_pos._z - hit_pos._z;
-        normalize(li, &li);
-        GLfloat diff = hit_normal._x * li._x + hit_normal._y * li._y + hit_normal._z * li._z;
-        if(diff<0) diff = 0;
-        color->_red += diff * hit_color._red * (scene._lights[l])._light_color._red;
-        color->_green += diff * hit_color._green * (scene._lights[l])._light_color._green;
-        color->_blue += diff * hit_color._blue * (scene._lights[l])._light_color._blue;
+    return 0;
+}
 
 
-        // Complete
-        // specular component
-        Vector3 v;
-        //the vector from the intersection to the viewer
-        v._x = scene._camera._x - hit_pos._x;
-        v._y = scene._camera._y - hit_pos._y;
-        v._z = scene._camera._z - hit_pos._z;
+// Check if a sphere blocks the ray (origin, direction) at a distance
+// in [0, t_max), as occluded
+static int
+occludedBySpheres(Vector3 origin, Vector3 direction, const Scene *scene, float t_max) {
+    const BVH *bvh = &scene->_bvh;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
 
-        normalize(v, &v);
-        Vector3 r;
-        //the vector from the intersection to the light source
-        r._x = 2 * diff * hit_normal._x - li._x;
-        r._y = 2 * diff * hit_normal._y - li._y;
-        r._z = 2 * diff * hit_normal._z - li._z;
+    if (bvh->_number_nodes == 0) return 0;
 
-        normalize(r, &r);
-        GLfloat spec = r._x * v._x + r._y * v._y + r._z * v._z;
-        if(spec<0) spec = 0;
-        color->_red += pow(spec, 64) * hit_spec._red * (scene._lights[l])._light_color._red;
-        color->_green += pow(spec, 64) * hit_spec._green * (scene._lights[l])._light_color._green;
-        color->_blue += pow(spec, 64) * hit_spec._blue * (scene._lights[l])._light_color._blue;
+    Vector3 inv_d;
+    inv_d._x = 1.0f / direction._x;
+    inv_d._y = 1.0f / direction._y;
+    inv_d._z = 1.0f / direction._z;
 
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode *node = &bvh->_nodes[node_idx];
 
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!hitBox(origin, inv_d, node, t_max)) continue;
 
+        if (node->_count > 0) {
+            int end = node->_offset + node->_count;
+            int k;
+            for (k = node->_offset; k < end; k += SOA_WIDTH) {
+                int count = end - k < SOA_WIDTH ? end - k : SOA_WIDTH;
+                PROFILE_COUNT(PROFILE_SPHERE_TESTS, count);
+                if (anyHitSphereSoA(&scene->_soa, origin, direction, k, count, t_max)) {
+                    return 1;
+                }
+            }
+        } else {
+            stack[top++] = node->_offset;
+            stack[top++] = node_idx + 1;
+        }
     }
+
+    return 0;
 }
 
 
-static void rayTrace(Vector3 origin, Vector3 direction_normalized,
-                     Scene scene, Color *color) {
-    Vector3 hit_pos;
-    Vector3 hit_normal;
-    Color hit_color;
-    Color hit_spec;
-    int hit;
+// Check if an instance blocks the ray (origin, direction) at a
+// distance in [0, t_max), as occluded
+static int
+occludedByInstances(Vector3 origin, Vector3 direction, const Scene *scene, float t_max) {
+    const BVH *bvh = &scene->_instance_bvh;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
 
-    // does the ray intersect an object in the scene?
-    hit =
-            hitScene(origin, direction_normalized, scene,
-                     &hit_pos, &hit_normal, &hit_color,
-                     &hit_spec);
-
-    // no hit
-    if (!hit) {
-        color->_red = scene._background_color._red;
-        color->_green = scene._background_color._green;
-        color->_blue = scene._background_color._blue;
-        return;
+    if (bvh->_number_nodes == 0) return 0;
+
+    Vector3 inv_d;
+    inv_d._x = 1.0f / direction._x;
+    inv_d._y = 1.0f / direction._y;
+    inv_d._z = 1.0f / direction._z;
+
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode *node = &bvh->_nodes[node_idx];
+
+        PROFILE_COUNT(PROFILE_BVH_NODES, 1);
+        if (!hitBox(origin, inv_d, node, t_max)) continue;
+
+        if (node->_count > 0) {
+            int k;
+            for (k = node->_offset; k < node->_offset + node->_count; k++) {
+                const Instance *instance = &scene->_instances[bvh->_indices[k]];
+                const Scene *prototype = &scene->_prototypes[instance->_prototype];
+                Vector3 o;
+                Vector3 d;
+                float scale;
+
+                toObjectSpace(instance, origin, direction, &o, &d, &scale);
+                if (occludedBySpheres(o, d, prototype, t_max * scale)
+                    || occludedByTriangles(o, d, prototype, t_max * scale)) {
+                    return 1;
+                }
+            }
+        } else {
+            stack[top++] = node->_offset;
+            stack[top++] = node_idx + 1;
+        }
     }
 
-    // otherwise, apply the shading model at the intersection point
-    shade(hit_pos, hit_normal, hit_color, hit_spec, scene, color);
+    return 0;
 }
 
 
-void rayTraceScene(Scene scene, int width, int height, GLubyte **texture) {
-    Color **image;
-    int i;
-    int j;
+// Check if anything blocks the ray (origin, direction) at a distance
+// in [0, t_max). Unlike closestHit, stop at the first blocker found.
+// light is the index of the light the ray goes to (t_max away), or -1.
+// Return 1 if the ray is blocked, 0 otherwise.
+static int
+occluded(Vector3 origin, Vector3 direction, const Scene *scene, float t_max, int light) {
+    PROFILE_COUNT(PROFILE_SHADOW_RAYS, 1);
+
+    // cheapest first
+    return occludedByShapes(origin, direction, scene, t_max, light)
+           || occludedBySpheres(origin, direction, scene, t_max)
+           || occludedByTriangles(origin, direction, scene, t_max)
+           || occludedByInstances(origin, direction, scene, t_max);
+}
+
+
+static float maxComponent(Color c) {
+    float m = c._red > c._green ? c._red : c._green;
+    return c._blue > m ? c._blue : m;
+}
 
-    Vector3 camera_pos;
-    float screen_scale;
 
-    image = (Color **) malloc(height * sizeof(Color *));
-    for (i = 0; i < height; i++) {
-        image[i] = (Color *) malloc(width * sizeof(Color));
+// Settings of the rays traced for one pixel
+struct _TraceSettings {
+    // Reflection and refraction limits
+    int _max_depth;
+    int _ray_budget;
+
+    // Shadow rays per hit point (0: one per light)
+    int _light_samples;
+
+    // Shadow rays per area light, and shadow packet size
+    int _area_samples;
+    int _packet_size;
+};
+
+typedef struct _TraceSettings TraceSettings;
+
+
+// Lights faded out to less than this fraction of their color (near the
+// end of their range) are skipped
+#define LIGHT_CULL_THRESHOLD (1.0f / 1024.0f)
+
+
+// Squared distance from p to the box of light node idx (0 inside)
+static float lightNodeDistance2(const Scene *scene, int idx, Vector3 p) {
+    const BVHNode *node = &scene->_light_bvh._nodes[idx];
+    float dx = p._x < node->_lower_bound._x ? node->_lower_bound._x - p._x
+             : p._x > node->_upper_bound._x ? p._x - node->_upper_bound._x : 0.0f;
+    float dy = p._y < node->_lower_bound._y ? node->_lower_bound._y - p._y
+             : p._y > node->_upper_bound._y ? p._y - node->_upper_bound._y : 0.0f;
+    float dz = p._z < node->_lower_bound._z ? node->_lower_bound._z - p._z
+             : p._z > node->_upper_bound._z ? p._z - node->_upper_bound._z : 0.0f;
+
+    return dx * dx + dy * dy + dz * dz;
+}
+
+
+// Iterator over the lights that may light a point: walks _light_bvh,
+// skipping the nodes whose lights are all out of range of the point
+struct _LightIterator {
+    const Scene *_scene;
+    Vector3 _point;
+
+    // nodes left to visit, and entries [_leaf, _leaf_end) of the
+    // current leaf
+    int _stack[BVH_STACK_SIZE];
+    int _top;
+    int _leaf;
+    int _leaf_end;
+};
+
+typedef struct _LightIterator LightIterator;
+
+
+static void initLightIterator(LightIterator *it, const Scene *scene, Vector3 point) {
+    it->_scene = scene;
+    it->_point = point;
+    it->_top = 0;
+    it->_leaf = 0;
+    it->_leaf_end = 0;
+    if (scene->_light_bvh._number_nodes > 0) it->_stack[it->_top++] = 0;
+}
+
+
+// Return the next light, or -1 once every light has been returned
+static int nextLight(LightIterator *it) {
+    const Scene *scene = it->_scene;
+    const BVH *bvh = &scene->_light_bvh;
+
+    for (;;) {
+        const BVHNode *node;
+        float range;
+        int idx;
+
+        if (it->_leaf < it->_leaf_end) return bvh->_indices[it->_leaf++];
+        if (it->_top == 0) return -1;
+
+        idx = it->_stack[--it->_top];
+        node = &bvh->_nodes[idx];
+        range = scene->_light_node_range[idx];
+        if (range < INFINITY && lightNodeDistance2(scene, idx, it->_point) >= range * range) {
+            continue;
+        }
+
+        if (node->_count > 0) {
+            it->_leaf = node->_offset;
+            it->_leaf_end = node->_offset + node->_count;
+        } else {
+            it->_stack[it->_top++] = node->_offset;
+            it->_stack[it->_top++] = idx + 1;
+        }
     }
+}
 
-    // get parameters for the camera position and the screen fov
-    camera_pos._x = scene._camera._x;
-    camera_pos._y = scene._camera._y;
-    camera_pos._z = scene._camera._z;
 
-    screen_scale = scene._scale;
+// Color of light l at point p, faded out with the distance if the
+// light has a range. Return its largest component (0 out of range).
+static float lightColorAt(const Scene *scene, int l, Vector3 p, Color *light_color) {
+    const Light *light = &scene->_lights[l];
 
-    // go through each pixel
-    // and check for intersection between the ray and the scene
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++) {
-            // Compute (x,y) coordinates for the current pixel
-            // in scene space
-            float x = screen_scale * j - 0.5f * screen_scale * width;
-            float y = screen_scale * i - 0.5f * screen_scale * height;
-
-            // Form the vector camera to current pixel
-            Vector3 direction;
-            Vector3 direction_normalized;
+    *light_color = light->_light_color;
+    if (light->_range > 0.0f) {
+        float dx = light->_light_pos._x - p._x;
+        float dy = light->_light_pos._y - p._y;
+        float dz = light->_light_pos._z - p._z;
+        float x = 1.0f - (dx * dx + dy * dy + dz * dz) / (light->_range * light->_range);
+        float fade = x > 0.0f ? x * x : 0.0f;
 
-            direction._x = x - camera_pos._x;
-            direction._y = y - camera_pos._y;
-            direction._z = -camera_pos._z;
+        light_color->_red *= fade;
+        light_color->_green *= fade;
+        light_color->_blue *= fade;
+    }
 
-            normalize(direction, &direction_normalized);
+    return maxComponent(*light_color);
+}
 
-            Vector3 origin = scene._camera;
-            Color color;
-            color._red = 0.f;
-            color._green = 0.f;
-            color._blue = 0.f;
-            rayTrace(origin, direction_normalized, scene, &color);
 
-            // Gamma
-            color._red = color._red * 1.1f - 0.02f;
-            color._green = color._green * 1.1f - 0.02f;
-            color._blue = color._blue * 1.1f - 0.02f;
-            clamp(&color, 0.f, 1.f);
-            color._red = powf(color._red, 0.4545f);
-            color._green = powf(color._green, 0.4545f);
-            color._blue = powf(color._blue, 0.4545f);
+// Shadow rays of a packet of size rays from origin (see
+// closestHitPacket for the directions), ray l ending t_max[l] away:
+// blocked[l] is set to 1 if something blocks it, 0 otherwise. The
+// spheres are tested for the whole packet at once, the rest ray by ray.
+static void occludedPacket(const Scene *scene, int size, Vector3 origin,
+                           const Vector3 *directions, const float *dir_x,
+                           const float *dir_y, const float *dir_z,
+                           const float *t_max, int *blocked) {
+    int hit_k[MAX_PACKET_SIZE];
+    float hit_t[MAX_PACKET_SIZE];
+    int l;
+
+    PROFILE_COUNT(PROFILE_SHADOW_RAYS, size);
+
+    for (l = 0; l < size; l++) hit_t[l] = t_max[l];
+    tracePacket(scene, size, origin, dir_x, dir_y, dir_z, hit_k, hit_t);
+
+    for (l = 0; l < size; l++) {
+        blocked[l] = hit_k[l] >= 0
+                     || occludedByShapes(origin, directions[l], scene, t_max[l], -1)
+                     || occludedByTriangles(origin, directions[l], scene, t_max[l])
+                     || occludedByInstances(origin, directions[l], scene, t_max[l]);
+    }
+}
+
 
-            // Contrast
-            color._red = color._red * color._red * (3.f - 2.f * color._red);
-            color._green = color._green * color._green * (3.f - 2.f * color._green);
-            color._blue = color._blue * color._blue * (3.f - 2.f * color._blue);
+// Shadow rays from origin along the count directions, ray l ending
+// t_max[l] away: blocked[l] as in occludedPacket. The rays go in
+// packets of up to packet_size rays; the missing rays of a narrower
+// last packet repeat the last ray.
+static void occludedRays(const Scene *scene, int packet_size, int count, Vector3 origin,
+                         const Vector3 *directions, const float *t_max, int *blocked) {
+    Vector3 packet_directions[MAX_PACKET_SIZE];
+    float dir_x[MAX_PACKET_SIZE];
+    float dir_y[MAX_PACKET_SIZE];
+    float dir_z[MAX_PACKET_SIZE];
+    float packet_t_max[MAX_PACKET_SIZE];
+    int packet_blocked[MAX_PACKET_SIZE];
+    int size;
+    int s;
+    int l;
+
+    for (s = 0; s < count; s += size) {
+        size = packet_size;
+        while (size > PACKET_SSE && size > count - s) size /= 2;
+
+        if (size == PACKET_SCALAR) {
+            blocked[s] = occluded(origin, directions[s], scene, t_max[s], -1);
+            continue;
+        }
 
-            image[i][j] = color;
+        for (l = 0; l < size; l++) {
+            int k = s + l < count ? s + l : count - 1;
+            packet_directions[l] = directions[k];
+            dir_x[l] = directions[k]._x;
+            dir_y[l] = directions[k]._y;
+            dir_z[l] = directions[k]._z;
+            packet_t_max[l] = t_max[k];
         }
+        occludedPacket(scene, size, origin, packet_directions, dir_x, dir_y, dir_z,
+                       packet_t_max, packet_blocked);
+        for (l = 0; l < size && s + l < count; l++) blocked[s + l] = packet_blocked[l];
+    }
+}
+
+
+// Position of sample s of n * n samples over a square (n is 2 or 4),
+// as an offset in [-0.5, 0.5) from its center: one sample in each cell
+// of an n by n grid, at (u, v) in [0, 1)^2 inside the cell (jittered
+// stratification). Samples 0 to 3 fall in the four quadrants of the
+// square, each in another cell of its quadrant, so that the first
+// four already cover the square evenly.
+static void stratifiedOffset(int s, int n, float u, float v,
+                             float *offset_x, float *offset_y) {
+    int quadrant = s & 3;
+    int cell_x = quadrant & 1;
+    int cell_y = quadrant >> 1;
+
+    if (n == 4) {
+        int cell = (s >> 2) ^ quadrant;
+        cell_x = 2 * cell_x + (cell & 1);
+        cell_y = 2 * cell_y + (cell >> 1);
     }
 
-    // save image to texture buffer
-    saveRaw(image, width, height, texture);
+    *offset_x = (cell_x + u) / n - 0.5f;
+    *offset_y = (cell_y + v) / n - 0.5f;
+}
+
+
+// Point of area light l for the offset (x, y) in [-0.5, 0.5)^2 seen
+// from p: on a quad, the point of the parallelogram; on a sphere, the
+// point of the cap facing p above the point (x, y) of the disk facing
+// p (mapped from the square as in sampleDisk of Camera.c)
+static Vector3 areaLightPoint(const Light *light, Vector3 p, float x, float y) {
+    Vector3 q = light->_light_pos;
 
-    for (i = 0; i < height; i++) {
-        free(image[i]);
+    if (light->_type == LIGHT_QUAD) {
+        q._x += x * light->_edge_u._x + y * light->_edge_v._x;
+        q._y += x * light->_edge_u._y + y * light->_edge_v._y;
+        q._z += x * light->_edge_u._z + y * light->_edge_v._z;
+    } else {
+        Vector3 w;
+        Vector3 a;
+        Vector3 b;
+        Vector3 axis;
+        float r2 = light->_radius * light->_radius * (x + 0.5f);
+        float r = sqrtf(r2);
+        float theta = 2.0f * (float) M_PI * (y + 0.5f);
+        float h = sqrtf(light->_radius * light->_radius - r2);
+        float ca;
+        float cb;
+
+        sub(p, light->_light_pos, &w);
+        normalize(w, &w);
+        axis._x = fabsf(w._x) > 0.9f ? 0.0f : 1.0f;
+        axis._y = fabsf(w._x) > 0.9f ? 1.0f : 0.0f;
+        axis._z = 0.0f;
+        computeCrossProduct(axis, w, &a);
+        normalize(a, &a);
+        computeCrossProduct(w, a, &b);
+
+        ca = r * cosf(theta);
+        cb = r * sinf(theta);
+        q._x += ca * a._x + cb * b._x + h * w._x;
+        q._y += ca * a._y + cb * b._y + h * w._y;
+        q._z += ca * a._z + cb * b._z + h * w._z;
     }
 
-    free(image);
+    return q;
+}
+
+
+// Add the diffuse and specular terms (Phong) of a point light of color
+// light_color at light_pos to *color, with no shadow test (see
+// shadeLight for the arguments)
+static void
+phongLight(Vector3 hit_pos, Vector3 hit_normal, Vector3 view,
+           Color hit_color, Color hit_spec, Vector3 light_pos, Color light_color,
+           Color *color) {
+    // Complete
+    // diffuse component
+    Vector3 li;
+    li._x = light_pos._x - hit_pos._x;
+    li._y = light_pos._y - hit_pos._y;
+    li._z = light_pos._z - hit_pos._z;
+    normalize(li, &li);
+    float diff = hit_normal._x * li._x + hit_normal._y * li._y + hit_normal._z * li._z;
+    if(diff<0) diff = 0;
+    color->_red += diff * hit_color._red * light_color._red;
+    color->_green += diff * hit_color._green * light_color._green;
+    color->_blue += diff * hit_color._blue * light_color._blue;
+
+
+    // Complete
+    // specular component
+    Vector3 v = view;
+    Vector3 r;
+    //the vector from the intersection to the light source
+    r._x = 2 * diff * hit_normal._x - li._x;
+    r._y = 2 * diff * hit_normal._y - li._y;
+    r._z = 2 * diff * hit_normal._z - li._z;
+
+    normalize(r, &r);
+    float spec = r._x * v._x + r._y * v._y + r._z * v._z;
+    if(spec<0) spec = 0;
+    color->_red += pow(spec, 64) * hit_spec._red * light_color._red;
+    color->_green += pow(spec, 64) * hit_spec._green * light_color._green;
+    color->_blue += pow(spec, 64) * hit_spec._blue * light_color._blue;
+}
+
+
+// Area light l: shadow rays to n * n points of the light (n = 2 or 4,
+// for trace->_area_samples; see stratifiedOffset, all shifted by one
+// number pair of sampler), each a point light of 1 / (n * n) of its
+// color. The first four cover the four quarters of the light: when
+// they agree, the point is fully lit or fully shadowed and they are
+// used alone; otherwise (in the penumbra) the other rays are traced
+// too. The rays of each round go in packets (see occludedRays).
+static void
+shadeAreaLight(Vector3 hit_pos, Vector3 hit_normal, Vector3 view,
+               Color hit_color, Color hit_spec, const Scene *scene,
+               const TraceSettings *trace, int l, Color light_color, Sampler *sampler,
+               Color *color) {
+    const Light *light = &scene->_lights[l];
+    Vector3 points[AREA_MAX_SAMPLES];
+    Vector3 directions[AREA_MAX_SAMPLES];
+    float distances[AREA_MAX_SAMPLES];
+    int blocked[AREA_MAX_SAMPLES];
+    int n = trace->_area_samples == AREA_MAX_SAMPLES ? 4 : 2;
+    int count = 4;
+    int number_blocked = 0;
+    float scale;
+    float u;
+    float v;
+    int s;
+
+    nextSample2D(sampler, &u, &v);
+    for (s = 0; s < n * n; s++) {
+        float x;
+        float y;
+
+        stratifiedOffset(s, n, u, v, &x, &y);
+        points[s] = areaLightPoint(light, hit_pos, x, y);
+        sub(points[s], hit_pos, &directions[s]);
+        computeNorm(directions[s], &distances[s]);
+        normalize(directions[s], &directions[s]);
+    }
+
+    occludedRays(scene, trace->_packet_size, 4, hit_pos, directions, distances, blocked);
+    for (s = 0; s < 4; s++) number_blocked += blocked[s];
+
+    if (number_blocked > 0 && number_blocked < 4 && n * n > 4) {
+        count = n * n;
+        occludedRays(scene, trace->_packet_size, count - 4, hit_pos, directions + 4,
+                     distances + 4, blocked + 4);
+    }
+
+    scale = 1.0f / count;
+    light_color._red *= scale;
+    light_color._green *= scale;
+    light_color._blue *= scale;
+    for (s = 0; s < count; s++) {
+        if (blocked[s]) continue;
+        phongLight(hit_pos, hit_normal, view, hit_color, hit_spec, points[s], light_color,
+                   color);
+    }
+}
+
+
+// Complete
+// Given an intersection point (hit_pos),
+// the normal to the surface at the intersection point (hit_normal),
+// the unit vector from the intersection point to the viewer (view),
+// and the color (diffuse and specular) terms at the intersection point,
+// compute the light brought by light l, of color light_color at the
+// point, by applying the Phong shading model. Area lights take several
+// shadow rays (see shadeAreaLight; sampler places them).
+// Add the color intensity to *color.
+static void
+shadeLight(Vector3 hit_pos, Vector3 hit_normal, Vector3 view,
+           Color hit_color, Color hit_spec, const Scene *scene,
+           const TraceSettings *trace, int l, Color light_color, Sampler *sampler,
+           Color *color) {
+    Vector3 light_pos = scene->_lights[l]._light_pos;
+
+    if (scene->_lights[l]._type != LIGHT_POINT && trace->_area_samples > 1) {
+        shadeAreaLight(hit_pos, hit_normal, view, hit_color, hit_spec, scene, trace, l,
+                       light_color, sampler, color);
+        return;
+    }
+
+    // Complete
+    // Form a shadow ray and check if the hit point is under
+    // direct illumination from the light source
+    // Only objects between the point and the light cast a shadow
+    Vector3 shadow_ray_direction;
+    float light_distance;
+    sub(light_pos, hit_pos, &shadow_ray_direction);
+    computeNorm(shadow_ray_direction, &light_distance);
+    normalize(shadow_ray_direction, &shadow_ray_direction);
+
+    int in_shadow = occluded(hit_pos, shadow_ray_direction, scene, light_distance, l);
+
+    if (in_shadow) {
+        return; // Skip the diffuse and specular calculations if in shadow
+    }
+
+    phongLight(hit_pos, hit_normal, view, hit_color, hit_spec, light_pos, light_color, color);
+}
+
+
+// Weight of light l in the light sampling at point p of normal n: its
+// color times the cosine of its angle with the normal (0 behind the
+// surface, which hides it on closed objects)
+static float lightImportance(const Scene *scene, int l, Vector3 p, Vector3 n,
+                             Color *light_color) {
+    float strength = lightColorAt(scene, l, p, light_color);
+    Vector3 li;
+    float cosine;
+
+    if (strength <= 0.0f) return 0.0f;
+
+    sub(scene->_lights[l]._light_pos, p, &li);
+    normalize(li, &li);
+    computeDotProduct(n, li, &cosine);
+
+    return cosine > 0.0f ? strength * cosine : 0.0f;
+}
+
+
+// Bound on the lightImportance of the lights under light node idx at
+// point p of normal n: their power, faded with the distance to the
+// node box, and 0 if the whole box is behind the surface
+static float lightNodeImportance(const Scene *scene, int idx, Vector3 p, Vector3 n) {
+    const BVHNode *node = &scene->_light_bvh._nodes[idx];
+    float range = scene->_light_node_range[idx];
+    float front = 0.0f;
+    float fade = 1.0f;
+
+    // largest n . (c - p) over the corners c of the box
+    front += n._x * (n._x > 0.0f ? node->_upper_bound._x : node->_lower_bound._x);
+    front += n._y * (n._y > 0.0f ? node->_upper_bound._y : node->_lower_bound._y);
+    front += n._z * (n._z > 0.0f ? node->_upper_bound._z : node->_lower_bound._z);
+    front -= n._x * p._x + n._y * p._y + n._z * p._z;
+    if (front <= 0.0f) return 0.0f;
+
+    if (range < INFINITY) {
+        float x = 1.0f - lightNodeDistance2(scene, idx, p) / (range * range);
+        if (x <= 0.0f) return 0.0f;
+        fade = x * x;
+    }
+
+    return scene->_light_node_power[idx] * fade;
+}
+
+
+// Pick a light for the sample u in [0, 1): walk down _light_bvh, going
+// to each child with a probability proportional to its
+// lightNodeImportance (u, rescaled, picks the next child), then pick a
+// light of the leaf in proportion to its lightImportance.
+// Return the light, with its color at p in *light_color and the
+// probability it had to be picked in *probability, or -1 if no light
+// lights p.
+static int
+pickLight(const Scene *scene, Vector3 p, Vector3 n, float u,
+          Color *light_color, float *probability) {
+    const BVH *bvh = &scene->_light_bvh;
+    const BVHNode *node = &bvh->_nodes[0];
+    float total = 0.0f;
+    float weight = 0.0f;
+    int idx = 0;
+    int i;
+
+    *probability = 1.0f;
+    while (node->_count == 0) {
+        float left = lightNodeImportance(scene, idx + 1, p, n);
+        float right = lightNodeImportance(scene, node->_offset, p, n);
+        float q;
+
+        if (left + right <= 0.0f) return -1;
+
+        q = left / (left + right);
+        if (u < q) {
+            idx = idx + 1;
+            u = u / q;
+            *probability *= q;
+        } else {
+            idx = node->_offset;
+            u = (u - q) / (1.0f - q);
+            *probability *= 1.0f - q;
+        }
+        if (u >= 1.0f) u = 0x1.fffffep-1f;
+        node = &bvh->_nodes[idx];
+    }
+
+    for (i = node->_offset; i < node->_offset + node->_count; i++) {
+        total += lightImportance(scene, bvh->_indices[i], p, n, light_color);
+    }
+    if (total <= 0.0f) return -1;
+
+    u *= total;
+    for (i = node->_offset; i < node->_offset + node->_count; i++) {
+        weight = lightImportance(scene, bvh->_indices[i], p, n, light_color);
+        if (weight > 0.0f && u < weight) break;
+        u -= weight;
+    }
+    // rounding may leave u past the last weight: keep the last light
+    // with a weight
+    if (i == node->_offset + node->_count) {
+        for (i--; ; i--) {
+            weight = lightImportance(scene, bvh->_indices[i], p, n, light_color);
+            if (weight > 0.0f) break;
+        }
+    }
+
+    *probability *= weight / total;
+    return bvh->_indices[i];
+}
+
+
+// Stochastic lighting: trace number_samples shadow rays to lights
+// picked by pickLight, at stratified samples (one per slice of [0, 1),
+// at an offset drawn from sampler). Each one counts for 1 / (number_samples *
+// probability) times its light, so that the result is the full
+// lighting on average (see shade for the arguments).
+static void
+sampleLights(Vector3 hit_pos, Vector3 hit_normal, Vector3 view,
+             Color hit_color, Color hit_spec, const Scene *scene,
+             const TraceSettings *trace, Sampler *sampler, Color *color) {
+    int number_samples = trace->_light_samples;
+    float offset = nextSample(sampler);
+    int k;
+
+    for (k = 0; k < number_samples; k++) {
+        Color light_color;
+        float probability;
+        float scale;
+        int l = pickLight(scene, hit_pos, hit_normal, (k + offset) / number_samples,
+                          &light_color, &probability);
+
+        if (l < 0) continue;
+
+        scale = 1.0f / (number_samples * probability);
+        light_color._red *= scale;
+        light_color._green *= scale;
+        light_color._blue *= scale;
+        shadeLight(hit_pos, hit_normal, view, hit_color, hit_spec, scene, trace, l, light_color,
+                   sampler, color);
+    }
+}
+
+
+// Complete
+// Given an intersection point (hit_pos),
+// the normal to the surface at the intersection point (hit_normal),
+// the unit vector from the intersection point to the viewer (view),
+// and the color (diffuse and specular) terms at the intersection point,
+// compute the colot intensity at the point by applying the Phong
+// shading model.
+// Only the lights that reach the point are visited (see
+// LightIterator); with more lights than trace->_light_samples > 0,
+// that many are sampled instead (see sampleLights; sampler drives the
+// picks).
+// Return the color intensity in *color.
+static void
+shade(Vector3 hit_pos, Vector3 hit_normal, Vector3 view,
+      Color hit_color, Color hit_spec, const Scene *scene,
+      const TraceSettings *trace, Sampler *sampler, Color *color) {
+    LightIterator it;
+    int l;
+
+    // Complete
+    // ambient component
+    color->_red += scene->_ambient._red * hit_color._red;
+    color->_green += scene->_ambient._green * hit_color._green;
+    color->_blue += scene->_ambient._blue * hit_color._blue;
+
+    if (trace->_light_samples > 0 && scene->_number_lights > trace->_light_samples) {
+        sampleLights(hit_pos, hit_normal, view, hit_color, hit_spec, scene,
+                     trace, sampler, color);
+        return;
+    }
+
+    // for each light that reaches the point
+    initLightIterator(&it, scene, hit_pos);
+    while ((l = nextLight(&it)) >= 0) {
+        Color light_color;
+        float strength = lightColorAt(scene, l, hit_pos, &light_color);
+
+        if (strength < LIGHT_CULL_THRESHOLD * maxComponent(scene->_lights[l]._light_color)) {
+            continue;
+        }
+
+        shadeLight(hit_pos, hit_normal, view, hit_color, hit_spec, scene, trace, l, light_color,
+                   sampler, color);
+    }
+}
+
+
+// Rays deeper than this (number of bounces after the primary ray) may
+// be stopped by the Russian roulette
+#define RUSSIAN_ROULETTE_DEPTH 3
+
+
+// Ray waiting to be traced by shadeRay, with the weight of its color in
+// the pixel and its number of bounces
+struct _PendingRay {
+    Vector3 _origin;
+    Vector3 _direction;
+    Color _weight;
+    int _depth;
+};
+
+typedef struct _PendingRay PendingRay;
+
+
+// Push the ray (origin, direction) on the stack of shadeRay unless it
+// is black or the Russian roulette stops it. A ray surviving the
+// roulette with probability p has its weight divided by p, which keeps
+// the expected color of the pixel.
+static void pushRay(PendingRay *stack, int *top, Vector3 origin, Vector3 direction,
+                    Color weight, int depth, Sampler *sampler) {
+    float strength = maxComponent(weight);
+
+    if (strength <= 0.0f) return;
+    if (depth > RUSSIAN_ROULETTE_DEPTH && strength < 1.0f) {
+        if (nextSample(sampler) >= strength) return;
+        weight._red /= strength;
+        weight._green /= strength;
+        weight._blue /= strength;
+    }
+
+    stack[*top]._origin = origin;
+    stack[*top]._direction = direction;
+    stack[*top]._weight = weight;
+    stack[*top]._depth = depth;
+    (*top)++;
+}
+
+
+// Push the rays reflected and refracted where the ray of the given
+// direction and weight hits material (see computeHit for the other
+// arguments). The refracted ray bends following Snell's law; Fresnel
+// reflection (Schlick's approximation) takes part of the refracted
+// light, and all of it past the critical angle.
+static void
+spawnRays(PendingRay *stack, int *top, Vector3 direction,
+          Vector3 hit_pos, Vector3 hit_normal, Vector3 hit_offset, int back_side,
+          const Material *material, Color weight, int depth, Sampler *sampler) {
+    float cos_i;
+    float fresnel = 1.0f;
+    Vector3 reflected;
+    Vector3 refracted;
+    Vector3 v;
+    Color reflect_weight;
+    Color refract_weight;
+
+    computeDotProduct(direction, hit_normal, &cos_i);
+    cos_i = -cos_i;
+
+    mulAV(2.0f * cos_i, hit_normal, &v);
+    add(direction, v, &reflected);
+
+    if (maxComponent(material->_color_refract) > 0.0f) {
+        float ior = material->_index_of_refraction;
+        float eta = back_side ? ior : 1.0f / ior;
+        float sin2_t = eta * eta * (1.0f - cos_i * cos_i);
+
+        if (sin2_t < 1.0f) {
+            float cos_t = sqrtf(1.0f - sin2_t);
+            float r0 = (1.0f - ior) / (1.0f + ior);
+            float c = 1.0f - (back_side ? cos_t : cos_i);
+
+            r0 *= r0;
+            fresnel = r0 + (1.0f - r0) * c * c * c * c * c;
+
+            mulAV(eta, direction, &refracted);
+            mulAV(eta * cos_i - cos_t, hit_normal, &v);
+            add(refracted, v, &refracted);
+            normalize(refracted, &refracted);
+        }
+    }
+
+    reflect_weight._red = weight._red * (material->_color_reflect._red
+                                         + fresnel * material->_color_refract._red);
+    reflect_weight._green = weight._green * (material->_color_reflect._green
+                                             + fresnel * material->_color_refract._green);
+    reflect_weight._blue = weight._blue * (material->_color_reflect._blue
+                                           + fresnel * material->_color_refract._blue);
+
+    refract_weight._red = weight._red * (1.0f - fresnel) * material->_color_refract._red;
+    refract_weight._green = weight._green * (1.0f - fresnel) * material->_color_refract._green;
+    refract_weight._blue = weight._blue * (1.0f - fresnel) * material->_color_refract._blue;
+
+    // the refracted ray starts on the other side of the surface
+    Vector3 below;
+    mulAV(-2.0f, hit_offset, &v);
+    add(hit_pos, v, &below);
+
+    // the stronger ray is traced first, in case the budget runs out
+    if (maxComponent(reflect_weight) >= maxComponent(refract_weight)) {
+        pushRay(stack, top, below, refracted, refract_weight, depth + 1, sampler);
+        pushRay(stack, top, hit_pos, reflected, reflect_weight, depth + 1, sampler);
+    } else {
+        pushRay(stack, top, hit_pos, reflected, reflect_weight, depth + 1, sampler);
+        pushRay(stack, top, below, refracted, refract_weight, depth + 1, sampler);
+    }
+}
+
+
+// Color of the ray (origin, direction) given the closest hit found
+// for it: the background if hit_k is -1, the shaded object otherwise,
+// plus the colors of the rays it spawns on reflective and refractive
+// surfaces, up to max_depth bounces and ray_budget rays in all.
+// The spawned rays wait on a small explicit stack rather than in
+// recursive calls, so the depth does not weigh on the thread stacks.
+// sampler drives the light picks and the Russian roulette.
+static void shadeRay(Vector3 origin, Vector3 direction, const Scene *scene,
+                     int hit_k, int hit_sub, float t, const TraceSettings *trace,
+                     Sampler sampler, Color *color) {
+    PendingRay stack[MAX_TRACE_DEPTH + 2];
+    int top = 0;
+    int number_rays = 1;
+    int depth = 0;
+    Color weight;
+
+    weight._red = 1.0f;
+    weight._green = 1.0f;
+    weight._blue = 1.0f;
+
+    PROFILE_COUNT(PROFILE_PRIMARY_RAYS, 1);
+
+    for (;;) {
+        if (hit_k == -1) {
+            // no hit
+            color->_red += weight._red * scene->_background_color._red;
+            color->_green += weight._green * scene->_background_color._green;
+            color->_blue += weight._blue * scene->_background_color._blue;
+        } else {
+            // otherwise, apply the shading model at the intersection point
+            Vector3 hit_pos;
+            Vector3 hit_normal;
+            Vector3 hit_offset;
+            Vector3 view;
+            const Material *material;
+            Color local;
+            int back_side;
+
+            back_side = computeHit(origin, direction, scene, hit_k, hit_sub, t,
+                                   &hit_pos, &hit_normal, &hit_offset, &material);
+
+            local._red = 0.0f;
+            local._green = 0.0f;
+            local._blue = 0.0f;
+            // the viewer is where the ray comes from
+            mulAV(-1.0f, direction, &view);
+            PROFILE_START(shading_start);
+            shade(hit_pos, hit_normal, view, material->_color, material->_color_spec,
+                  scene, trace, &sampler, &local);
+            PROFILE_STOP(PROFILE_SHADING_TIME, shading_start);
+
+            color->_red += weight._red * local._red;
+            color->_green += weight._green * local._green;
+            color->_blue += weight._blue * local._blue;
+
+            if (depth < trace->_max_depth
+                && (maxComponent(material->_color_reflect) > 0.0f
+                    || maxComponent(material->_color_refract) > 0.0f)) {
+                spawnRays(stack, &top, direction, hit_pos, hit_normal, hit_offset, back_side,
+                          material, weight, depth, &sampler);
+            }
+        }
+
+        // next ray, within the budget of the pixel
+        if (top == 0 || number_rays >= trace->_ray_budget) break;
+
+        top--;
+        origin = stack[top]._origin;
+        direction = stack[top]._direction;
+        weight = stack[top]._weight;
+        depth = stack[top]._depth;
+
+        hit_k = closestHit(origin, direction, scene, &t, &hit_sub);
+        number_rays++;
+        PROFILE_COUNT(PROFILE_SECONDARY_RAYS, 1);
+    }
+}
+
+
+static void rayTrace(Vector3 origin, Vector3 direction_normalized,
+                     const Scene *scene, const TraceSettings *trace,
+                     Sampler sampler, Color *color) {
+    float t;
+    int hit_sub = -1;
+
+    // does the ray intersect an object in the scene?
+    int hit_k = closestHit(origin, direction_normalized, scene, &t, &hit_sub);
+
+    shadeRay(origin, direction_normalized, scene, hit_k, hit_sub, t, trace, sampler, color);
+}
+
+
+// Number of threads used by rayTraceScene (0: one per core)
+static int g_number_threads = 0;
+
+// Number of primary rays traced together (0: widest the CPU supports)
+static int g_packet_size = 0;
+
+// Reflection and refraction limits (see setRayTraceDepth and
+// setRayTraceRayBudget)
+static int g_max_depth = DEFAULT_TRACE_DEPTH;
+static int g_ray_budget = DEFAULT_RAY_BUDGET;
+
+// Shadow rays per hit point (see setRayTraceLightSamples)
+static int g_light_samples = 0;
+
+// Shadow rays per area light (see setRayTraceAreaSamples)
+static int g_area_samples = DEFAULT_AREA_SAMPLES;
+
+// Numbers of the stochastic effects (see setRayTraceSampler)
+static int g_sampler = DEFAULT_SAMPLER;
+
+// Adaptive anti-aliasing settings (see setRayTraceAntialiasing)
+static int g_aa_samples = DEFAULT_AA_SAMPLES;
+static float g_aa_contrast = DEFAULT_AA_CONTRAST;
+
+// Operator turning pixel colors into display values
+static ToneMap g_tone_map;
+static int g_tone_map_ready = 0;
+static int g_tone_map_operator = TONEMAP_DEFAULT;
+
+// Renders started from several threads at once (see
+// rayTraceSceneToBufferThreads) build the tone map only once
+static pthread_mutex_t g_tone_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+void setRayTraceThreads(int number_threads) {
+    g_number_threads = number_threads;
+}
+
+
+void setRayTracePacketSize(int packet_size) {
+    g_packet_size = packet_size;
+}
+
+
+void setRayTraceDepth(int max_depth) {
+    if (max_depth < 0) max_depth = 0;
+    if (max_depth > MAX_TRACE_DEPTH) max_depth = MAX_TRACE_DEPTH;
+    g_max_depth = max_depth;
+}
+
+
+void setRayTraceRayBudget(int ray_budget) {
+    g_ray_budget = ray_budget > 1 ? ray_budget : 1;
+}
+
+
+void setRayTraceAntialiasing(int samples, float contrast) {
+    if (samples >= AA_MAX_SAMPLES) {
+        g_aa_samples = AA_MAX_SAMPLES;
+    } else if (samples >= 4) {
+        g_aa_samples = 4;
+    } else {
+        g_aa_samples = 1;
+    }
+    g_aa_contrast = contrast;
+}
+
+
+void setRayTraceLightSamples(int light_samples) {
+    g_light_samples = light_samples > 0 ? light_samples : 0;
+}
+
+
+void setRayTraceAreaSamples(int samples) {
+    if (samples >= AREA_MAX_SAMPLES) {
+        g_area_samples = AREA_MAX_SAMPLES;
+    } else if (samples >= 4) {
+        g_area_samples = 4;
+    } else {
+        g_area_samples = 1;
+    }
+}
+
+
+void setRayTraceSampler(int sampler) {
+    g_sampler = sampler;
+}
+
+
+void setRayTraceToneMap(int op) {
+    if (g_tone_map_ready) freeToneMap(&g_tone_map);
+    g_tone_map_ready = 0;
+    g_tone_map_operator = op;
+}
+
+
+// Build the tables of the tone map before the first render uses them
+static const ToneMap *prepareToneMap(void) {
+    pthread_mutex_lock(&g_tone_map_mutex);
+    if (!g_tone_map_ready) {
+        initToneMap(&g_tone_map, g_tone_map_operator);
+        g_tone_map_ready = 1;
+    }
+    pthread_mutex_unlock(&g_tone_map_mutex);
+
+    return &g_tone_map;
+}
+
+
+// Number of rows rendered at once by rayTraceSceneRows
+#define ROW_BAND_HEIGHT (4 * DEFAULT_TILE_SIZE)
+
+
+// Data shared by all the tiles of one frame
+struct _RenderJob {
+    const Scene *_scene;
+    int _width;
+    int _height;
+    int _packet_size;
+
+    // Position of the sample inside each pixel, in pixels, and number
+    // of the pass (the index of the pixel samples, see startPixelSampler)
+    float _offset_x;
+    float _offset_y;
+    int _pass;
+
+    // Sampler type (SAMPLER_)
+    int _sampler;
+
+    // Primary rays
+    CameraRays _camera;
+
+    // Reflection, refraction and lighting settings
+    TraceSettings _trace;
+
+    // Adaptive anti-aliasing: samples per refined pixel (1: off) and
+    // contrast threshold
+    int _samples;
+    float _contrast;
+
+    // Store tone-mapped pixels (1) or the raw shaded samples (0, in
+    // RGB32F frame buffers only)
+    int _post_process;
+    const ToneMap *_tone_map;
+
+    // Row 0 of _frame is row _row_offset of the frame
+    FrameBuffer *_frame;
+    int _row_offset;
+
+    // Tiles not started yet are skipped once *_cancel is set (NULL:
+    // the frame cannot be cancelled)
+    const int *_cancel;
+
+#ifdef RAYTRACE_PROFILE
+    // Counters of the frame (NULL if it is not profiled)
+    FrameProfile *_profile;
+#endif
+};
+
+typedef struct _RenderJob RenderJob;
+
+
+// Sampler of the pixel sample of (i, j) in the pass of job: sample
+// _pass of seed 0, from its shading dimensions (its position and lens
+// sample are those of generateRays)
+static void startPixelSampler(const RenderJob *job, int i, int j, Sampler *sampler) {
+    startSampler(sampler, job->_sampler, j, i, 0, job->_pass);
+    sampler->_dimension = SAMPLE_SHADING;
+}
+
+
+// Ray-trace the pixels of one tile, one ray at a time, and store their
+// colors row by row in colors. The rays are given by generateRays.
+static void renderTileScalar(const Tile *tile, const RenderJob *job,
+                             float *const directions[3], float *const origins[3],
+                             Color *colors) {
+    const Scene *scene = job->_scene;
+    int k = 0;
+    int i;
+    int j;
+
+    // go through each pixel of the tile
+    // and check for intersection between the ray and the scene
+    for (i = tile->_y0; i < tile->_y1; i++) {
+        for (j = tile->_x0; j < tile->_x1; j++, k++) {
+            Vector3 direction_normalized;
+            Vector3 origin = job->_camera._origin;
+
+            direction_normalized._x = directions[0][k];
+            direction_normalized._y = directions[1][k];
+            direction_normalized._z = directions[2][k];
+            if (job->_camera._lens) {
+                origin._x = origins[0][k];
+                origin._y = origins[1][k];
+                origin._z = origins[2][k];
+            }
+
+            Color color;
+            Sampler sampler;
+            color._red = 0.f;
+            color._green = 0.f;
+            color._blue = 0.f;
+            startPixelSampler(job, i, j, &sampler);
+            rayTrace(origin, direction_normalized, scene, &job->_trace, sampler, &color);
+
+            *colors++ = color;
+        }
+    }
+}
+
+
+// Closest hits of a packet of size rays from origin (directions given
+// both as vectors and as separate coordinate arrays)
+static void closestHitPacket(const Scene *scene, int size, Vector3 origin,
+                             const Vector3 *directions, const float *dir_x,
+                             const float *dir_y, const float *dir_z,
+                             int *hit_k, int *hit_sub, float *hit_t) {
+    int first_instance = scene->_soa._count + scene->_triangles._count + scene->_number_shapes;
+    int l;
+
+    for (l = 0; l < size; l++) hit_t[l] = FLT_MAX;
+    tracePacket(scene, size, origin, dir_x, dir_y, dir_z, hit_k, hit_t);
+
+    // packets only hold spheres: look for closer triangles ray by ray
+    if (scene->_triangles._count > 0) {
+        for (l = 0; l < size; l++) {
+            int triangle_k = closestHitTriangles(origin, directions[l], scene, &hit_t[l]);
+            if (triangle_k >= 0) hit_k[l] = scene->_soa._count + triangle_k;
+        }
+    }
+    closestHitShapesPacket(scene, size, origin, dir_x, dir_y, dir_z, hit_k, hit_t);
+
+    // and instances too
+    if (scene->_number_instances > 0) {
+        for (l = 0; l < size; l++) {
+            int instance_k = closestHitInstances(origin, directions[l], scene, &hit_t[l],
+                                                 &hit_sub[l]);
+            if (instance_k >= 0) hit_k[l] = first_instance + instance_k;
+        }
+    }
+}
+
+
+// Ray-trace the pixels of one tile with packets of primary rays
+// (given by generateRays, and all starting at the camera: there is no
+// lens). Each packet covers a small block of pixels; at the border of
+// the tile the missing rays repeat the last valid one and are
+// discarded. Shading is done one ray at a time.
+static void renderTilePackets(const Tile *tile, const RenderJob *job,
+                              float *const directions_soa[3], Color *colors) {
+    const Scene *scene = job->_scene;
+    int size = job->_packet_size;
+    int size_x = PACKET_WIDTH_X(size);
+    int size_y = PACKET_WIDTH_Y(size);
+    int tile_width = tile->_x1 - tile->_x0;
+    Vector3 origin = job->_camera._origin;
+
+    float dir_x[MAX_PACKET_SIZE];
+    float dir_y[MAX_PACKET_SIZE];
+    float dir_z[MAX_PACKET_SIZE];
+    Vector3 directions[MAX_PACKET_SIZE];
+    int hit_k[MAX_PACKET_SIZE];
+    int hit_sub[MAX_PACKET_SIZE];
+    float hit_t[MAX_PACKET_SIZE];
+    int i;
+    int j;
+
+    for (i = tile->_y0; i < tile->_y1; i += size_y) {
+        for (j = tile->_x0; j < tile->_x1; j += size_x) {
+            int l;
+
+            for (l = 0; l < size; l++) {
+                int pi = i + l / size_x;
+                int pj = j + l % size_x;
+                int k;
+                if (pi >= tile->_y1) pi = tile->_y1 - 1;
+                if (pj >= tile->_x1) pj = tile->_x1 - 1;
+
+                k = (pi - tile->_y0) * tile_width + pj - tile->_x0;
+                directions[l]._x = directions_soa[0][k];
+                directions[l]._y = directions_soa[1][k];
+                directions[l]._z = directions_soa[2][k];
+                dir_x[l] = directions[l]._x;
+                dir_y[l] = directions[l]._y;
+                dir_z[l] = directions[l]._z;
+            }
+
+            closestHitPacket(scene, size, origin, directions, dir_x, dir_y, dir_z,
+                             hit_k, hit_sub, hit_t);
+
+            for (l = 0; l < size; l++) {
+                int pi = i + l / size_x;
+                int pj = j + l % size_x;
+                Color color;
+                Sampler sampler;
+
+                if (pi >= tile->_y1 || pj >= tile->_x1) continue;
+
+                color._red = 0.f;
+                color._green = 0.f;
+                color._blue = 0.f;
+                startPixelSampler(job, pi, pj, &sampler);
+                shadeRay(origin, directions[l], scene, hit_k[l], hit_sub[l], hit_t[l],
+                         &job->_trace, sampler, &color);
+
+                colors[(pi - tile->_y0) * tile_width + pj - tile->_x0] = color;
+            }
+        }
+    }
+}
+
+
+// Largest number of pixels of a tile, anti-aliasing border included
+#define MAX_TILE_PIXELS ((DEFAULT_TILE_SIZE + 2) * (DEFAULT_TILE_SIZE + 2))
+
+
+// Ray-trace one sample per pixel of a tile, with packets if the job
+// uses them
+static void renderTileSamples(const Tile *tile, const RenderJob *job, Color *colors) {
+    float ray_data[6][MAX_TILE_PIXELS];
+    float *const directions[3] = {ray_data[0], ray_data[1], ray_data[2]};
+    float *const origins[3] = {ray_data[3], ray_data[4], ray_data[5]};
+
+    generateRays(&job->_camera, tile, job->_offset_x, job->_offset_y, job->_sampler,
+                 job->_pass, directions, origins);
+
+    if (job->_packet_size > PACKET_SCALAR && !job->_camera._lens) {
+        renderTilePackets(tile, job, directions, colors);
+    } else {
+        renderTileScalar(tile, job, directions, origins, colors);
+    }
+}
+
+
+// Pixels refined by the adaptive anti-aliasing get AA_FIRST_SAMPLES
+// samples first, and the rest only if those still differ
+#define AA_FIRST_SAMPLES 4
+
+
+// 1 if the count colors differ by more than threshold in one channel.
+// The difference is Mitchell's contrast (max - min) / (max + min),
+// which follows the eye's sensitivity: the same step counts more in
+// dark areas than in bright ones.
+static int highContrast(const Color *colors, int count, float threshold) {
+    Color low = colors[0];
+    Color high = colors[0];
+    int k;
+
+    // plain comparisons rather than fminf and fmaxf, which are library
+    // calls unless NaNs can be ignored
+    for (k = 1; k < count; k++) {
+        low._red = colors[k]._red < low._red ? colors[k]._red : low._red;
+        low._green = colors[k]._green < low._green ? colors[k]._green : low._green;
+        low._blue = colors[k]._blue < low._blue ? colors[k]._blue : low._blue;
+        high._red = colors[k]._red > high._red ? colors[k]._red : high._red;
+        high._green = colors[k]._green > high._green ? colors[k]._green : high._green;
+        high._blue = colors[k]._blue > high._blue ? colors[k]._blue : high._blue;
+    }
+
+    // the small constant keeps black pixels from dividing by zero
+    return high._red - low._red > threshold * (high._red + low._red + 1e-3f)
+           || high._green - low._green > threshold * (high._green + low._green + 1e-3f)
+           || high._blue - low._blue > threshold * (high._blue + low._blue + 1e-3f);
+}
+
+
+// Ray-trace samples [first, last) of pixel (i, j) (out of n * n, see
+// stratifiedOffset) into samples[first, last). Sample s is sample s of
+// the pixel with seed _pass + 1 of the sampler, which gives its
+// position, its lens sample and then the numbers of its shading.
+static void tracePixelSamples(const RenderJob *job, int i, int j, int first, int last, int n,
+                              Color *samples) {
+    const Scene *scene = job->_scene;
+    Vector3 origins[MAX_PACKET_SIZE];
+    int size;
+
+    float dir_x[MAX_PACKET_SIZE];
+    float dir_y[MAX_PACKET_SIZE];
+    float dir_z[MAX_PACKET_SIZE];
+    Vector3 directions[MAX_PACKET_SIZE];
+    Sampler samplers[MAX_PACKET_SIZE];
+    int hit_k[MAX_PACKET_SIZE];
+    int hit_sub[MAX_PACKET_SIZE];
+    float hit_t[MAX_PACKET_SIZE];
+    int s;
+    int l;
+
+    for (s = first; s < last; s += size) {
+        // narrower packets when there are fewer samples left: at the
+        // end, the missing rays repeat the last one
+        size = job->_camera._lens ? PACKET_SCALAR : job->_packet_size;
+        while (size > PACKET_SSE && size > last - s) size /= 2;
+
+        for (l = 0; l < size; l++) {
+            if (s + l < last) {
+                float offset_x;
+                float offset_y;
+                float u;
+                float v;
+                float lens_u;
+                float lens_v;
+
+                startSampler(&samplers[l], job->_sampler, j, i, job->_pass + 1, s + l);
+                nextSample2D(&samplers[l], &u, &v);
+                nextSample2D(&samplers[l], &lens_u, &lens_v);
+                stratifiedOffset(s + l, n, u, v, &offset_x, &offset_y);
+                generateRay(&job->_camera, j + job->_offset_x + offset_x,
+                            i + job->_offset_y + offset_y, lens_u, lens_v,
+                            &origins[l], &directions[l]);
+            } else {
+                origins[l] = origins[l - 1];
+                directions[l] = directions[l - 1];
+            }
+            dir_x[l] = directions[l]._x;
+            dir_y[l] = directions[l]._y;
+            dir_z[l] = directions[l]._z;
+        }
+
+        if (size > PACKET_SCALAR) {
+            closestHitPacket(scene, size, origins[0], directions, dir_x, dir_y, dir_z,
+                             hit_k, hit_sub, hit_t);
+        } else {
+            hit_k[0] = closestHit(origins[0], directions[0], scene, &hit_t[0], &hit_sub[0]);
+        }
+
+        for (l = 0; l < size && s + l < last; l++) {
+            samples[s + l]._red = 0.f;
+            samples[s + l]._green = 0.f;
+            samples[s + l]._blue = 0.f;
+            shadeRay(origins[l], directions[l], scene, hit_k[l], hit_sub[l], hit_t[l],
+                     &job->_trace, samplers[l], &samples[s + l]);
+        }
+    }
+}
+
+
+// Ray-trace the pixels of one tile with adaptive anti-aliasing
+// (Mitchell 1987): one sample per pixel first, over the tile and a
+// one-pixel border around it, then more samples in the pixels whose
+// 3 by 3 neighbourhood has a high contrast, that is near edges,
+// shadow boundaries and textures. The border pixels are those of the
+// next tiles, traced the same way, so the image still does not depend
+// on the tiles or threads.
+static void renderTileAntialiased(const Tile *tile, const RenderJob *job, Color *colors) {
+    Color base[MAX_TILE_PIXELS];
+    Color samples[1 + AA_MAX_SAMPLES];
+    Color neighbours[9];
+    int tile_width = tile->_x1 - tile->_x0;
+    int base_width;
+    int n = job->_samples == AA_MAX_SAMPLES ? 4 : 2;
+    Tile border = *tile;
+    int i;
+    int j;
+
+    if (border._x0 > 0) border._x0--;
+    if (border._y0 > 0) border._y0--;
+    if (border._x1 < job->_width) border._x1++;
+    if (border._y1 < job->_height) border._y1++;
+    base_width = border._x1 - border._x0;
+
+    renderTileSamples(&border, job, base);
+
+    for (i = tile->_y0; i < tile->_y1; i++) {
+        for (j = tile->_x0; j < tile->_x1; j++) {
+            int i0 = i > border._y0 ? i - 1 : i;
+            int i1 = i + 1 < border._y1 ? i + 1 : i;
+            int j0 = j > border._x0 ? j - 1 : j;
+            int j1 = j + 1 < border._x1 ? j + 1 : j;
+            int count = 0;
+            int number_samples;
+            Color *pixel = &colors[(i - tile->_y0) * tile_width + j - tile->_x0];
+            int k;
+            int ni;
+            int nj;
+
+            *pixel = base[(i - border._y0) * base_width + j - border._x0];
+
+            for (ni = i0; ni <= i1; ni++) {
+                for (nj = j0; nj <= j1; nj++) {
+                    neighbours[count++] = base[(ni - border._y0) * base_width + nj - border._x0];
+                }
+            }
+            if (!highContrast(neighbours, count, job->_contrast)) continue;
+
+            // the pixel sample counts as one more sample of the pixel
+            samples[0] = *pixel;
+            number_samples = AA_FIRST_SAMPLES;
+            tracePixelSamples(job, i, j, 0, AA_FIRST_SAMPLES, n, samples + 1);
+            if (job->_samples > AA_FIRST_SAMPLES
+                && highContrast(samples, 1 + AA_FIRST_SAMPLES, job->_contrast)) {
+                number_samples = job->_samples;
+                tracePixelSamples(job, i, j, AA_FIRST_SAMPLES, number_samples, n, samples + 1);
+            }
+
+            for (k = 1; k <= number_samples; k++) {
+                pixel->_red += samples[k]._red;
+                pixel->_green += samples[k]._green;
+                pixel->_blue += samples[k]._blue;
+            }
+            pixel->_red /= number_samples + 1;
+            pixel->_green /= number_samples + 1;
+            pixel->_blue /= number_samples + 1;
+        }
+    }
+}
+
+
+// Ray-trace the pixels of one tile (at most DEFAULT_TILE_SIZE wide and
+// high) and store them in job->_frame, tone-mapped one tile row at a
+// time. The tile is given relative to row _row_offset of the frame.
+static void renderTile(const Tile *tile, void *data) {
+    RenderJob *job = (RenderJob *) data;
+    const FrameBuffer *frame = job->_frame;
+    Color colors[DEFAULT_TILE_SIZE * DEFAULT_TILE_SIZE];
+    int tile_width = tile->_x1 - tile->_x0;
+    Tile frame_tile = *tile;
+    int i;
+
+    if (job->_cancel && __atomic_load_n(job->_cancel, __ATOMIC_RELAXED)) return;
+
+#ifdef RAYTRACE_PROFILE
+    ProfileCounters profile_start;
+    beginTileProfile(&profile_start);
+#endif
+    PROFILE_START(tile_start);
+
+    frame_tile._y0 += job->_row_offset;
+    frame_tile._y1 += job->_row_offset;
+
+    if (job->_samples > 1) {
+        renderTileAntialiased(&frame_tile, job, colors);
+    } else {
+        renderTileSamples(&frame_tile, job, colors);
+    }
+
+    PROFILE_START(post_process_start);
+    for (i = tile->_y0; i < tile->_y1; i++) {
+        const Color *row = colors + (i - tile->_y0) * tile_width;
+        char *pixels = (char *) frame->_data + (size_t) i * frame->_row_size
+                       + (size_t) tile->_x0 * frame->_pixel_size;
+
+        if (job->_post_process) {
+            toneMapValues(job->_tone_map, (const float *) row, 3 * tile_width,
+                          pixels, frame->_format);
+        } else {
+            memcpy(pixels, row, tile_width * sizeof(Color));
+        }
+    }
+    PROFILE_STOP(PROFILE_POST_PROCESS_TIME, post_process_start);
+    PROFILE_STOP(PROFILE_TILE_TIME, tile_start);
+
+#ifdef RAYTRACE_PROFILE
+    if (job->_profile) endTileProfile(job->_profile, &frame_tile, &profile_start);
+#endif
+}
+
+
+// Fill the settings shared by every tile of a frame
+static void initRenderJob(RenderJob *job, const Scene *scene, int width, int height) {
+    if (!scene->_finalized) {
+        printf("Error: The scene must be finalized before it is ray-traced.\n");
+        exit(1);
+    }
+
+    job->_scene = scene;
+    job->_width = width;
+    job->_height = height;
+    job->_offset_x = 0.0f;
+    job->_offset_y = 0.0f;
+    job->_pass = 0;
+    job->_sampler = g_sampler;
+    setupCameraRays(&job->_camera, &scene->_camera, width, height);
+    job->_trace._max_depth = g_max_depth;
+    job->_trace._ray_budget = g_ray_budget;
+    job->_trace._light_samples = g_light_samples;
+    job->_trace._area_samples = g_area_samples;
+    job->_samples = g_aa_samples;
+    job->_contrast = g_aa_contrast;
+    job->_post_process = 1;
+    job->_tone_map = prepareToneMap();
+    job->_frame = NULL;
+    job->_row_offset = 0;
+    job->_cancel = NULL;
+#ifdef RAYTRACE_PROFILE
+    job->_profile = NULL;
+#endif
+
+    // use the requested packet size if the CPU supports it
+    job->_packet_size = getBestPacketSize();
+    if (g_packet_size > 0 && g_packet_size < job->_packet_size) {
+        job->_packet_size = g_packet_size;
+    }
+    job->_trace._packet_size = job->_packet_size;
+}
+
+
+#ifdef RAYTRACE_PROFILE
+
+// Counters of the last frame rendered by rayTraceSceneToBuffer or
+// rayTraceSceneRows
+static FrameProfile g_profile;
+
+
+// Profile the width by height frame of job, rendered by runTiles in
+// bands of band_height rows
+static void beginRenderProfile(RenderJob *job, int width, int height, int band_height) {
+    int tiles_x = (width + DEFAULT_TILE_SIZE - 1) / DEFAULT_TILE_SIZE;
+    int number_tiles = 0;
+    int y;
+
+    for (y = 0; y < height; y += band_height) {
+        int rows = height - y < band_height ? height - y : band_height;
+        number_tiles += tiles_x * ((rows + DEFAULT_TILE_SIZE - 1) / DEFAULT_TILE_SIZE);
+    }
+
+    beginFrameProfile(&g_profile, width, height,
+                      g_number_threads > 0 ? g_number_threads : getNumberCores(), number_tiles);
+    job->_profile = &g_profile;
+}
+
+#endif
+
+
+const FrameProfile *getRayTraceProfile(void) {
+#ifdef RAYTRACE_PROFILE
+    return &g_profile;
+#else
+    return NULL;
+#endif
+}
+
+
+void rayTraceScene(const Scene *scene, int width, int height, unsigned char **texture) {
+    FrameBuffer frame;
+
+    // The texture is the pixel data of an 8-bit frame buffer; the
+    // caller frees it
+    initFrameBuffer(&frame);
+    resizeFrameBuffer(&frame, width, height, FRAMEBUFFER_RGB8);
+    rayTraceSceneToBuffer(scene, &frame);
+
+    *texture = (unsigned char *) frame._data;
+}
+
+
+void rayTraceSceneToBuffer(const Scene *scene, FrameBuffer *frame) {
+    RenderJob job;
+
+    initRenderJob(&job, scene, frame->_width, frame->_height);
+
+    // Every pixel is computed independently, so the image does not
+    // depend on the number of threads or on the order of the tiles
+    job._frame = frame;
+#ifdef RAYTRACE_PROFILE
+    beginRenderProfile(&job, frame->_width, frame->_height, frame->_height);
+#endif
+    runTiles(frame->_width, frame->_height, DEFAULT_TILE_SIZE, g_number_threads,
+             renderTile, &job);
+#ifdef RAYTRACE_PROFILE
+    endFrameProfile(&g_profile);
+#endif
+}
+
+
+void rayTraceSceneToBufferThreads(const Scene *scene, FrameBuffer *frame, int number_threads) {
+    RenderJob job;
+
+    initRenderJob(&job, scene, frame->_width, frame->_height);
+    job._frame = frame;
+    runTiles(frame->_width, frame->_height, DEFAULT_TILE_SIZE,
+             number_threads > 0 ? number_threads : g_number_threads, renderTile, &job);
+}
+
+
+void rayTraceSceneRows(const Scene *scene, int width, int height,
+                       RowFunc func, void *data) {
+    FrameBuffer band;
+    int band_top;
+    int i;
+    RenderJob job;
+
+    initRenderJob(&job, scene, width, height);
+
+    initFrameBuffer(&band);
+    resizeFrameBuffer(&band, width, ROW_BAND_HEIGHT, FRAMEBUFFER_RGB8);
+
+#ifdef RAYTRACE_PROFILE
+    beginRenderProfile(&job, width, height, ROW_BAND_HEIGHT);
+#endif
+
+    // Frame row 0 is the bottom of the image: go down from the top,
+    // one band of rows at a time
+    for (band_top = height; band_top > 0; band_top -= ROW_BAND_HEIGHT) {
+        int y0 = band_top > ROW_BAND_HEIGHT ? band_top - ROW_BAND_HEIGHT : 0;
+
+        job._frame = &band;
+        job._row_offset = y0;
+        runTiles(width, band_top - y0, DEFAULT_TILE_SIZE, g_number_threads,
+                 renderTile, &job);
+
+        for (i = band_top - 1; i >= y0; i--) {
+            func((const unsigned char *) band._data + (i - y0) * band._row_size,
+                 height - 1 - i, data);
+        }
+    }
+
+#ifdef RAYTRACE_PROFILE
+    endFrameProfile(&g_profile);
+#endif
+
+    freeFrameBuffer(&band);
+}
+
+
+// Radical inverse of index in the given base: the coordinate of
+// sample index of a Halton sequence
+static float radicalInverse(int index, int base) {
+    float inv_base = 1.0f / base;
+    float f = inv_base;
+    float r = 0.0f;
+
+    while (index > 0) {
+        r += f * (index % base);
+        index /= base;
+        f *= inv_base;
+    }
+
+    return r;
+}
+
+
+// Position of the sample of pass number sample inside the pixels:
+// a Halton (2, 3) sequence shifted by half a pixel, so that the first
+// pass samples the same point as rayTraceScene
+static void sampleOffset(int sample, float *offset_x, float *offset_y) {
+    float x = radicalInverse(sample, 2) + 0.5f;
+    float y = radicalInverse(sample, 3) + 0.5f;
+
+    *offset_x = (x >= 1.0f ? x - 1.0f : x) - 0.5f;
+    *offset_y = (y >= 1.0f ? y - 1.0f : y) - 0.5f;
+}
+
+
+// Render passes in the background until max_samples are accumulated
+// or the render is stopped. Each pass is rendered in _pass and added
+// to _accumulation under the lock, so the estimate is always made of
+// complete passes: a pass cut short by stopProgressiveRender is
+// dropped.
+static void *progressiveThread(void *data) {
+    ProgressiveRender *render = (ProgressiveRender *) data;
+    int size = render->_width * render->_height;
+    int sample;
+    int stop;
+    int k;
+    RenderJob job;
+
+    const Color *pass = (const Color *) render->_pass._data;
+
+    initRenderJob(&job, render->_scene, render->_width, render->_height);
+    job._samples = 1;
+    job._post_process = 0;
+    job._frame = &render->_pass;
+    job._cancel = &render->_stop;
+
+    for (sample = 0; sample < render->_max_samples; sample++) {
+        pthread_mutex_lock(&render->_mutex);
+        stop = render->_stop;
+        pthread_mutex_unlock(&render->_mutex);
+        if (stop) break;
+
+        sampleOffset(sample, &job._offset_x, &job._offset_y);
+        job._pass = sample;
+        runTiles(render->_width, render->_height, DEFAULT_TILE_SIZE,
+                 g_number_threads, renderTile, &job);
+
+        pthread_mutex_lock(&render->_mutex);
+        if (render->_stop) {
+            pthread_mutex_unlock(&render->_mutex);
+            break;
+        }
+        for (k = 0; k < size; k++) {
+            render->_accumulation[k]._red += pass[k]._red;
+            render->_accumulation[k]._green += pass[k]._green;
+            render->_accumulation[k]._blue += pass[k]._blue;
+        }
+        render->_number_samples = sample + 1;
+        pthread_mutex_unlock(&render->_mutex);
+    }
+
+    return NULL;
+}
+
+
+void startProgressiveRender(ProgressiveRender *render, const Scene *scene,
+                            int width, int height, int max_samples) {
+    int size = width * height;
+
+    if (!scene->_finalized) {
+        printf("Error: The scene must be finalized before it is ray-traced.\n");
+        exit(1);
+    }
+
+    // the estimate is tone-mapped here while the thread renders
+    prepareToneMap();
+
+    render->_scene = scene;
+    render->_width = width;
+    render->_height = height;
+    render->_max_samples = max_samples > 0 ? max_samples : PROGRESSIVE_MAX_SAMPLES;
+    render->_number_samples = 0;
+    render->_stop = 0;
+
+    render->_accumulation = (Color *) calloc(size, sizeof(Color));
+    render->_row = (Color *) malloc(width * sizeof(Color));
+    if (!render->_accumulation || !render->_row) {
+        printf("Error: Couldn't allocate memory for a %dx%d progressive render\n", width, height);
+        exit(1);
+    }
+
+    initFrameBuffer(&render->_pass);
+    resizeFrameBuffer(&render->_pass, width, height, FRAMEBUFFER_RGB32F);
+
+    pthread_mutex_init(&render->_mutex, NULL);
+    if (pthread_create(&render->_thread, NULL, progressiveThread, render) != 0) {
+        printf("Error: Couldn't start the progressive render thread\n");
+        exit(1);
+    }
+}
+
+
+int getProgressiveSamples(ProgressiveRender *render) {
+    int number_samples;
+
+    pthread_mutex_lock(&render->_mutex);
+    number_samples = render->_number_samples;
+    pthread_mutex_unlock(&render->_mutex);
+
+    return number_samples;
+}
+
+
+int getProgressiveEstimate(ProgressiveRender *render, unsigned char *texture) {
+    int width = render->_width;
+    int number_samples;
+    int i;
+    int j;
+
+    pthread_mutex_lock(&render->_mutex);
+
+    number_samples = render->_number_samples;
+    if (number_samples > 0) {
+        float inv_samples = 1.0f / number_samples;
+
+        for (i = 0; i < render->_height; i++) {
+            const Color *sum = render->_accumulation + width * i;
+            for (j = 0; j < width; j++) {
+                render->_row[j]._red = sum[j]._red * inv_samples;
+                render->_row[j]._green = sum[j]._green * inv_samples;
+                render->_row[j]._blue = sum[j]._blue * inv_samples;
+            }
+            toneMapValues(&g_tone_map, (const float *) render->_row, 3 * width,
+                          texture + 3 * width * i, FRAMEBUFFER_RGB8);
+        }
+    }
+
+    pthread_mutex_unlock(&render->_mutex);
+
+    return number_samples;
+}
+
+
+void stopProgressiveRender(ProgressiveRender *render) {
+    // the tiles read _stop without the lock
+    pthread_mutex_lock(&render->_mutex);
+    __atomic_store_n(&render->_stop, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&render->_mutex);
+
+    pthread_join(render->_thread, NULL);
+    pthread_mutex_destroy(&render->_mutex);
+
+    free(render->_accumulation);
+    freeFrameBuffer(&render->_pass);
+    free(render->_row);
 }
@@ -1,20 +1,182 @@
-#ifdef __APPLE__
-#include <GLUT/glut.h>
-#else
-#include <GL/glut.h>
-#endif
+#include <pthread.h>
 
 #include "Scene.h"
+#include "FrameBuffer.h"
+#include "Profile.h"
+#include "Sampler.h"
 
 
 #ifndef RAYTRACE_H
 #define RAYTRACE_H
 
 
-// Ray-trace the given scene.
+// Ray-trace the given scene (finalizeScene must have been called).
 // Write the output (the ray-traced image) on a texture of size 
-// width by height pixels. 
-void rayTraceScene(Scene scene, int width, int height, GLubyte** texture);
+// width by height pixels. The texture is allocated here and must be
+// released with free().
+void rayTraceScene(const Scene* scene, int width, int height, unsigned char** texture);
+
+// Ray-trace the given scene into a caller-owned frame buffer, at the
+// size and in the format the buffer was last resized to. Nothing is
+// allocated, so the same buffer can be reused for every frame.
+void rayTraceSceneToBuffer(const Scene* scene, FrameBuffer* frame);
+
+// Same as rayTraceSceneToBuffer, with number_threads threads (0: as
+// set by setRayTraceThreads) and no profile: several of these can run
+// at once from different threads, on different scenes and buffers, as
+// when the frames of an animation are rendered side by side.
+void rayTraceSceneToBufferThreads(const Scene* scene, FrameBuffer* frame, int number_threads);
+
+// Called with each row of 8-bit RGB pixels of the image;
+// row 0 is the top of the image.
+typedef void (*RowFunc)(const unsigned char* rgb, int row, void* data);
+
+// Ray-trace the given scene and hand the image to func row by row,
+// from top to bottom, without keeping the whole image in memory.
+void rayTraceSceneRows(const Scene* scene, int width, int height,
+                       RowFunc func, void* data);
+
+// Set the number of threads used by rayTraceScene.
+// 0 (the default) uses one thread per core. The image is the same
+// for any number of threads.
+void setRayTraceThreads(int number_threads);
+
+// Set the number of primary rays traced together with SIMD kernels:
+// PACKET_SCALAR, PACKET_SSE, PACKET_AVX2 or PACKET_AVX512 (see
+// RayPacket.h). 0 (the default) uses the widest packets the CPU
+// supports; a size the CPU does not support falls back to the widest
+// one it does. The image is the same for any packet size.
+void setRayTracePacketSize(int packet_size);
+
+// Reflection and refraction: a ray hitting a reflective or refractive
+// material (see Material) spawns new rays. A pixel traces rays up to
+// a maximum depth (number of bounces after the primary ray) and never
+// more than its ray budget, primary ray included. Past a few bounces,
+// weak rays are also stopped at random (Russian roulette): the image
+// stays the same on average.
+#define DEFAULT_TRACE_DEPTH 5
+#define MAX_TRACE_DEPTH 32
+#define DEFAULT_RAY_BUDGET 64
+
+// Set the maximum depth, from 0 (no reflection or refraction) to
+// MAX_TRACE_DEPTH. Not to be called while a render is running.
+void setRayTraceDepth(int max_depth);
+
+// Set the number of rays a pixel may trace (at least 1).
+// Not to be called while a render is running.
+void setRayTraceRayBudget(int ray_budget);
+
+// Set the number of shadow rays traced from each hit point. 0 (the
+// default) traces one to every light that reaches the point. With
+// many lights, n > 0 traces n rays, to lights picked at random in
+// proportion to their contribution before shadows: the image gets
+// noisier but its cost no longer grows with the number of lights.
+// Not to be called while a render is running.
+void setRayTraceLightSamples(int light_samples);
+
+// Area lights (see Light): a hit point traces shadow rays to n * n
+// points spread over the light, one in each cell of an n by n grid.
+// The first four cover the four quarters of the light, and the others
+// are only traced if these do not agree (in the penumbra), so fully
+// lit and fully shadowed points cost four rays. The rays of a hit
+// point are traced as packets.
+#define AREA_MAX_SAMPLES 16
+#define DEFAULT_AREA_SAMPLES AREA_MAX_SAMPLES
+
+// Set the number of shadow rays per area light and hit point: 1 (hard
+// shadows, as from a point light at the center), 4 or
+// AREA_MAX_SAMPLES. Not to be called while a render is running.
+void setRayTraceAreaSamples(int samples);
+
+// Set the sampler of the stochastic effects (anti-aliasing sample
+// positions, lens samples, light picks and Russian roulette):
+// SAMPLER_RANDOM (the default), SAMPLER_SOBOL or SAMPLER_BLUE_NOISE
+// (see Sampler.h). The image depends on the sampler but never on the
+// threads. Not to be called while a render is running.
+void setRayTraceSampler(int sampler);
+
+// Adaptive anti-aliasing: rayTraceScene traces one ray per pixel,
+// then more rays in the pixels whose neighbourhood has a contrast
+// above a threshold (per channel, (max - min) / (max + min)). Those
+// pixels get 4 samples spread over the pixel, and up to the maximum
+// number of samples if these still differ.
+#define AA_MAX_SAMPLES 16
+#define DEFAULT_AA_SAMPLES AA_MAX_SAMPLES
+#define DEFAULT_AA_CONTRAST 0.15f
+
+// Set the number of samples of the refined pixels: 1 (no
+// anti-aliasing), 4 or AA_MAX_SAMPLES, and the contrast threshold.
+// Not to be called while a render is running.
+void setRayTraceAntialiasing(int samples, float contrast);
+
+// Set the operator turning pixel colors into display values:
+// TONEMAP_DEFAULT, TONEMAP_SRGB, TONEMAP_REINHARD or TONEMAP_ACES (see
+// ToneMap.h). Not to be called while a render is running.
+void setRayTraceToneMap(int op);
+
+
+// Return the counters of the last frame rendered by rayTraceScene,
+// rayTraceSceneToBuffer or rayTraceSceneRows (not to be read while a
+// render is running), or NULL if the ray tracer was compiled without
+// RAYTRACE_PROFILE (see Profile.h). Progressive renders are not
+// profiled.
+const FrameProfile* getRayTraceProfile(void);
+
+
+// Number of passes of a progressive render if none is given
+#define PROGRESSIVE_MAX_SAMPLES 256
+
+// Progressive rendering: a background thread renders the scene over
+// and over with one sample per pixel per pass, each pass at another
+// position inside the pixels, and accumulates the samples. The
+// current estimate (the mean of the passes done so far) can be read
+// at any time. The first pass gives the same image as rayTraceScene
+// without anti-aliasing.
+struct _ProgressiveRender {
+    const Scene* _scene;
+    int _width;
+    int _height;
+    int _max_samples;
+
+    // Sum of the samples of each pixel (width * height, row 0 at the
+    // bottom) and the number of passes it holds
+    Color* _accumulation;
+    int _number_samples;
+
+    // Pass being rendered (RGB32F)
+    FrameBuffer _pass;
+
+    // Row converted by getProgressiveEstimate
+    Color* _row;
+
+    pthread_t _thread;
+    pthread_mutex_t _mutex;
+    int _stop;
+};
+
+typedef struct _ProgressiveRender ProgressiveRender;
+
+
+// Start rendering the scene (which must stay alive and unchanged until
+// the render is stopped) in the background, for at most max_samples
+// passes (0: PROGRESSIVE_MAX_SAMPLES).
+void startProgressiveRender(ProgressiveRender* render, const Scene* scene,
+                            int width, int height, int max_samples);
+
+// Return the number of passes accumulated so far
+int getProgressiveSamples(ProgressiveRender* render);
+
+// Write the current estimate in texture (3 * width * height bytes, in
+// the layout of rayTraceScene) and return the number of passes it is
+// made of. texture is left untouched while the first pass is running.
+int getProgressiveEstimate(ProgressiveRender* render, unsigned char* texture);
+
+// Stop the render and release its memory. The tiles of the current
+// pass that are not started yet are skipped, so this returns after the
+// tiles in flight rather than after the whole pass: the scene can then
+// be changed and a new render started at once (the way rtviewer
+// follows the camera and lights being moved).
+void stopProgressiveRender(ProgressiveRender* render);
 
 #endif
 
@@ -0,0 +1,264 @@
+#include <math.h>
+#include <pthread.h>
+
+#include "Sampler.h"
+
+
+#define BLUE_NOISE_PIXELS (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE)
+
+// Width of the Gaussian filter of the void-and-cluster method, in
+// pixels
+#define BLUE_NOISE_SIGMA 1.5f
+
+// 1 / golden ratio: the index step of the blue noise sampler
+#define GOLDEN_RATIO_STEP 0.6180339887f
+
+
+// Blue noise tile: the rank of each pixel, as (rank + 0.5) /
+// BLUE_NOISE_PIXELS. Built once, by the first blue noise sampler, and
+// only read after that.
+static float g_blue_noise[BLUE_NOISE_PIXELS];
+static pthread_once_t g_blue_noise_once = PTHREAD_ONCE_INIT;
+
+
+unsigned int hashPCG(unsigned int x) {
+    unsigned int state = x * 747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+
+    return (word >> 22) ^ word;
+}
+
+
+// [0, 1) from the high 24 bits of x
+static float toUnit(unsigned int x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static unsigned int reverseBits(unsigned int x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+
+    return x;
+}
+
+
+// Owen scrambling of the bits of x (read from the highest one) keyed
+// by seed: the Laine-Karras permutation applied to the reversed bits
+static unsigned int owenScramble(unsigned int x, unsigned int seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+
+    return reverseBits(x);
+}
+
+
+// Dimension 0 (van der Corput) and 1 of the Sobol sequence, as 32-bit
+// fractions. The direction numbers of dimension 1 are v_k = v_(k-1) ^
+// (v_(k-1) >> 1), starting from 1/2.
+static void sobol2D(unsigned int index, unsigned int* x, unsigned int* y) {
+    unsigned int v = 0x80000000u;
+
+    *x = reverseBits(index);
+    *y = 0;
+    for (; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) *y ^= v;
+    }
+}
+
+
+// Key of dimension of the sample
+static unsigned int dimensionKey(const Sampler* sampler, unsigned int dimension) {
+    return hashPCG(sampler->_key + hashPCG(dimension));
+}
+
+
+// Energy added to the pixels at (dx, dy) (toroidal) from a set pixel
+static float blueNoiseKernel(int dx, int dy) {
+    float x = (float) (dx < BLUE_NOISE_SIZE - dx ? dx : BLUE_NOISE_SIZE - dx);
+    float y = (float) (dy < BLUE_NOISE_SIZE - dy ? dy : BLUE_NOISE_SIZE - dy);
+
+    return expf(-(x * x + y * y) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+}
+
+
+// Set (sign 1) or clear (sign -1) pixel p of the binary pattern and
+// update the energy of every pixel
+static void toggleBlueNoisePixel(unsigned char* pattern, float* energy, const float* kernel,
+                                 int p, int sign) {
+    int px = p % BLUE_NOISE_SIZE;
+    int py = p / BLUE_NOISE_SIZE;
+    int q;
+
+    pattern[p] = sign > 0;
+    for (q = 0; q < BLUE_NOISE_PIXELS; q++) {
+        int dx = (q % BLUE_NOISE_SIZE - px) & (BLUE_NOISE_SIZE - 1);
+        int dy = (q / BLUE_NOISE_SIZE - py) & (BLUE_NOISE_SIZE - 1);
+        energy[q] += sign * kernel[dy * BLUE_NOISE_SIZE + dx];
+    }
+}
+
+
+// Set pixel with the highest energy (the tightest cluster) if set is
+// 1, the unset one with the lowest energy (the largest void) if set
+// is 0
+static int findBlueNoisePixel(const unsigned char* pattern, const float* energy, int set) {
+    int best = -1;
+    int p;
+
+    for (p = 0; p < BLUE_NOISE_PIXELS; p++) {
+        if (pattern[p] != set) continue;
+        if (best < 0 || (set ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+    }
+
+    return best;
+}
+
+
+// Build the blue noise tile with the void-and-cluster method (Ulichney
+// 1993): a pattern of a tenth of the pixels relaxed until its tightest
+// cluster is its largest void, then ranks given by removing its
+// tightest clusters one by one and by filling the largest voids. The
+// initial pattern comes from hashPCG, so the tile is always the same.
+static void buildBlueNoise(void) {
+    static float kernel[BLUE_NOISE_PIXELS];
+    static float energy[BLUE_NOISE_PIXELS];
+    static float initial_energy[BLUE_NOISE_PIXELS];
+    static unsigned char pattern[BLUE_NOISE_PIXELS];
+    static unsigned char initial_pattern[BLUE_NOISE_PIXELS];
+    static int rank[BLUE_NOISE_PIXELS];
+    int number_set = 0;
+    unsigned int k = 0;
+    int iteration;
+    int p;
+
+    for (p = 0; p < BLUE_NOISE_PIXELS; p++) {
+        kernel[p] = blueNoiseKernel(p % BLUE_NOISE_SIZE, p / BLUE_NOISE_SIZE);
+        energy[p] = 0.0f;
+        pattern[p] = 0;
+    }
+
+    while (number_set < BLUE_NOISE_PIXELS / 10) {
+        p = hashPCG(k++) % BLUE_NOISE_PIXELS;
+        if (pattern[p]) continue;
+        toggleBlueNoisePixel(pattern, energy, kernel, p, 1);
+        number_set++;
+    }
+
+    // move the tightest cluster to the largest void until it stays
+    for (iteration = 0; iteration < BLUE_NOISE_PIXELS; iteration++) {
+        int cluster = findBlueNoisePixel(pattern, energy, 1);
+        int hole;
+
+        toggleBlueNoisePixel(pattern, energy, kernel, cluster, -1);
+        hole = findBlueNoisePixel(pattern, energy, 0);
+        toggleBlueNoisePixel(pattern, energy, kernel, hole, 1);
+        if (hole == cluster) break;
+    }
+
+    for (p = 0; p < BLUE_NOISE_PIXELS; p++) {
+        initial_pattern[p] = pattern[p];
+        initial_energy[p] = energy[p];
+    }
+
+    for (k = number_set; k-- > 0;) {
+        p = findBlueNoisePixel(pattern, energy, 1);
+        toggleBlueNoisePixel(pattern, energy, kernel, p, -1);
+        rank[p] = k;
+    }
+
+    // past half the pixels, the largest void of the set pixels is also
+    // the tightest cluster of the unset ones, so the same step goes on
+    for (p = 0; p < BLUE_NOISE_PIXELS; p++) {
+        pattern[p] = initial_pattern[p];
+        energy[p] = initial_energy[p];
+    }
+    for (k = number_set; k < BLUE_NOISE_PIXELS; k++) {
+        p = findBlueNoisePixel(pattern, energy, 0);
+        toggleBlueNoisePixel(pattern, energy, kernel, p, 1);
+        rank[p] = k;
+    }
+
+    for (p = 0; p < BLUE_NOISE_PIXELS; p++) {
+        g_blue_noise[p] = (rank[p] + 0.5f) / BLUE_NOISE_PIXELS;
+    }
+}
+
+
+// Number of dimension from the blue noise tile, shifted by the key of
+// the dimension and stepped along the golden ratio by index
+static float blueNoiseSample(const Sampler* sampler, unsigned int dimension) {
+    unsigned int key = hashPCG(sampler->_key ^ hashPCG(dimension));
+    int x = (sampler->_x + (int) (key & 0xffffu)) & (BLUE_NOISE_SIZE - 1);
+    int y = (sampler->_y + (int) (key >> 16)) & (BLUE_NOISE_SIZE - 1);
+    float u = g_blue_noise[y * BLUE_NOISE_SIZE + x] + sampler->_index * GOLDEN_RATIO_STEP;
+
+    u -= floorf(u);
+    return u < 1.0f ? u : 0.0f;
+}
+
+
+void startSampler(Sampler* sampler, int type, int x, int y, unsigned int seed,
+                  unsigned int index) {
+    sampler->_type = type;
+    sampler->_x = x;
+    sampler->_y = y;
+    sampler->_index = index;
+    sampler->_dimension = 0;
+
+    // the blue noise tile is the same for every pixel: only the seed
+    // keys its shifts
+    if (type == SAMPLER_BLUE_NOISE) {
+        pthread_once(&g_blue_noise_once, buildBlueNoise);
+        sampler->_key = hashPCG(seed);
+    } else {
+        sampler->_key = hashPCG(hashPCG(hashPCG((unsigned int) x) + (unsigned int) y) + seed);
+    }
+}
+
+
+float nextSample(Sampler* sampler) {
+    unsigned int dimension = sampler->_dimension++;
+    unsigned int key;
+    unsigned int x;
+    unsigned int y;
+
+    switch (sampler->_type) {
+        case SAMPLER_SOBOL:
+            key = dimensionKey(sampler, dimension);
+            sobol2D(owenScramble(sampler->_index, key), &x, &y);
+            return toUnit(owenScramble(x, hashPCG(key)));
+        case SAMPLER_BLUE_NOISE:
+            return blueNoiseSample(sampler, dimension);
+        default:
+            return toUnit(hashPCG(dimensionKey(sampler, dimension) ^ sampler->_index));
+    }
+}
+
+
+void nextSample2D(Sampler* sampler, float* u, float* v) {
+    unsigned int key;
+    unsigned int x;
+    unsigned int y;
+
+    if (sampler->_type != SAMPLER_SOBOL) {
+        *u = nextSample(sampler);
+        *v = nextSample(sampler);
+        return;
+    }
+
+    // both numbers from the same shuffled index, so that the pair
+    // keeps the stratification of the Sobol points
+    key = dimensionKey(sampler, sampler->_dimension);
+    sobol2D(owenScramble(sampler->_index, key), &x, &y);
+    *u = toUnit(owenScramble(x, hashPCG(key)));
+    *v = toUnit(owenScramble(y, hashPCG(key + 1)));
+    sampler->_dimension += 2;
+}
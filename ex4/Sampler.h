@@ -0,0 +1,71 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+
+// Samplers: the numbers in [0, 1) driving the stochastic effects
+// (positions of the anti-aliasing samples, lens samples, light picks,
+// Russian roulette).
+// A sample is given by a pixel, a seed and an index, and each of its
+// numbers by a dimension. The numbers are computed from these counters
+// alone, with no state carried from one pixel or sample to the next
+// and nothing shared between threads, so an image does not depend on
+// the tiles, threads or order in which it is rendered.
+//
+// SAMPLER_RANDOM hashes the counters (PCG hash): independent random
+// numbers. SAMPLER_SOBOL takes the dimensions two by two from the
+// first two dimensions of the Sobol sequence, scrambled per pixel and
+// per pair (Owen scrambling, Burley 2020): the first 2^k samples of a
+// pixel spread evenly over each pair of dimensions. SAMPLER_BLUE_NOISE
+// reads a blue noise tile, shifted per dimension and advanced along
+// the golden ratio per index: one sample per pixel already spreads
+// its error over high frequencies across neighbouring pixels.
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+
+#define DEFAULT_SAMPLER SAMPLER_RANDOM
+
+// First dimensions of a sample, by use: position inside the pixel and
+// on the lens (two each), then the numbers drawn while shading
+#define SAMPLE_PIXEL 0
+#define SAMPLE_LENS 2
+#define SAMPLE_SHADING 4
+
+// Width and height of the blue noise tile (a power of 2)
+#define BLUE_NOISE_SIZE 64
+
+
+// Counters of one sample
+struct _Sampler {
+    int _type;
+    int _x;
+    int _y;
+
+    // Hash of the pixel and the seed
+    unsigned int _key;
+
+    unsigned int _index;
+
+    // Dimension of the next number
+    unsigned int _dimension;
+};
+
+typedef struct _Sampler Sampler;
+
+
+// Set up sample index of pixel (x, y) with the given seed (different
+// seeds give independent sequences), from dimension 0, for the
+// sampler type (SAMPLER_)
+void startSampler(Sampler* sampler, int type, int x, int y, unsigned int seed,
+                  unsigned int index);
+
+// Next number of the sample
+float nextSample(Sampler* sampler);
+
+// Next two numbers of the sample, taken as one point of [0, 1)^2
+void nextSample2D(Sampler* sampler, float* u, float* v);
+
+// Hash of x (PCG output permutation, O'Neill 2014)
+unsigned int hashPCG(unsigned int x);
+
+#endif
@@ -1,60 +1,771 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #include "Scene.h"
 
 
+// Grow *array (holding used elements of size bytes) so that it can
+// hold at least count elements.
+// A capacity smaller than used means the array is borrowed (it points
+// into a mapped scene file): it is then copied to the heap.
+static void growArray(void** array, int* capacity, int used, int count, size_t size) {
+    int new_capacity;
+    void* new_array;
+
+    if (count <= *capacity) return;
+
+    new_capacity = *capacity > 0 ? *capacity : 8;
+    while (new_capacity < count) new_capacity *= 2;
+
+    if (*capacity < used) {
+        new_array = malloc(new_capacity * size);
+        if (new_array) memcpy(new_array, *array, used * size);
+    } else {
+        new_array = realloc(*array, new_capacity * size);
+    }
+
+    if (!new_array) {
+        printf("Error: Couldn't allocate memory for %d scene objects\n", new_capacity);
+        exit(1);
+    }
+
+    *array = new_array;
+    *capacity = new_capacity;
+}
+
+
+void initScene(Scene* scene) {
+    scene->_number_spheres = 0;
+    scene->_capacity_spheres = 0;
+    scene->_spheres = NULL;
+
+    scene->_background_color._red = 1.0f;
+    scene->_background_color._green = 1.0f;
+    scene->_background_color._blue = 1.0f;
+
+    initCamera(&scene->_camera);
+
+    scene->_ambient._red = 0.2f;
+    scene->_ambient._green = 0.2f;
+    scene->_ambient._blue = 0.2f;
+
+    scene->_number_lights = 0;
+    scene->_capacity_lights = 0;
+    scene->_lights = NULL;
+
+    scene->_number_meshes = 0;
+    scene->_capacity_meshes = 0;
+    scene->_meshes = NULL;
+
+    scene->_number_shapes = 0;
+    scene->_capacity_shapes = 0;
+    scene->_shapes = NULL;
+
+    initBVH(&scene->_bvh);
+
+    initSphereSoA(&scene->_soa);
+    scene->_materials = NULL;
+
+    initBVH(&scene->_triangle_bvh);
+
+    initTriangleSoA(&scene->_triangles);
+    scene->_light_sides = NULL;
+
+    initBVH(&scene->_light_bvh);
+    scene->_light_node_power = NULL;
+    scene->_light_node_range = NULL;
+
+    scene->_number_prototypes = 0;
+    scene->_capacity_prototypes = 0;
+    scene->_prototypes = NULL;
+
+    scene->_number_instances = 0;
+    scene->_capacity_instances = 0;
+    scene->_instances = NULL;
+
+    initBVH(&scene->_instance_bvh);
+
+    scene->_mapping = NULL;
+    scene->_mapping_size = 0;
+    scene->_mapped_hierarchies = 0;
+
+    scene->_finalized = 0;
+}
+
+
+void reserveScene(Scene* scene, int number_spheres, int number_lights) {
+    growArray((void**) &scene->_spheres, &scene->_capacity_spheres,
+              scene->_number_spheres, number_spheres, sizeof(Sphere));
+    growArray((void**) &scene->_lights, &scene->_capacity_lights,
+              scene->_number_lights, number_lights, sizeof(Light));
+}
+
+
+// Forget the hierarchies borrowed from a scene file, so that
+// finalizeScene builds them again over the new objects
+static void dropMappedHierarchies(Scene* scene) {
+    if (!scene->_mapped_hierarchies) return;
+
+    initBVH(&scene->_bvh);
+    initSphereSoA(&scene->_soa);
+    scene->_materials = NULL;
+    initBVH(&scene->_triangle_bvh);
+    initTriangleSoA(&scene->_triangles);
+    scene->_mapped_hierarchies = 0;
+}
+
+
+int addSphere(Scene* scene, const Sphere* sphere) {
+    int idx = scene->_number_spheres;
+
+    dropMappedHierarchies(scene);
+    growArray((void**) &scene->_spheres, &scene->_capacity_spheres,
+              idx, idx + 1, sizeof(Sphere));
+    scene->_spheres[idx] = *sphere;
+    scene->_number_spheres++;
+    scene->_finalized = 0;
+
+    return idx;
+}
+
+
+int addLight(Scene* scene, const Light* light) {
+    int idx = scene->_number_lights;
+
+    growArray((void**) &scene->_lights, &scene->_capacity_lights,
+              idx, idx + 1, sizeof(Light));
+    scene->_lights[idx] = *light;
+    scene->_number_lights++;
+    scene->_finalized = 0;
+
+    return idx;
+}
+
+
+int addShape(Scene* scene, const Shape* shape) {
+    int idx = scene->_number_shapes;
+
+    growArray((void**) &scene->_shapes, &scene->_capacity_shapes,
+              idx, idx + 1, sizeof(Shape));
+    scene->_shapes[idx] = *shape;
+    scene->_number_shapes++;
+    scene->_finalized = 0;
+
+    return idx;
+}
+
+
+int addMesh(Scene* scene, const TriangleMesh* mesh, const Material* material) {
+    int idx = scene->_number_meshes;
+    SceneMesh* scene_mesh;
+
+    dropMappedHierarchies(scene);
+    growArray((void**) &scene->_meshes, &scene->_capacity_meshes,
+              idx, idx + 1, sizeof(SceneMesh));
+    scene_mesh = &scene->_meshes[idx];
+    scene_mesh->_mesh = *mesh;
+    scene_mesh->_material = *material;
+    scene_mesh->_owned = 1;
+
+    if (!scene_mesh->_mesh._vertex_normals) computeVertexNormals(&scene_mesh->_mesh);
+
+    scene->_number_meshes++;
+    scene->_finalized = 0;
+
+    return idx;
+}
+
+
+int addPrototype(Scene* scene, const Scene* prototype) {
+    int idx = scene->_number_prototypes;
+
+    if (prototype->_number_lights > 0 || prototype->_number_shapes > 0
+        || prototype->_number_prototypes > 0) {
+        printf("Error: A prototype only holds spheres and meshes\n");
+        exit(1);
+    }
+
+    growArray((void**) &scene->_prototypes, &scene->_capacity_prototypes,
+              idx, idx + 1, sizeof(Scene));
+    scene->_prototypes[idx] = *prototype;
+    scene->_number_prototypes++;
+    scene->_finalized = 0;
+
+    return idx;
+}
+
+
+int addInstance(Scene* scene, int prototype, const Transform* transform) {
+    int idx = scene->_number_instances;
+    Instance* instance;
+
+    if (prototype < 0 || prototype >= scene->_number_prototypes) {
+        printf("Error: No prototype %d for an instance\n", prototype);
+        exit(1);
+    }
+
+    growArray((void**) &scene->_instances, &scene->_capacity_instances,
+              idx, idx + 1, sizeof(Instance));
+    instance = &scene->_instances[idx];
+    instance->_prototype = prototype;
+    instance->_transform = *transform;
+    if (!invertTransform(transform, &instance->_inverse)) {
+        printf("Error: The transform of instance %d cannot be inverted\n", idx);
+        exit(1);
+    }
+    scene->_number_instances++;
+    scene->_finalized = 0;
+
+    return idx;
+}
+
+
+// Bounds of the spheres, to be freed by the caller
+static AABB* computeSphereBoxes(const Scene* scene) {
+    AABB* boxes;
+    int i;
+
+    boxes = (AABB*) malloc(scene->_number_spheres * sizeof(AABB));
+    if (!boxes) {
+        printf("Error: Couldn't allocate memory for the scene bounds\n");
+        exit(1);
+    }
+
+    for (i = 0; i < scene->_number_spheres; i++) {
+        const Sphere* s = &scene->_spheres[i];
+
+        // pad the box a little so that rounding in the ray/box test
+        // never misses a hit found by the ray/sphere test
+        float pad = 1e-5f * (s->_radius + fabsf(s->_center._x)
+                             + fabsf(s->_center._y) + fabsf(s->_center._z));
+        float r = s->_radius + pad;
+
+        boxes[i]._lower_bound._x = s->_center._x - r;
+        boxes[i]._lower_bound._y = s->_center._y - r;
+        boxes[i]._lower_bound._z = s->_center._z - r;
+
+        boxes[i]._upper_bound._x = s->_center._x + r;
+        boxes[i]._upper_bound._y = s->_center._y + r;
+        boxes[i]._upper_bound._z = s->_center._z + r;
+    }
+
+    return boxes;
+}
+
+
+// (Re)build the acceleration structure over the spheres
+static void buildSceneBVH(Scene* scene) {
+    AABB* boxes;
+
+    freeBVH(&scene->_bvh);
+    if (scene->_number_spheres == 0) return;
+
+    boxes = computeSphereBoxes(scene);
+    buildBVH(&scene->_bvh, boxes, scene->_number_spheres);
+
+    free(boxes);
+}
+
+
+// Copy the sphere geometry in BVH leaf order, and the materials
+// in the same order
+static void buildSphereSoA(Scene* scene) {
+    int n = scene->_bvh._number_indices;
+    int k;
+
+    allocateSphereSoA(&scene->_soa, n);
+
+    free(scene->_materials);
+    scene->_materials = NULL;
+    if (n == 0) return;
+
+    scene->_materials = (Material*) malloc(n * sizeof(Material));
+    if (!scene->_materials) {
+        printf("Error: Couldn't allocate memory for %d materials\n", n);
+        exit(1);
+    }
+
+    for (k = 0; k < n; k++) {
+        int i = scene->_bvh._indices[k];
+        const Sphere* s = &scene->_spheres[i];
+
+        setSphereSoA(&scene->_soa, k, s->_center, s->_radius, i);
+        scene->_materials[k]._color = s->_color;
+        scene->_materials[k]._color_spec = s->_color_spec;
+        scene->_materials[k]._color_reflect = s->_color_reflect;
+        scene->_materials[k]._color_refract = s->_color_refract;
+        scene->_materials[k]._index_of_refraction = s->_index_of_refraction;
+    }
+}
+
+
+// (Re)build the acceleration structure over the triangles of every
+// mesh. Triangle i of the BVH is triangle i - first[m] of mesh m, where
+// first[m] is the number of triangles in the meshes before m.
+static void buildTriangleBVH(Scene* scene, int* first) {
+    AABB* boxes;
+    int number_triangles = 0;
+    int m;
+
+    freeBVH(&scene->_triangle_bvh);
+
+    for (m = 0; m < scene->_number_meshes; m++) {
+        first[m] = number_triangles;
+        number_triangles += scene->_meshes[m]._mesh._number_triangles;
+    }
+    if (number_triangles == 0) return;
+
+    boxes = (AABB*) malloc(number_triangles * sizeof(AABB));
+    if (!boxes) {
+        printf("Error: Couldn't allocate memory for the scene bounds\n");
+        exit(1);
+    }
+
+    for (m = 0; m < scene->_number_meshes; m++) {
+        const TriangleMesh* mesh = &scene->_meshes[m]._mesh;
+        int i;
+
+        for (i = 0; i < mesh->_number_triangles; i++) {
+            const Triple* t = &mesh->_triangles[i];
+            Vector3 p[3];
+            AABB* box = &boxes[first[m] + i];
+            float pad;
+            int j;
+
+            p[0] = mesh->_vertices[t->_v0];
+            p[1] = mesh->_vertices[t->_v1];
+            p[2] = mesh->_vertices[t->_v2];
+
+            box->_lower_bound = p[0];
+            box->_upper_bound = p[0];
+            for (j = 1; j < 3; j++) {
+                box->_lower_bound._x = fminf(box->_lower_bound._x, p[j]._x);
+                box->_lower_bound._y = fminf(box->_lower_bound._y, p[j]._y);
+                box->_lower_bound._z = fminf(box->_lower_bound._z, p[j]._z);
+                box->_upper_bound._x = fmaxf(box->_upper_bound._x, p[j]._x);
+                box->_upper_bound._y = fmaxf(box->_upper_bound._y, p[j]._y);
+                box->_upper_bound._z = fmaxf(box->_upper_bound._z, p[j]._z);
+            }
+
+            // pad the box as for the spheres
+            pad = 1e-5f * (fabsf(box->_lower_bound._x) + fabsf(box->_lower_bound._y)
+                           + fabsf(box->_lower_bound._z) + fabsf(box->_upper_bound._x)
+                           + fabsf(box->_upper_bound._y) + fabsf(box->_upper_bound._z));
+
+            box->_lower_bound._x -= pad;
+            box->_lower_bound._y -= pad;
+            box->_lower_bound._z -= pad;
+            box->_upper_bound._x += pad;
+            box->_upper_bound._y += pad;
+            box->_upper_bound._z += pad;
+        }
+    }
+
+    buildBVH(&scene->_triangle_bvh, boxes, number_triangles);
+
+    free(boxes);
+}
+
+
+// Copy the triangle vertices in BVH leaf order
+static void buildTriangleSoA(Scene* scene, const int* first) {
+    int n = scene->_triangle_bvh._number_indices;
+    int k;
+
+    allocateTriangleSoA(&scene->_triangles, n);
+
+    for (k = 0; k < n; k++) {
+        int i = scene->_triangle_bvh._indices[k];
+        const TriangleMesh* mesh;
+        const Triple* t;
+        int m;
+        int low = 0;
+        int high = scene->_number_meshes - 1;
+
+        // last mesh starting at or before i
+        while (low < high) {
+            int middle = (low + high + 1) / 2;
+            if (first[middle] <= i) low = middle;
+            else high = middle - 1;
+        }
+        m = low;
+
+        mesh = &scene->_meshes[m]._mesh;
+        t = &mesh->_triangles[i - first[m]];
+        setTriangleSoA(&scene->_triangles, k, mesh->_vertices[t->_v0],
+                       mesh->_vertices[t->_v1], mesh->_vertices[t->_v2], m, i - first[m]);
+    }
+}
+
+
+// Precompute the side of each plane every light is on
+static void computeLightSides(Scene* scene) {
+    int n = scene->_number_lights * scene->_number_shapes;
+    int l;
+    int s;
+
+    free(scene->_light_sides);
+    scene->_light_sides = NULL;
+    if (n == 0) return;
+
+    scene->_light_sides = (float*) malloc(n * sizeof(float));
+    if (!scene->_light_sides) {
+        printf("Error: Couldn't allocate memory for the light sides\n");
+        exit(1);
+    }
+
+    for (l = 0; l < scene->_number_lights; l++) {
+        for (s = 0; s < scene->_number_shapes; s++) {
+            const Shape* shape = &scene->_shapes[s];
+            float side = 0.0f;
+
+            if (shape->_type == SHAPE_PLANE) {
+                computeDotProduct(shape->_geometry._plane._normal,
+                                  scene->_lights[l]._light_pos, &side);
+                side -= shape->_geometry._plane._offset;
+            }
+            scene->_light_sides[l * scene->_number_shapes + s] = side;
+        }
+    }
+}
+
+
+// Build the hierarchy over the light positions, and sum up the power
+// and range of the lights under each node
+static void buildLightBVH(Scene* scene) {
+    BVH* bvh = &scene->_light_bvh;
+    AABB* boxes;
+    int l;
+    int k;
+
+    freeBVH(bvh);
+    free(scene->_light_node_power);
+    free(scene->_light_node_range);
+    scene->_light_node_power = NULL;
+    scene->_light_node_range = NULL;
+    if (scene->_number_lights == 0) return;
+
+    boxes = (AABB*) malloc(scene->_number_lights * sizeof(AABB));
+    if (!boxes) {
+        printf("Error: Couldn't allocate memory for %d lights\n", scene->_number_lights);
+        exit(1);
+    }
+    for (l = 0; l < scene->_number_lights; l++) {
+        boxes[l]._lower_bound = scene->_lights[l]._light_pos;
+        boxes[l]._upper_bound = scene->_lights[l]._light_pos;
+    }
+    buildBVH(bvh, boxes, scene->_number_lights);
+    free(boxes);
+
+    scene->_light_node_power = (float*) malloc(bvh->_number_nodes * sizeof(float));
+    scene->_light_node_range = (float*) malloc(bvh->_number_nodes * sizeof(float));
+    if (!scene->_light_node_power || !scene->_light_node_range) {
+        printf("Error: Couldn't allocate memory for %d lights\n", scene->_number_lights);
+        exit(1);
+    }
+
+    // children come after their parent
+    for (k = bvh->_number_nodes - 1; k >= 0; k--) {
+        const BVHNode* node = &bvh->_nodes[k];
+        float power = 0.0f;
+        float range = 0.0f;
+
+        if (node->_count > 0) {
+            int i;
+            for (i = node->_offset; i < node->_offset + node->_count; i++) {
+                const Light* light = &scene->_lights[bvh->_indices[i]];
+                float r = light->_range > 0.0f ? light->_range : INFINITY;
+
+                power += fmaxf(fmaxf(light->_light_color._red, light->_light_color._green),
+                               light->_light_color._blue);
+                range = fmaxf(range, r);
+            }
+        } else {
+            power = scene->_light_node_power[k + 1] + scene->_light_node_power[node->_offset];
+            range = fmaxf(scene->_light_node_range[k + 1], scene->_light_node_range[node->_offset]);
+        }
+
+        scene->_light_node_power[k] = power;
+        scene->_light_node_range[k] = range;
+    }
+}
+
+
+// Bounds of a finalized prototype, in object space. Return 0 if it is
+// empty.
+static int computePrototypeBounds(const Scene* prototype, AABB* box) {
+    const BVH* bvhs[2];
+    int found = 0;
+    int k;
+
+    bvhs[0] = &prototype->_bvh;
+    bvhs[1] = &prototype->_triangle_bvh;
+    for (k = 0; k < 2; k++) {
+        AABB root;
+
+        if (bvhs[k]->_number_nodes == 0) continue;
+        root._lower_bound = bvhs[k]->_nodes[0]._lower_bound;
+        root._upper_bound = bvhs[k]->_nodes[0]._upper_bound;
+        if (found) {
+            expandAABB(box, &root);
+        } else {
+            *box = root;
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+
+// (Re)build the top level hierarchy over the world bounds of the
+// instances: the boxes of their prototypes, transformed
+static void buildInstanceBVH(Scene* scene) {
+    AABB* object_boxes;
+    AABB* boxes;
+    int* non_empty;
+    int i;
+    int p;
+
+    freeBVH(&scene->_instance_bvh);
+    if (scene->_number_instances == 0) return;
+
+    object_boxes = (AABB*) malloc(scene->_number_prototypes * sizeof(AABB));
+    non_empty = (int*) malloc(scene->_number_prototypes * sizeof(int));
+    boxes = (AABB*) malloc(scene->_number_instances * sizeof(AABB));
+    if (!object_boxes || !non_empty || !boxes) {
+        printf("Error: Couldn't allocate memory for %d instances\n", scene->_number_instances);
+        exit(1);
+    }
+
+    for (p = 0; p < scene->_number_prototypes; p++) {
+        non_empty[p] = computePrototypeBounds(&scene->_prototypes[p], &object_boxes[p]);
+    }
+
+    for (i = 0; i < scene->_number_instances; i++) {
+        const Instance* instance = &scene->_instances[i];
+        const AABB* object_box = &object_boxes[instance->_prototype];
+        int c;
+
+        // an empty prototype is a point: rays entering its box hit
+        // nothing inside
+        if (!non_empty[instance->_prototype]) {
+            boxes[i]._lower_bound._x = instance->_transform._m[0][3];
+            boxes[i]._lower_bound._y = instance->_transform._m[1][3];
+            boxes[i]._lower_bound._z = instance->_transform._m[2][3];
+            boxes[i]._upper_bound = boxes[i]._lower_bound;
+            continue;
+        }
+
+        for (c = 0; c < 8; c++) {
+            Vector3 corner;
+            AABB point;
+
+            corner._x = c & 1 ? object_box->_upper_bound._x : object_box->_lower_bound._x;
+            corner._y = c & 2 ? object_box->_upper_bound._y : object_box->_lower_bound._y;
+            corner._z = c & 4 ? object_box->_upper_bound._z : object_box->_lower_bound._z;
+            transformPoint(&instance->_transform, corner, &point._lower_bound);
+            point._upper_bound = point._lower_bound;
+            if (c == 0) {
+                boxes[i] = point;
+            } else {
+                expandAABB(&boxes[i], &point);
+            }
+        }
+    }
+
+    buildBVH(&scene->_instance_bvh, boxes, scene->_number_instances);
+
+    free(object_boxes);
+    free(non_empty);
+    free(boxes);
+}
+
+
+void finalizeScene(Scene* scene) {
+    int* first = NULL;
+    int p;
+
+    for (p = 0; p < scene->_number_prototypes; p++) {
+        if (!scene->_prototypes[p]._finalized) finalizeScene(&scene->_prototypes[p]);
+    }
+
+    // hierarchies saved in a scene file are used as they are
+    if (!scene->_mapped_hierarchies) {
+        buildSceneBVH(scene);
+        buildSphereSoA(scene);
+
+        if (scene->_number_meshes > 0) {
+            first = (int*) malloc(scene->_number_meshes * sizeof(int));
+            if (!first) {
+                printf("Error: Couldn't allocate memory for %d meshes\n", scene->_number_meshes);
+                exit(1);
+            }
+        }
+        buildTriangleBVH(scene, first);
+        buildTriangleSoA(scene, first);
+        free(first);
+    }
+
+    buildInstanceBVH(scene);
+
+    computeLightSides(scene);
+    buildLightBVH(scene);
+
+    scene->_finalized = 1;
+}
+
+
+void updateSceneLights(Scene* scene) {
+    computeLightSides(scene);
+    buildLightBVH(scene);
+}
+
+
+void refitScene(Scene* scene) {
+    AABB* boxes;
+    int k;
+
+    if (scene->_number_spheres == 0) return;
+
+    boxes = computeSphereBoxes(scene);
+    refitBVH(&scene->_bvh, boxes);
+    free(boxes);
+
+    for (k = 0; k < scene->_soa._count; k++) {
+        int i = scene->_bvh._indices[k];
+        setSphereSoA(&scene->_soa, k, scene->_spheres[i]._center, scene->_spheres[i]._radius, i);
+    }
+}
+
+
+void copySceneFrame(Scene* frame, const Scene* scene) {
+    *frame = *scene;
+
+    // the sphere hierarchy is refit, which keeps its _indices
+    frame->_spheres = NULL;
+    frame->_capacity_spheres = 0;
+    frame->_bvh._nodes = NULL;
+    initSphereSoA(&frame->_soa);
+    frame->_lights = NULL;
+    frame->_capacity_lights = 0;
+    frame->_light_sides = NULL;
+    frame->_light_bvh._nodes = NULL;
+    frame->_light_bvh._indices = NULL;
+    frame->_light_node_power = NULL;
+    frame->_light_node_range = NULL;
+    frame->_mapping = NULL;
+
+    if (scene->_number_spheres > 0) {
+        growArray((void**) &frame->_spheres, &frame->_capacity_spheres, 0,
+                  scene->_number_spheres, sizeof(Sphere));
+        memcpy(frame->_spheres, scene->_spheres, scene->_number_spheres * sizeof(Sphere));
+
+        frame->_bvh._nodes = (BVHNode*) malloc(scene->_bvh._number_nodes * sizeof(BVHNode));
+        if (!frame->_bvh._nodes) {
+            printf("Error: Couldn't allocate memory for %d BVH nodes\n", scene->_bvh._number_nodes);
+            exit(1);
+        }
+        memcpy(frame->_bvh._nodes, scene->_bvh._nodes, scene->_bvh._number_nodes * sizeof(BVHNode));
+
+        allocateSphereSoA(&frame->_soa, scene->_soa._count);
+        refitScene(frame);
+    }
+
+    if (scene->_number_lights > 0) {
+        growArray((void**) &frame->_lights, &frame->_capacity_lights, 0,
+                  scene->_number_lights, sizeof(Light));
+        memcpy(frame->_lights, scene->_lights, scene->_number_lights * sizeof(Light));
+    }
+    updateSceneLights(frame);
+}
+
+
+void freeSceneFrame(Scene* frame) {
+    free(frame->_spheres);
+    free(frame->_bvh._nodes);
+    freeSphereSoA(&frame->_soa);
+    free(frame->_lights);
+    free(frame->_light_sides);
+    freeBVH(&frame->_light_bvh);
+    free(frame->_light_node_power);
+    free(frame->_light_node_range);
+
+    initScene(frame);
+}
+
+
 // Assume that memory for scene has already been allocated
 void createScene(Scene* scene) {
-    // Set the number of objects
-    scene->_number_spheres = 3;
+    Sphere sphere;
+    Shape shape;
+    Light light;
+
+    initScene(scene);
+    reserveScene(scene, 2, 2);
+
+    // Nothing reflects or refracts
+    memset(&sphere, 0, sizeof(sphere));
+    memset(&shape, 0, sizeof(shape));
 
     // Set property of each object:
 
-    // Plane 1: 
-    // (Simulate a plane by a sphere with a "very" large radius)
-    (scene->_spheres[0])._radius = 10000.0f;
+    // Plane 1: the floor, y = -5
+    shape._type = SHAPE_PLANE;
+
+    shape._geometry._plane._normal._x = 0.0f;
+    shape._geometry._plane._normal._y = 1.0f;
+    shape._geometry._plane._normal._z = 0.0f;
+    shape._geometry._plane._offset = -5.0f;
 
-    (scene->_spheres[0])._center._x = 0.0f;
-    (scene->_spheres[0])._center._y = -10005.0f;
-    (scene->_spheres[0])._center._z = 0.0f;
+    shape._material._color._red = 0.25f;
+    shape._material._color._green = 0.25f;
+    shape._material._color._blue = 0.25f;
 
-    (scene->_spheres[0])._color._red = 0.25f;
-    (scene->_spheres[0])._color._green = 0.25f;
-    (scene->_spheres[0])._color._blue = 0.25f;
+    shape._material._color_spec._red = 0.0f;
+    shape._material._color_spec._green = 0.0f;
+    shape._material._color_spec._blue = 0.0f;
 
-    (scene->_spheres[0])._color_spec._red = 0.0f;
-    (scene->_spheres[0])._color_spec._green = 0.0f;
-    (scene->_spheres[0])._color_spec._blue = 0.0f;
+    addShape(scene, &shape);
 
 
     // Sphere 2:
-    (scene->_spheres[1])._radius = 3.0f;
+    sphere._radius = 3.0f;
+
+    sphere._center._x = 4.0f;
+    sphere._center._y = 2.1f;
+    sphere._center._z = -4.0f;
 
-    (scene->_spheres[1])._center._x = 4.0f;
-    (scene->_spheres[1])._center._y = 2.1f;
-    (scene->_spheres[1])._center._z = -4.0f;
+    sphere._color._red = 0.76f;
+    sphere._color._green = 0.73f;
+    sphere._color._blue = 0.69f;
 
-    (scene->_spheres[1])._color._red = 0.76f;
-    (scene->_spheres[1])._color._green = 0.73f;
-    (scene->_spheres[1])._color._blue = 0.69f;
+    sphere._color_spec._red = 1.0f;
+    sphere._color_spec._green = 1.0f;
+    sphere._color_spec._blue = 1.0f;
 
-    (scene->_spheres[1])._color_spec._red = 1.0f;
-    (scene->_spheres[1])._color_spec._green = 1.0f;
-    (scene->_spheres[1])._color_spec._blue = 1.0f;
+    addSphere(scene, &sphere);
 
 
     // Sphere 3:
-    (scene->_spheres[2])._radius = 4.f;
+    sphere._radius = 4.f;
 
-    (scene->_spheres[2])._center._x = -4.0f;
-    (scene->_spheres[2])._center._y = 3.1f;
-    (scene->_spheres[2])._center._z = -4.5f;
+    sphere._center._x = -4.0f;
+    sphere._center._y = 3.1f;
+    sphere._center._z = -4.5f;
 
-    (scene->_spheres[2])._color._red = 0.97f;
-    (scene->_spheres[2])._color._green = 0.74f;
-    (scene->_spheres[2])._color._blue = 0.62f;
+    sphere._color._red = 0.97f;
+    sphere._color._green = 0.74f;
+    sphere._color._blue = 0.62f;
 
-    (scene->_spheres[2])._color_spec._red = 1.0f;
-    (scene->_spheres[2])._color_spec._green = 1.0f;
-    (scene->_spheres[2])._color_spec._blue = 1.0f;
+    sphere._color_spec._red = 1.0f;
+    sphere._color_spec._green = 1.0f;
+    sphere._color_spec._blue = 1.0f;
+
+    addSphere(scene, &sphere);
 
 
     // Background color
@@ -63,12 +774,8 @@ void createScene(Scene* scene) {
     scene->_background_color._blue = 1.0f;
 
 
-    // camera information
-    scene->_camera._x = 0.0f;
-    scene->_camera._y = 0.0f;
-    scene->_camera._z = 10.0f;
-
-    scene->_scale = 0.03f;
+    // camera information: looking down -z from (0, 0, 10)
+    initCamera(&scene->_camera);
 
 
     // ambient color
@@ -77,23 +784,63 @@ void createScene(Scene* scene) {
     scene->_ambient._blue = 0.2f;
 
 
-    // lights information
-    scene->_number_lights = 2;
+    // lights information: two white lights without a range
+    memset(&light, 0, sizeof(light));
+
+    light._light_pos._x = -5.0f;
+    light._light_pos._y = 10.0f;
+    light._light_pos._z = -2.0f;
 
-    (scene->_lights[0])._light_pos._x = -5.0f;
-    (scene->_lights[0])._light_pos._y = 10.0f;
-    (scene->_lights[0])._light_pos._z = -2.0f;
+    light._light_color._red = 1.f;
+    light._light_color._green = 1.f;
+    light._light_color._blue = 1.f;
 
-    (scene->_lights[0])._light_color._red = 1.f;
-    (scene->_lights[0])._light_color._green = 1.f;
-    (scene->_lights[0])._light_color._blue = 1.f;
+    addLight(scene, &light);
 
-    (scene->_lights[1])._light_pos._x = 5.0f;
-    (scene->_lights[1])._light_pos._y = 10.0f;
-    (scene->_lights[1])._light_pos._z = -2.0f;
+    light._light_pos._x = 5.0f;
+    light._light_pos._y = 10.0f;
+    light._light_pos._z = -2.0f;
 
-    (scene->_lights[1])._light_color._red = 1.f;
-    (scene->_lights[1])._light_color._green = 1.f;
-    (scene->_lights[1])._light_color._blue = 1.f;
+    light._light_color._red = 1.f;
+    light._light_color._green = 1.f;
+    light._light_color._blue = 1.f;
+
+    addLight(scene, &light);
+
+    finalizeScene(scene);
 }
 
+
+void freeScene(Scene* scene) {
+    int i;
+
+    if (!scene->_mapped_hierarchies) {
+        freeBVH(&scene->_bvh);
+        freeSphereSoA(&scene->_soa);
+        free(scene->_materials);
+        freeBVH(&scene->_triangle_bvh);
+        freeTriangleSoA(&scene->_triangles);
+    }
+    free(scene->_light_sides);
+    freeBVH(&scene->_light_bvh);
+    free(scene->_light_node_power);
+    free(scene->_light_node_range);
+
+    for (i = 0; i < scene->_number_prototypes; i++) freeScene(&scene->_prototypes[i]);
+    free(scene->_prototypes);
+    free(scene->_instances);
+    freeBVH(&scene->_instance_bvh);
+
+    for (i = 0; i < scene->_number_meshes; i++) {
+        if (scene->_meshes[i]._owned) freeTriangleMeshStructures(&scene->_meshes[i]._mesh);
+    }
+    if (scene->_capacity_meshes > 0) free(scene->_meshes);
+
+    // borrowed arrays belong to the mapping
+    if (scene->_capacity_spheres > 0) free(scene->_spheres);
+    if (scene->_capacity_lights > 0) free(scene->_lights);
+    if (scene->_capacity_shapes > 0) free(scene->_shapes);
+    if (scene->_mapping) munmap(scene->_mapping, scene->_mapping_size);
+
+    initScene(scene);
+}
@@ -1,4 +1,11 @@
+#include <stddef.h>
+
 #include "Geometry.h"
+#include "BVH.h"
+#include "SphereSoA.h"
+#include "TriangleSoA.h"
+#include "TriangleMesh.h"
+#include "Camera.h"
 
 
 #ifndef SCENE_H
@@ -17,34 +24,137 @@ struct _Color {
 typedef struct _Color Color;
 
 
-// Sphere data-structure. 
-// Currently the only possible type of objects in the scene. 
+// Sphere data-structure.
+// The colors and index of refraction are those of Material.
 struct _Sphere {
     float _radius;
     Vector3 _center;
     Color _color;
     Color _color_spec;
+    Color _color_reflect;
+    Color _color_refract;
+    float _index_of_refraction;
 };
 
 typedef struct _Sphere Sphere;
 
 
+// Shading data of an object, kept apart from the geometry used by the
+// intersection tests and only read once a hit is found.
+// _color and _color_spec are the diffuse and specular colors of the
+// Phong model. _color_reflect is the fraction of the light coming from
+// the mirror direction. _color_refract is the fraction that goes
+// through the surface of a dielectric with the given index of
+// refraction (the rest of it is reflected, following Fresnel).
+struct _Material {
+    Color _color;
+    Color _color_spec;
+    Color _color_reflect;
+    Color _color_refract;
+    float _index_of_refraction;
+};
+
+typedef struct _Material Material;
+
+
+// Triangle mesh (see ex5/TriangleMesh.h) with one material for all
+// its triangles. Shading interpolates the _vertex_normals of the mesh.
+struct _SceneMesh {
+    TriangleMesh _mesh;
+    Material _material;
+
+    // 1 if freeScene frees the arrays of the mesh, 0 if they are
+    // borrowed (from a mapped scene file)
+    int _owned;
+};
+
+typedef struct _SceneMesh SceneMesh;
+
+
+// Kinds of analytic shapes (objects with a closed-form intersection
+// test other than spheres)
+#define SHAPE_PLANE 0
+#define SHAPE_BOX 1
+
+
+// Infinite plane: the points p with _normal . p = _offset, where
+// _normal is a unit vector
+struct _Plane {
+    Vector3 _normal;
+    float _offset;
+};
+
+typedef struct _Plane Plane;
+
+
+// Analytic shape: a plane or an axis-aligned box, told apart by _type
+struct _Shape {
+    int _type;
+    union {
+        Plane _plane;
+        AABB _box;
+    } _geometry;
+    Material _material;
+};
+
+typedef struct _Shape Shape;
+
+
+// Light types
+#define LIGHT_POINT 0
+#define LIGHT_SPHERE 1
+#define LIGHT_QUAD 2
+
 // Light data-structure.
+// A light with a _range lights the points closer than _range only, and
+// fades out on the way: its color is scaled by (1 - (d / _range)^2)^2
+// at distance d (from _light_pos). A light with _range = 0 lights
+// every point the same.
+// Area lights cast soft shadows: a sphere of _radius around
+// _light_pos, or the parallelogram of the points _light_pos + u
+// _edge_u + v _edge_v for u and v in [-1/2, 1/2]. They light a point
+// as the mean of point lights of the same color spread over their
+// surface (see setRayTraceAreaSamples). Zeroed fields make a point
+// light.
 struct _Light {
     Color _light_color;
     Vector3 _light_pos;
+    float _range;
+
+    int _type;
+    float _radius;
+    Vector3 _edge_u;
+    Vector3 _edge_v;
 };
 
 typedef struct _Light Light;
 
 
+// Instance of a prototype: geometry defined once (spheres and triangle
+// meshes in object space, see addPrototype) and placed in the scene
+// by a transform. Rays are taken to object space and traced against
+// the hierarchies of the prototype, so copies of a model cost one
+// Instance each rather than copies of its geometry.
+struct _Instance {
+    int _prototype;
+
+    // Object to world, and world to object
+    Transform _transform;
+    Transform _inverse;
+};
+
+typedef struct _Instance Instance;
+
+
 // Scene data-structure:
-// Currently contains only spheres.
-#define MAX_NUMBER_OBJECTS 10
-#define MAX_NUMBER_LIGHTS 7
+// Contains spheres, triangle meshes, analytic shapes and instances.
+// Objects and lights are stored in arrays that grow as they are added.
+// Once every object is added, finalizeScene builds the acceleration
+// structure; the scene can then be ray-traced.
 struct _Scene {
     int _number_spheres;
-    Sphere _spheres[MAX_NUMBER_OBJECTS];
+    int _capacity_spheres;
+    Sphere* _spheres;
 
 
     // put background color
@@ -52,8 +162,7 @@ struct _Scene {
 
 
     // camera information
-    Vector3 _camera;
-    float _scale;
+    Camera _camera;
 
 
     // ambient color for the scene
@@ -62,13 +171,141 @@ struct _Scene {
 
     // Lights in the scene
     int _number_lights;
-    Light _lights[MAX_NUMBER_LIGHTS];
+    int _capacity_lights;
+    Light* _lights;
+
+
+    // Triangle meshes in the scene
+    int _number_meshes;
+    int _capacity_meshes;
+    SceneMesh* _meshes;
+
+
+    // Planes and boxes in the scene (few: each ray tests all of them)
+    int _number_shapes;
+    int _capacity_shapes;
+    Shape* _shapes;
+
+
+    // Prototypes (scenes of spheres and meshes only) and their
+    // instances
+    int _number_prototypes;
+    int _capacity_prototypes;
+    struct _Scene* _prototypes;
+
+    int _number_instances;
+    int _capacity_instances;
+    Instance* _instances;
+
+
+    // Acceleration structure over the spheres
+    BVH _bvh;
+
+    // Sphere geometry in BVH leaf order and the matching materials
+    // (built by finalizeScene, used by the ray tracer)
+    SphereSoA _soa;
+    Material* _materials;
+
+    // Acceleration structure over the triangles of every mesh, and
+    // their vertices in BVH leaf order
+    BVH _triangle_bvh;
+    TriangleSoA _triangles;
+
+    // Top level of the two-level hierarchy: over the world bounds of
+    // the instances (its _indices are instance indices)
+    BVH _instance_bvh;
+
+    // For light l and plane s, _light_sides[l * _number_shapes + s]
+    // is _normal . light position - _offset: a point p is shadowed by
+    // the plane when _normal . p - _offset has the other sign
+    float* _light_sides;
+
+    // Hierarchy over the light positions (its _indices are light
+    // indices), with the total power (sum of the largest color
+    // component) and the largest range of the lights under each node
+    // (INFINITY if one of them has no range): shading uses it to skip
+    // the lights out of range and to sample lights
+    BVH _light_bvh;
+    float* _light_node_power;
+    float* _light_node_range;
+
+    // Memory-mapped scene file the sphere and light arrays point into,
+    // if the scene was loaded from a binary file (see SceneFile.h)
+    void* _mapping;
+    size_t _mapping_size;
+
+    // 1 if _bvh, _soa, _materials, _triangle_bvh and _triangles point
+    // into _mapping too: finalizeScene keeps them until a sphere or a
+    // mesh is added
+    int _mapped_hierarchies;
+
+    // 1 once finalizeScene has been called after the last change
+    int _finalized;
 };
 
 typedef struct _Scene Scene;
 
 
+// Initialize an empty scene (no object, no light, default camera)
+void initScene(Scene* scene);
+
+// Reserve memory for at least number_spheres spheres and
+// number_lights lights
+void reserveScene(Scene* scene, int number_spheres, int number_lights);
+
+// Add a copy of sphere to the scene. Return its index.
+int addSphere(Scene* scene, const Sphere* sphere);
+
+// Add a copy of light to the scene. Return its index.
+int addLight(Scene* scene, const Light* light);
+
+// Add a copy of shape to the scene. Return its index.
+int addShape(Scene* scene, const Shape* shape);
+
+// Add a triangle mesh with the given material to the scene, computing
+// its vertex normals if needed. The scene takes over the arrays of
+// mesh and frees them in freeScene. Return its index.
+int addMesh(Scene* scene, const TriangleMesh* mesh, const Material* material);
+
+// Add a prototype: geometry shared by instances. prototype is a scene
+// holding spheres and triangle meshes only (no lights, shapes or
+// instances), in object space. The scene takes over its memory and
+// frees it in freeScene. Return its index.
+int addPrototype(Scene* scene, const Scene* prototype);
+
+// Add an instance of prototype placed in the scene by transform
+// (object to world, which must be invertible). Return its index.
+int addInstance(Scene* scene, int prototype, const Transform* transform);
+
+// Build the acceleration structure of the scene.
+// Must be called after the last object is added or modified.
+void finalizeScene(Scene* scene);
+
+// Rebuild what depends on the lights only (the light sides and the
+// light hierarchy), after lights of a finalized scene were moved or
+// changed: much cheaper than finalizeScene for a scene with many
+// objects. Lights must not be added or removed.
+void updateSceneLights(Scene* scene);
+
+// Refit the hierarchy over the spheres of a finalized scene (see
+// refitBVH) after spheres were moved or resized, none being added or
+// removed: the way animations update the scene between frames.
+void refitScene(Scene* scene);
+
+// Make frame a copy of the finalized scene for rendering one frame of
+// an animation (see Animation.h): it gets its own spheres, lights,
+// camera and the structures built over them, and shares the rest
+// (meshes, shapes, instances, materials) with scene, which must outlive it.
+// Free it with freeSceneFrame, never with freeScene.
+void copySceneFrame(Scene* frame, const Scene* scene);
+
+// Free memory used by a copy made by copySceneFrame
+void freeSceneFrame(Scene* frame);
+
 // Create a scene - modify this function for a different scene
 void createScene(Scene* scene);
 
+// Free memory used by the scene
+void freeScene(Scene* scene);
+
 #endif
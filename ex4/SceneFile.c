@@ -0,0 +1,883 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SceneFile.h"
+
+
+#define MAX_LINE_LENGTH 1024
+#define MAX_NAME_LENGTH 64
+
+
+struct _NamedMaterial {
+    char _name[MAX_NAME_LENGTH];
+    Material _material;
+};
+
+typedef struct _NamedMaterial NamedMaterial;
+
+
+// Materials defined so far in a text file
+struct _MaterialTable {
+    int _number_materials;
+    int _capacity;
+    NamedMaterial* _materials;
+};
+
+typedef struct _MaterialTable MaterialTable;
+
+
+static void addMaterial(MaterialTable* table, const char* name, const Material* material) {
+    if (table->_number_materials == table->_capacity) {
+        table->_capacity = table->_capacity > 0 ? 2 * table->_capacity : 16;
+        table->_materials = (NamedMaterial*) realloc(table->_materials,
+                                                     table->_capacity * sizeof(NamedMaterial));
+        if (!table->_materials) {
+            printf("Error: Couldn't allocate memory for the materials\n");
+            exit(1);
+        }
+    }
+
+    strncpy(table->_materials[table->_number_materials]._name, name, MAX_NAME_LENGTH - 1);
+    table->_materials[table->_number_materials]._name[MAX_NAME_LENGTH - 1] = '\0';
+    table->_materials[table->_number_materials]._material = *material;
+    table->_number_materials++;
+}
+
+
+// Return the last material defined with this name, NULL if there is none
+static const Material* findMaterial(const MaterialTable* table, const char* name) {
+    int i;
+    for (i = table->_number_materials - 1; i >= 0; i--) {
+        if (!strcmp(table->_materials[i]._name, name)) return &table->_materials[i]._material;
+    }
+    return NULL;
+}
+
+
+// Names of the prototypes defined so far in a text file, by index
+struct _PrototypeTable {
+    int _number_prototypes;
+    int _capacity;
+    char (*_names)[MAX_NAME_LENGTH];
+};
+
+typedef struct _PrototypeTable PrototypeTable;
+
+
+static void addPrototypeName(PrototypeTable* table, const char* name) {
+    if (table->_number_prototypes == table->_capacity) {
+        table->_capacity = table->_capacity > 0 ? 2 * table->_capacity : 16;
+        table->_names = (char (*)[MAX_NAME_LENGTH]) realloc(table->_names,
+                                                            table->_capacity * MAX_NAME_LENGTH);
+        if (!table->_names) {
+            printf("Error: Couldn't allocate memory for the prototypes\n");
+            exit(1);
+        }
+    }
+
+    snprintf(table->_names[table->_number_prototypes], MAX_NAME_LENGTH, "%s", name);
+    table->_number_prototypes++;
+}
+
+
+// Return the index of the last prototype defined with this name, -1 if
+// there is none
+static int findPrototype(const PrototypeTable* table, const char* name) {
+    int i;
+    for (i = table->_number_prototypes - 1; i >= 0; i--) {
+        if (!strcmp(table->_names[i], name)) return i;
+    }
+    return -1;
+}
+
+
+static void parseError(const char* filename, int line, const char* message) {
+    printf("Error: %s:%d: %s\n", filename, line, message);
+    exit(1);
+}
+
+
+// Read the OFF file path (relative to the directory of the scene file
+// scene_filename), apply scale then translation to its vertices, and add
+// it to the scene
+static void loadMesh(const char* scene_filename, const char* path, const Material* material,
+                     float scale, Vector3 translation, Scene* scene) {
+    char full_path[2 * MAX_LINE_LENGTH];
+    const char* slash = strrchr(scene_filename, '/');
+    TriangleMesh mesh;
+    int i;
+
+    if (path[0] == '/' || !slash) {
+        snprintf(full_path, sizeof(full_path), "%s", path);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%.*s/%s",
+                 (int) (slash - scene_filename), scene_filename, path);
+    }
+
+    readOFF(full_path, &mesh);
+
+    for (i = 0; i < mesh._number_vertices; i++) {
+        Vector3 v;
+        mulAV(scale, mesh._vertices[i], &v);
+        add(v, translation, &mesh._vertices[i]);
+    }
+
+    addMesh(scene, &mesh, material);
+}
+
+
+static void loadSceneText(const char* filename, FILE* f, Scene* scene) {
+    char line[MAX_LINE_LENGTH];
+    char keyword[MAX_NAME_LENGTH];
+    char name[MAX_NAME_LENGTH];
+    char path[MAX_LINE_LENGTH];
+    MaterialTable table;
+    PrototypeTable prototypes;
+    Scene prototype;
+    int line_number = 0;
+
+    // objects go to target: the scene, or the prototype being defined
+    Scene* target = scene;
+
+    table._number_materials = 0;
+    table._capacity = 0;
+    table._materials = NULL;
+
+    prototypes._number_prototypes = 0;
+    prototypes._capacity = 0;
+    prototypes._names = NULL;
+
+    initScene(scene);
+
+    while (fgets(line, MAX_LINE_LENGTH, f)) {
+        char* comment = strchr(line, '#');
+        char* args;
+        int n;
+
+        line_number++;
+        if (comment) *comment = '\0';
+        if (sscanf(line, "%63s%n", keyword, &n) != 1) continue;
+        args = line + n;
+
+        if (target != scene && strcmp(keyword, "material") && strcmp(keyword, "sphere")
+            && strcmp(keyword, "mesh") && strcmp(keyword, "end")) {
+            parseError(filename, line_number, "a prototype only holds spheres and meshes");
+        }
+
+        if (!strcmp(keyword, "background")) {
+            Color* c = &scene->_background_color;
+            if (sscanf(args, "%f %f %f", &c->_red, &c->_green, &c->_blue) != 3) {
+                parseError(filename, line_number, "expected: background r g b");
+            }
+        } else if (!strcmp(keyword, "ambient")) {
+            Color* c = &scene->_ambient;
+            if (sscanf(args, "%f %f %f", &c->_red, &c->_green, &c->_blue) != 3) {
+                parseError(filename, line_number, "expected: ambient r g b");
+            }
+        } else if (!strcmp(keyword, "camera")) {
+            Camera* c = &scene->_camera;
+            initCamera(c);
+            if (sscanf(args, "%f %f %f %f", &c->_position._x, &c->_position._y,
+                       &c->_position._z, &c->_scale) != 4) {
+                parseError(filename, line_number, "expected: camera x y z scale");
+            }
+        } else if (!strcmp(keyword, "lookat")) {
+            Camera* c = &scene->_camera;
+            int number_args;
+            initCamera(c);
+            number_args = sscanf(args, "%f %f %f %f %f %f %f %f %f",
+                                 &c->_position._x, &c->_position._y, &c->_position._z,
+                                 &c->_look_at._x, &c->_look_at._y, &c->_look_at._z,
+                                 &c->_fov, &c->_aperture, &c->_focus_distance);
+            if ((number_args != 7 && number_args != 9) || c->_fov <= 0.0f || c->_fov >= 180.0f
+                || c->_aperture < 0.0f) {
+                parseError(filename, line_number,
+                           "expected: lookat x y z tx ty tz fov [aperture focus_distance]");
+            }
+        } else if (!strcmp(keyword, "material")) {
+            Material m;
+            int number_args;
+
+            memset(&m, 0, sizeof(m));
+            m._index_of_refraction = 1.0f;
+            number_args = sscanf(args, "%63s %f %f %f %f %f %f %f %f %f %f %f %f %f", name,
+                                 &m._color._red, &m._color._green, &m._color._blue,
+                                 &m._color_spec._red, &m._color_spec._green, &m._color_spec._blue,
+                                 &m._color_reflect._red, &m._color_reflect._green,
+                                 &m._color_reflect._blue, &m._color_refract._red,
+                                 &m._color_refract._green, &m._color_refract._blue,
+                                 &m._index_of_refraction);
+            if ((number_args != 7 && number_args != 14) || m._index_of_refraction <= 0.0f) {
+                parseError(filename, line_number,
+                           "expected: material name r g b spec_r spec_g spec_b "
+                           "[reflect_r reflect_g reflect_b refract_r refract_g refract_b ior]");
+            }
+            addMaterial(&table, name, &m);
+        } else if (!strcmp(keyword, "sphere")) {
+            Sphere s;
+            const Material* m;
+            if (sscanf(args, "%f %f %f %f %63s", &s._center._x, &s._center._y, &s._center._z,
+                       &s._radius, name) != 5) {
+                parseError(filename, line_number, "expected: sphere x y z radius material");
+            }
+            m = findMaterial(&table, name);
+            if (!m) parseError(filename, line_number, "undefined material");
+            s._color = m->_color;
+            s._color_spec = m->_color_spec;
+            s._color_reflect = m->_color_reflect;
+            s._color_refract = m->_color_refract;
+            s._index_of_refraction = m->_index_of_refraction;
+            addSphere(target, &s);
+        } else if (!strcmp(keyword, "light")) {
+            Light l;
+            int number_args;
+            memset(&l, 0, sizeof(l));
+            number_args = sscanf(args, "%f %f %f %f %f %f %f",
+                                 &l._light_pos._x, &l._light_pos._y, &l._light_pos._z,
+                                 &l._light_color._red, &l._light_color._green,
+                                 &l._light_color._blue, &l._range);
+            if (number_args < 6 || l._range < 0.0f) {
+                parseError(filename, line_number, "expected: light x y z r g b [range]");
+            }
+            addLight(scene, &l);
+        } else if (!strcmp(keyword, "spherelight")) {
+            Light l;
+            int number_args;
+            memset(&l, 0, sizeof(l));
+            l._type = LIGHT_SPHERE;
+            number_args = sscanf(args, "%f %f %f %f %f %f %f %f",
+                                 &l._light_pos._x, &l._light_pos._y, &l._light_pos._z,
+                                 &l._radius, &l._light_color._red, &l._light_color._green,
+                                 &l._light_color._blue, &l._range);
+            if (number_args < 7 || l._radius <= 0.0f || l._range < 0.0f) {
+                parseError(filename, line_number,
+                           "expected: spherelight x y z radius r g b [range]");
+            }
+            addLight(scene, &l);
+        } else if (!strcmp(keyword, "quadlight")) {
+            Light l;
+            int number_args;
+            memset(&l, 0, sizeof(l));
+            l._type = LIGHT_QUAD;
+            number_args = sscanf(args, "%f %f %f %f %f %f %f %f %f %f %f %f %f",
+                                 &l._light_pos._x, &l._light_pos._y, &l._light_pos._z,
+                                 &l._edge_u._x, &l._edge_u._y, &l._edge_u._z,
+                                 &l._edge_v._x, &l._edge_v._y, &l._edge_v._z,
+                                 &l._light_color._red, &l._light_color._green,
+                                 &l._light_color._blue, &l._range);
+            if (number_args < 12 || l._range < 0.0f) {
+                parseError(filename, line_number,
+                           "expected: quadlight x y z ux uy uz vx vy vz r g b [range]");
+            }
+            addLight(scene, &l);
+        } else if (!strcmp(keyword, "plane")) {
+            Shape shape;
+            Plane* plane = &shape._geometry._plane;
+            const Material* m;
+            float norm;
+            if (sscanf(args, "%f %f %f %f %63s", &plane->_normal._x, &plane->_normal._y,
+                       &plane->_normal._z, &plane->_offset, name) != 5) {
+                parseError(filename, line_number, "expected: plane nx ny nz offset material");
+            }
+            computeNorm(plane->_normal, &norm);
+            if (norm == 0.0f) parseError(filename, line_number, "null plane normal");
+            m = findMaterial(&table, name);
+            if (!m) parseError(filename, line_number, "undefined material");
+
+            // keep the same plane with a unit normal
+            mulAV(1.0f / norm, plane->_normal, &plane->_normal);
+            plane->_offset /= norm;
+            shape._type = SHAPE_PLANE;
+            shape._material = *m;
+            addShape(scene, &shape);
+        } else if (!strcmp(keyword, "box")) {
+            Shape shape;
+            Vector3 a;
+            Vector3 b;
+            const Material* m;
+            if (sscanf(args, "%f %f %f %f %f %f %63s", &a._x, &a._y, &a._z,
+                       &b._x, &b._y, &b._z, name) != 7) {
+                parseError(filename, line_number, "expected: box x0 y0 z0 x1 y1 z1 material");
+            }
+            m = findMaterial(&table, name);
+            if (!m) parseError(filename, line_number, "undefined material");
+            shape._type = SHAPE_BOX;
+            shape._geometry._box._lower_bound._x = fminf(a._x, b._x);
+            shape._geometry._box._lower_bound._y = fminf(a._y, b._y);
+            shape._geometry._box._lower_bound._z = fminf(a._z, b._z);
+            shape._geometry._box._upper_bound._x = fmaxf(a._x, b._x);
+            shape._geometry._box._upper_bound._y = fmaxf(a._y, b._y);
+            shape._geometry._box._upper_bound._z = fmaxf(a._z, b._z);
+            shape._material = *m;
+            addShape(scene, &shape);
+        } else if (!strcmp(keyword, "mesh")) {
+            const Material* m;
+            float scale = 1.0f;
+            Vector3 t;
+            int number_args;
+
+            t._x = 0.0f;
+            t._y = 0.0f;
+            t._z = 0.0f;
+            number_args = sscanf(args, "%1023s %63s %f %f %f %f", path, name,
+                                 &scale, &t._x, &t._y, &t._z);
+            if ((number_args != 2 && number_args != 6) || scale <= 0.0f) {
+                parseError(filename, line_number, "expected: mesh file.off material [scale tx ty tz]");
+            }
+            m = findMaterial(&table, name);
+            if (!m) parseError(filename, line_number, "undefined material");
+            loadMesh(filename, path, m, scale, t, target);
+        } else if (!strcmp(keyword, "prototype")) {
+            if (target != scene) parseError(filename, line_number, "prototypes cannot be nested");
+            if (sscanf(args, "%63s", name) != 1) {
+                parseError(filename, line_number, "expected: prototype name");
+            }
+            addPrototypeName(&prototypes, name);
+            initScene(&prototype);
+            target = &prototype;
+        } else if (!strcmp(keyword, "end")) {
+            if (target == scene) parseError(filename, line_number, "end without prototype");
+            addPrototype(scene, &prototype);
+            target = scene;
+        } else if (!strcmp(keyword, "instance")) {
+            Transform transform;
+            float* m = &transform._m[0][0];
+            int p;
+            int number_args;
+
+            number_args = sscanf(args, "%63s %f %f %f %f %f %f %f %f %f %f %f %f", name,
+                                 &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+                                 &m[6], &m[7], &m[8], &m[9], &m[10], &m[11]);
+            if (number_args == 4 || number_args == 5 || number_args == 6) {
+                // translation, then scale and angle around y (degrees)
+                float t[3] = {m[0], m[1], m[2]};
+                float scale = number_args >= 5 ? m[3] : 1.0f;
+                float angle = number_args == 6 ? m[4] * (float) M_PI / 180.0f : 0.0f;
+
+                setIdentity(&transform);
+                transform._m[0][0] = scale * cosf(angle);
+                transform._m[0][2] = scale * sinf(angle);
+                transform._m[1][1] = scale;
+                transform._m[2][0] = -scale * sinf(angle);
+                transform._m[2][2] = scale * cosf(angle);
+                transform._m[0][3] = t[0];
+                transform._m[1][3] = t[1];
+                transform._m[2][3] = t[2];
+            } else if (number_args != 13) {
+                parseError(filename, line_number,
+                           "expected: instance name tx ty tz [scale [angle]] or "
+                           "instance name and 12 matrix entries");
+            }
+            p = findPrototype(&prototypes, name);
+            if (p < 0) parseError(filename, line_number, "undefined prototype");
+            addInstance(scene, p, &transform);
+        } else {
+            parseError(filename, line_number, "unknown statement");
+        }
+    }
+
+    if (target != scene) parseError(filename, line_number, "prototype without end");
+
+    free(table._materials);
+    free(prototypes._names);
+}
+
+
+// 1 if the count elements of element_size bytes at offset lie in a
+// file of size bytes and start on a multiple of SCENE_FILE_ALIGNMENT
+static int isInFile(unsigned long long offset, unsigned long long count,
+                    unsigned long long element_size, size_t size) {
+    return offset <= size && count * element_size <= size - offset
+           && offset % SCENE_FILE_ALIGNMENT == 0;
+}
+
+
+// 1 if traversal can walk the nodes safely: a depth-first tree (see
+// BVHNode) no deeper than BVH_STACK_SIZE whose leaves hold entries of
+// [0, number_entries)
+static int isValidBVH(const BVHNode* nodes, int number_nodes, int number_entries) {
+    // subtrees left to check: first node, end, depth
+    int first[BVH_STACK_SIZE + 1];
+    int end[BVH_STACK_SIZE + 1];
+    int depth[BVH_STACK_SIZE + 1];
+    int top = 0;
+
+    if (number_nodes <= 0) return number_nodes == 0 && number_entries == 0;
+
+    first[0] = 0;
+    end[0] = number_nodes;
+    depth[0] = 1;
+    top = 1;
+    while (top > 0) {
+        const BVHNode* node;
+        int i;
+        int e;
+        int d;
+
+        top--;
+        i = first[top];
+        e = end[top];
+        d = depth[top];
+        node = &nodes[i];
+
+        if (node->_count > 0) {
+            if (e != i + 1 || node->_offset < 0 || node->_offset > number_entries - node->_count) {
+                return 0;
+            }
+        } else {
+            // the left child is the next node, the right one follows
+            // the left subtree
+            if (node->_offset <= i + 1 || node->_offset >= e || d >= BVH_STACK_SIZE) return 0;
+
+            first[top] = i + 1;
+            end[top] = node->_offset;
+            depth[top++] = d + 1;
+            first[top] = node->_offset;
+            end[top] = e;
+            depth[top++] = d + 1;
+        }
+    }
+
+    return 1;
+}
+
+
+// 1 if the count indices are in [0, limit)
+static int areValidIndices(const int* indices, int count, int limit) {
+    int k;
+
+    for (k = 0; k < count; k++) {
+        if (indices[k] < 0 || indices[k] >= limit) return 0;
+    }
+
+    return 1;
+}
+
+
+static void loadSceneBinary(const char* filename, int fd, size_t size, Scene* scene) {
+    const SceneFileHeader* header;
+    unsigned long long spheres_end;
+    unsigned long long lights_end;
+    unsigned long long shapes_end;
+    unsigned long long meshes_end;
+    const SceneFileMesh* records;
+    const Triple* triangles;
+    int number_triangles = 0;
+    SphereSoA soa;
+    TriangleSoA triangle_soa;
+    char* base;
+    int i;
+    int k;
+
+    if (size < sizeof(SceneFileHeader)) {
+        printf("Error: Truncated scene file: %s\n", filename);
+        exit(1);
+    }
+
+    // private mapping: the scene may modify objects in place
+    base = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("Error: Couldn't map the scene file: %s\n", filename);
+        exit(1);
+    }
+
+    header = (const SceneFileHeader*) base;
+    if (header->_version != SCENE_FILE_VERSION
+        || header->_byte_order != SCENE_FILE_BYTE_ORDER
+        || header->_sphere_size != sizeof(Sphere)
+        || header->_light_size != sizeof(Light)
+        || header->_shape_size != sizeof(Shape)
+        || header->_mesh_size != sizeof(SceneFileMesh)
+        || header->_node_size != sizeof(BVHNode)
+        || header->_material_size != sizeof(Material)) {
+        printf("Error: The scene file was written for another version or machine: %s\n", filename);
+        exit(1);
+    }
+
+    spheres_end = header->_spheres_offset + (unsigned long long) header->_number_spheres * sizeof(Sphere);
+    lights_end = header->_lights_offset + (unsigned long long) header->_number_lights * sizeof(Light);
+    shapes_end = header->_shapes_offset + (unsigned long long) header->_number_shapes * sizeof(Shape);
+    meshes_end = header->_meshes_offset + (unsigned long long) header->_number_meshes * sizeof(SceneFileMesh);
+    if (header->_number_spheres < 0 || header->_number_lights < 0
+        || header->_number_shapes < 0 || header->_number_meshes < 0
+        || spheres_end > size || lights_end > size || shapes_end > size || meshes_end > size
+        || header->_spheres_offset % SCENE_FILE_ALIGNMENT
+        || header->_lights_offset % SCENE_FILE_ALIGNMENT
+        || header->_shapes_offset % SCENE_FILE_ALIGNMENT
+        || header->_meshes_offset % SCENE_FILE_ALIGNMENT) {
+        printf("Error: Corrupted scene file: %s\n", filename);
+        exit(1);
+    }
+
+    records = (const SceneFileMesh*) (base + header->_meshes_offset);
+    for (i = 0; i < header->_number_meshes; i++) {
+        const SceneFileMesh* r = &records[i];
+        unsigned long long nv = (unsigned long long) r->_number_vertices;
+        unsigned long long nt = (unsigned long long) r->_number_triangles;
+
+        if (r->_number_vertices < 0 || r->_number_triangles < 0
+            || r->_number_triangles > INT_MAX - number_triangles
+            || r->_vertices_offset + nv * sizeof(Vector3) > size
+            || r->_triangles_offset + nt * sizeof(Triple) > size
+            || r->_normals_offset + nv * sizeof(Vector3) > size
+            || r->_vertices_offset % SCENE_FILE_ALIGNMENT
+            || r->_triangles_offset % SCENE_FILE_ALIGNMENT
+            || r->_normals_offset % SCENE_FILE_ALIGNMENT) {
+            printf("Error: Corrupted scene file: %s\n", filename);
+            exit(1);
+        }
+
+        // the triangles index the vertices directly
+        triangles = (const Triple*) (base + r->_triangles_offset);
+        for (k = 0; k < r->_number_triangles; k++) {
+            const Triple* t = &triangles[k];
+            if (t->_v0 < 0 || t->_v0 >= r->_number_vertices
+                || t->_v1 < 0 || t->_v1 >= r->_number_vertices
+                || t->_v2 < 0 || t->_v2 >= r->_number_vertices) {
+                printf("Error: Corrupted scene file: %s\n", filename);
+                exit(1);
+            }
+        }
+        number_triangles += r->_number_triangles;
+    }
+
+    // the hierarchies are walked as they are: check every index
+    // traversal and shading follow
+    if (header->_number_triangles != number_triangles
+        || header->_number_sphere_nodes < 0 || header->_number_triangle_nodes < 0
+        || !isInFile(header->_sphere_nodes_offset, header->_number_sphere_nodes,
+                     sizeof(BVHNode), size)
+        || !isInFile(header->_sphere_indices_offset, header->_number_spheres, sizeof(int), size)
+        || !isInFile(header->_sphere_soa_offset, 1, getSphereSoASize(header->_number_spheres), size)
+        || !isInFile(header->_materials_offset, header->_number_spheres, sizeof(Material), size)
+        || !isInFile(header->_triangle_nodes_offset, header->_number_triangle_nodes,
+                     sizeof(BVHNode), size)
+        || !isInFile(header->_triangle_indices_offset, number_triangles, sizeof(int), size)
+        || !isInFile(header->_triangle_soa_offset, 1, getTriangleSoASize(number_triangles), size)) {
+        printf("Error: Corrupted scene file: %s\n", filename);
+        exit(1);
+    }
+
+    mapSphereSoA(&soa, header->_number_spheres, base + header->_sphere_soa_offset);
+    mapTriangleSoA(&triangle_soa, number_triangles, base + header->_triangle_soa_offset);
+    if (!isValidBVH((const BVHNode*) (base + header->_sphere_nodes_offset),
+                    header->_number_sphere_nodes, header->_number_spheres)
+        || !isValidBVH((const BVHNode*) (base + header->_triangle_nodes_offset),
+                       header->_number_triangle_nodes, number_triangles)
+        || !areValidIndices((const int*) (base + header->_sphere_indices_offset),
+                            header->_number_spheres, header->_number_spheres)
+        || !areValidIndices(soa._index, soa._count, header->_number_spheres)
+        || !areValidIndices((const int*) (base + header->_triangle_indices_offset),
+                            number_triangles, number_triangles)
+        || !areValidIndices(triangle_soa._mesh, triangle_soa._count, header->_number_meshes)) {
+        printf("Error: Corrupted scene file: %s\n", filename);
+        exit(1);
+    }
+    for (k = 0; k < triangle_soa._count; k++) {
+        if (triangle_soa._triangle[k] < 0
+            || triangle_soa._triangle[k] >= records[triangle_soa._mesh[k]]._number_triangles) {
+            printf("Error: Corrupted scene file: %s\n", filename);
+            exit(1);
+        }
+    }
+
+    initScene(scene);
+
+    scene->_background_color = header->_background_color;
+    scene->_ambient = header->_ambient;
+    scene->_camera = header->_camera;
+
+    // the arrays are borrowed from the mapping (capacity 0)
+    scene->_number_spheres = header->_number_spheres;
+    scene->_spheres = (Sphere*) (base + header->_spheres_offset);
+    scene->_number_lights = header->_number_lights;
+    scene->_lights = (Light*) (base + header->_lights_offset);
+    scene->_number_shapes = header->_number_shapes;
+    scene->_shapes = (Shape*) (base + header->_shapes_offset);
+
+    // the mesh arrays are borrowed too, only the mesh list is allocated
+    if (header->_number_meshes > 0) {
+        scene->_meshes = (SceneMesh*) calloc(header->_number_meshes, sizeof(SceneMesh));
+        if (!scene->_meshes) {
+            printf("Error: Couldn't allocate memory for %d meshes\n", header->_number_meshes);
+            exit(1);
+        }
+        scene->_number_meshes = header->_number_meshes;
+        scene->_capacity_meshes = header->_number_meshes;
+    }
+
+    for (i = 0; i < header->_number_meshes; i++) {
+        const SceneFileMesh* r = &records[i];
+        SceneMesh* m = &scene->_meshes[i];
+
+        m->_mesh._number_vertices = r->_number_vertices;
+        m->_mesh._number_triangles = r->_number_triangles;
+        m->_mesh._vertices = (Vector3*) (base + r->_vertices_offset);
+        m->_mesh._triangles = (Triple*) (base + r->_triangles_offset);
+        m->_mesh._vertex_normals = (Vector3*) (base + r->_normals_offset);
+        m->_material = r->_material;
+        m->_owned = 0;
+    }
+
+    // so are the hierarchies, which finalizeScene keeps
+    scene->_bvh._nodes = (BVHNode*) (base + header->_sphere_nodes_offset);
+    scene->_bvh._number_nodes = header->_number_sphere_nodes;
+    scene->_bvh._indices = (int*) (base + header->_sphere_indices_offset);
+    scene->_bvh._number_indices = header->_number_spheres;
+    scene->_soa = soa;
+    scene->_materials = (Material*) (base + header->_materials_offset);
+    scene->_triangle_bvh._nodes = (BVHNode*) (base + header->_triangle_nodes_offset);
+    scene->_triangle_bvh._number_nodes = header->_number_triangle_nodes;
+    scene->_triangle_bvh._indices = (int*) (base + header->_triangle_indices_offset);
+    scene->_triangle_bvh._number_indices = number_triangles;
+    scene->_triangles = triangle_soa;
+    scene->_mapped_hierarchies = 1;
+
+    scene->_mapping = base;
+    scene->_mapping_size = size;
+}
+
+
+void loadScene(const char* filename, Scene* scene) {
+    char magic[4];
+    struct stat st;
+    FILE* f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        printf("Error: Couldn't find the scene file: %s\n", filename);
+        exit(1);
+    }
+
+    if (fread(magic, 1, 4, f) == 4 && !memcmp(magic, SCENE_FILE_MAGIC, 4)) {
+        if (fstat(fileno(f), &st) != 0) {
+            printf("Error: Couldn't read the scene file: %s\n", filename);
+            exit(1);
+        }
+        loadSceneBinary(filename, fileno(f), (size_t) st.st_size, scene);
+    } else {
+        rewind(f);
+        loadSceneText(filename, f, scene);
+    }
+
+    // the mapping stays valid after the file is closed
+    fclose(f);
+
+    finalizeScene(scene);
+}
+
+
+// Round offset up to a multiple of SCENE_FILE_ALIGNMENT
+static unsigned long long alignOffset(unsigned long long offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+
+// Write zeros up to the next multiple of SCENE_FILE_ALIGNMENT
+static unsigned long long alignFile(FILE* f, unsigned long long offset) {
+    static const char zeros[SCENE_FILE_ALIGNMENT] = {0};
+    unsigned long long aligned = alignOffset(offset);
+
+    fwrite(zeros, 1, (size_t) (aligned - offset), f);
+    return aligned;
+}
+
+
+// Write the arrays of the store one after the other (the layout of
+// mapSphereSoA)
+static void writeSphereSoA(FILE* f, const SphereSoA* soa) {
+    fwrite(soa->_center_x, sizeof(float), soa->_padded_count, f);
+    fwrite(soa->_center_y, sizeof(float), soa->_padded_count, f);
+    fwrite(soa->_center_z, sizeof(float), soa->_padded_count, f);
+    fwrite(soa->_radius, sizeof(float), soa->_padded_count, f);
+    fwrite(soa->_radius_squared, sizeof(float), soa->_padded_count, f);
+    fwrite(soa->_index, sizeof(int), soa->_padded_count, f);
+}
+
+
+// Write the arrays of the store one after the other (the layout of
+// mapTriangleSoA)
+static void writeTriangleSoA(FILE* f, const TriangleSoA* soa) {
+    int i;
+    int a;
+
+    for (i = 0; i < 3; i++) {
+        for (a = 0; a < 3; a++) fwrite(soa->_vertices[i][a], sizeof(float), soa->_padded_count, f);
+    }
+    fwrite(soa->_mesh, sizeof(int), soa->_padded_count, f);
+    fwrite(soa->_triangle, sizeof(int), soa->_padded_count, f);
+}
+
+
+void saveSceneBinary(const char* filename, const Scene* scene) {
+    SceneFileHeader header;
+    SceneFileMesh* records = NULL;
+    unsigned long long offset;
+    FILE* f;
+    int i;
+
+    if (scene->_number_prototypes > 0) {
+        printf("Error: Binary scene files cannot hold instances\n");
+        exit(1);
+    }
+    if (!scene->_finalized) {
+        printf("Error: The scene must be finalized before it is saved\n");
+        exit(1);
+    }
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        printf("Error: Couldn't open the scene file for writing: %s\n", filename);
+        exit(1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header._magic, SCENE_FILE_MAGIC, 4);
+    header._version = SCENE_FILE_VERSION;
+    header._byte_order = SCENE_FILE_BYTE_ORDER;
+    header._sphere_size = sizeof(Sphere);
+    header._light_size = sizeof(Light);
+    header._shape_size = sizeof(Shape);
+    header._mesh_size = sizeof(SceneFileMesh);
+    header._node_size = sizeof(BVHNode);
+    header._material_size = sizeof(Material);
+    header._number_spheres = scene->_number_spheres;
+    header._number_lights = scene->_number_lights;
+    header._number_shapes = scene->_number_shapes;
+    header._number_meshes = scene->_number_meshes;
+    header._background_color = scene->_background_color;
+    header._ambient = scene->_ambient;
+    header._camera = scene->_camera;
+    header._number_sphere_nodes = scene->_bvh._number_nodes;
+    header._number_triangle_nodes = scene->_triangle_bvh._number_nodes;
+    header._number_triangles = scene->_triangle_bvh._number_indices;
+
+    // lay the arrays out first, the header and the mesh records hold
+    // their offsets
+    if (scene->_number_meshes > 0) {
+        records = (SceneFileMesh*) calloc(scene->_number_meshes, sizeof(SceneFileMesh));
+        if (!records) {
+            printf("Error: Couldn't allocate memory for %d meshes\n", scene->_number_meshes);
+            exit(1);
+        }
+    }
+
+    header._spheres_offset = alignOffset(sizeof(header));
+    header._lights_offset = alignOffset(header._spheres_offset
+                                        + (unsigned long long) scene->_number_spheres * sizeof(Sphere));
+    header._shapes_offset = alignOffset(header._lights_offset
+                                        + (unsigned long long) scene->_number_lights * sizeof(Light));
+    header._meshes_offset = alignOffset(header._shapes_offset
+                                        + (unsigned long long) scene->_number_shapes * sizeof(Shape));
+    offset = header._meshes_offset + (unsigned long long) scene->_number_meshes * sizeof(SceneFileMesh);
+
+    for (i = 0; i < scene->_number_meshes; i++) {
+        const TriangleMesh* mesh = &scene->_meshes[i]._mesh;
+        SceneFileMesh* r = &records[i];
+
+        r->_number_vertices = mesh->_number_vertices;
+        r->_number_triangles = mesh->_number_triangles;
+        r->_material = scene->_meshes[i]._material;
+        r->_vertices_offset = alignOffset(offset);
+        r->_triangles_offset = alignOffset(r->_vertices_offset
+                                           + (unsigned long long) mesh->_number_vertices * sizeof(Vector3));
+        r->_normals_offset = alignOffset(r->_triangles_offset
+                                         + (unsigned long long) mesh->_number_triangles * sizeof(Triple));
+        offset = r->_normals_offset + (unsigned long long) mesh->_number_vertices * sizeof(Vector3);
+    }
+
+    header._sphere_nodes_offset = alignOffset(offset);
+    header._sphere_indices_offset = alignOffset(header._sphere_nodes_offset
+                                                + (unsigned long long) scene->_bvh._number_nodes
+                                                * sizeof(BVHNode));
+    header._sphere_soa_offset = alignOffset(header._sphere_indices_offset
+                                            + (unsigned long long) scene->_number_spheres
+                                            * sizeof(int));
+    header._materials_offset = alignOffset(header._sphere_soa_offset
+                                           + getSphereSoASize(scene->_soa._count));
+    header._triangle_nodes_offset = alignOffset(header._materials_offset
+                                                + (unsigned long long) scene->_number_spheres
+                                                * sizeof(Material));
+    header._triangle_indices_offset = alignOffset(header._triangle_nodes_offset
+                                                  + (unsigned long long)
+                                                  scene->_triangle_bvh._number_nodes
+                                                  * sizeof(BVHNode));
+    header._triangle_soa_offset = alignOffset(header._triangle_indices_offset
+                                              + (unsigned long long) header._number_triangles
+                                              * sizeof(int));
+
+    fwrite(&header, sizeof(header), 1, f);
+    offset = alignFile(f, sizeof(header));
+
+    fwrite(scene->_spheres, sizeof(Sphere), scene->_number_spheres, f);
+    offset += (unsigned long long) scene->_number_spheres * sizeof(Sphere);
+    offset = alignFile(f, offset);
+
+    fwrite(scene->_lights, sizeof(Light), scene->_number_lights, f);
+    offset += (unsigned long long) scene->_number_lights * sizeof(Light);
+    offset = alignFile(f, offset);
+
+    fwrite(scene->_shapes, sizeof(Shape), scene->_number_shapes, f);
+    offset += (unsigned long long) scene->_number_shapes * sizeof(Shape);
+    offset = alignFile(f, offset);
+
+    fwrite(records, sizeof(SceneFileMesh), scene->_number_meshes, f);
+    offset += (unsigned long long) scene->_number_meshes * sizeof(SceneFileMesh);
+
+    for (i = 0; i < scene->_number_meshes; i++) {
+        const TriangleMesh* mesh = &scene->_meshes[i]._mesh;
+
+        offset = alignFile(f, offset);
+        fwrite(mesh->_vertices, sizeof(Vector3), mesh->_number_vertices, f);
+        offset += (unsigned long long) mesh->_number_vertices * sizeof(Vector3);
+
+        offset = alignFile(f, offset);
+        fwrite(mesh->_triangles, sizeof(Triple), mesh->_number_triangles, f);
+        offset += (unsigned long long) mesh->_number_triangles * sizeof(Triple);
+
+        offset = alignFile(f, offset);
+        fwrite(mesh->_vertex_normals, sizeof(Vector3), mesh->_number_vertices, f);
+        offset += (unsigned long long) mesh->_number_vertices * sizeof(Vector3);
+    }
+
+    offset = alignFile(f, offset);
+    fwrite(scene->_bvh._nodes, sizeof(BVHNode), scene->_bvh._number_nodes, f);
+    offset += (unsigned long long) scene->_bvh._number_nodes * sizeof(BVHNode);
+
+    offset = alignFile(f, offset);
+    fwrite(scene->_bvh._indices, sizeof(int), scene->_number_spheres, f);
+    offset += (unsigned long long) scene->_number_spheres * sizeof(int);
+
+    offset = alignFile(f, offset);
+    writeSphereSoA(f, &scene->_soa);
+    offset += getSphereSoASize(scene->_soa._count);
+
+    offset = alignFile(f, offset);
+    fwrite(scene->_materials, sizeof(Material), scene->_number_spheres, f);
+    offset += (unsigned long long) scene->_number_spheres * sizeof(Material);
+
+    offset = alignFile(f, offset);
+    fwrite(scene->_triangle_bvh._nodes, sizeof(BVHNode), scene->_triangle_bvh._number_nodes, f);
+    offset += (unsigned long long) scene->_triangle_bvh._number_nodes * sizeof(BVHNode);
+
+    offset = alignFile(f, offset);
+    fwrite(scene->_triangle_bvh._indices, sizeof(int), header._number_triangles, f);
+    offset += (unsigned long long) header._number_triangles * sizeof(int);
+
+    offset = alignFile(f, offset);
+    writeTriangleSoA(f, &scene->_triangles);
+
+    free(records);
+
+    if (fclose(f) != 0) {
+        printf("Error: Couldn't finish writing the scene file: %s\n", filename);
+        exit(1);
+    }
+}
@@ -0,0 +1,131 @@
+#include "Scene.h"
+
+
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+
+// Scene files come in two forms.
+//
+// Text form: one statement per line, '#' starts a comment.
+//   background r g b
+//   ambient r g b
+//   camera x y z scale
+//   lookat x y z tx ty tz fov [aperture focus_distance]
+//   material name r g b spec_r spec_g spec_b [reflect_r reflect_g reflect_b
+//            refract_r refract_g refract_b ior]
+//   sphere x y z radius material
+//   plane nx ny nz offset material
+//   box x0 y0 z0 x1 y1 z1 material
+//   light x y z r g b [range]
+//   spherelight x y z radius r g b [range]
+//   quadlight x y z ux uy uz vx vy vz r g b [range]
+//   mesh file.off material [scale tx ty tz]
+//   prototype name
+//     (sphere and mesh statements)
+//   end
+//   instance name tx ty tz [scale [angle]]
+//   instance name a00 a01 a02 b0 a10 a11 a12 b1 a20 a21 a22 b2
+// Materials must be defined before the objects that use them. A mesh is
+// read from an OFF file (path relative to the scene file), scaled and
+// then translated. A plane holds the points p with n . p = offset (n is
+// normalized when loading); a box is given by two opposite corners.
+// A light with a range only lights the points closer than range (see
+// Light). spherelight and quadlight make area lights: a sphere, or the
+// parallelogram centered on (x, y, z) with edges u and v.
+// camera and lookat set the camera (see Camera.h): the view down -z
+// of the first scene files, or a camera at (x, y, z) looking at
+// (tx, ty, tz) with a vertical field of view of fov degrees, and
+// optionally a thin lens of the given radius focused at focus_distance.
+// The spheres and meshes between prototype and end make a prototype,
+// drawn wherever an instance of it is placed (see Instance): scaled,
+// turned by angle degrees around y then moved by (tx, ty, tz), or
+// mapped by x -> A x + b. Binary files do not hold prototypes.
+//
+// Binary form (written by saveSceneBinary): a SceneFileHeader followed
+// by the sphere, light, shape and SceneFileMesh arrays, the vertex,
+// triangle and vertex normal arrays of each mesh, then the hierarchies
+// finalizeScene built over the spheres and the triangles (nodes,
+// indices and SoA stores, and the materials of the spheres in leaf
+// order), exactly as they are laid out in memory. The file is
+// memory-mapped and the scene points into the mapping, so loading
+// does not copy or allocate anything per object, nor build the
+// hierarchies again: only the light structures are built.
+// Binary files are only read back on machines with the same byte order
+// and structure layout (both are checked).
+
+
+#define SCENE_FILE_MAGIC "RTSB"
+#define SCENE_FILE_VERSION 8
+#define SCENE_FILE_BYTE_ORDER 0x01020304u
+
+// Arrays in a binary file start on a multiple of this many bytes
+#define SCENE_FILE_ALIGNMENT 64
+
+
+struct _SceneFileHeader {
+    char _magic[4];
+    unsigned int _version;
+    unsigned int _byte_order;
+    unsigned int _sphere_size;
+    unsigned int _light_size;
+    unsigned int _shape_size;
+    unsigned int _mesh_size;
+    unsigned int _node_size;
+    unsigned int _material_size;
+
+    int _number_spheres;
+    int _number_lights;
+    int _number_shapes;
+    int _number_meshes;
+
+    unsigned long long _spheres_offset;
+    unsigned long long _lights_offset;
+    unsigned long long _shapes_offset;
+    unsigned long long _meshes_offset;
+
+    // Hierarchies over the spheres (_number_spheres indices) and over
+    // the _number_triangles triangles of the meshes
+    int _number_sphere_nodes;
+    int _number_triangle_nodes;
+    int _number_triangles;
+
+    unsigned long long _sphere_nodes_offset;
+    unsigned long long _sphere_indices_offset;
+    unsigned long long _sphere_soa_offset;
+    unsigned long long _materials_offset;
+    unsigned long long _triangle_nodes_offset;
+    unsigned long long _triangle_indices_offset;
+    unsigned long long _triangle_soa_offset;
+
+    Color _background_color;
+    Color _ambient;
+    Camera _camera;
+};
+
+typedef struct _SceneFileHeader SceneFileHeader;
+
+
+// Mesh record of a binary file; the offsets are from the start of the
+// file
+struct _SceneFileMesh {
+    int _number_vertices;
+    int _number_triangles;
+    Material _material;
+
+    unsigned long long _vertices_offset;
+    unsigned long long _triangles_offset;
+    unsigned long long _normals_offset;
+};
+
+typedef struct _SceneFileMesh SceneFileMesh;
+
+
+// Load a scene from a text or binary file (the form is detected from
+// the content) and finalize it.
+void loadScene(const char* filename, Scene* scene);
+
+// Save a finalized scene in binary form
+void saveSceneBinary(const char* filename, const Scene* scene);
+
+#endif
@@ -0,0 +1,321 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "SphereSoA.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+// The SIMD kernels must round exactly like hitSphere
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+// Given a ray (origin, unit direction), check if it intersects a given
+// sphere (center, radius_squared) at a distance in [t_min, t_max].
+// Return 1 if there is an intersection, 0 otherwise.
+// *t contains the distance to the closest intersection point in the
+// interval, if any: the far one when the near one is before t_min
+// (the origin is inside the sphere).
+//
+// Geometric form: with oc the vector from the origin to the center,
+// tca = oc . direction is the distance to the point of the ray closest
+// to the center, and l = oc - tca * direction the vector from that
+// point to the center. |l|^2 is computed from l rather than as
+// |oc|^2 - tca^2, which cancels badly for large spheres far away.
+static int
+hitSphere(Vector3 origin, Vector3 direction, Vector3 center, float radius_squared,
+          float t_min, float t_max, float *t) {
+    float ocx = center._x - origin._x;
+    float ocy = center._y - origin._y;
+    float ocz = center._z - origin._z;
+    float tca = ocx * direction._x + ocy * direction._y + ocz * direction._z;
+
+    float lx = ocx - tca * direction._x;
+    float ly = ocy - tca * direction._y;
+    float lz = ocz - tca * direction._z;
+    float l2 = lx * lx + ly * ly + lz * lz;
+
+    float thc;
+    float t0;
+    float t1;
+
+    // the line of the ray misses the sphere
+    if (l2 > radius_squared) return 0;
+
+    thc = sqrtf(radius_squared - l2);
+    t0 = tca - thc;
+    t1 = tca + thc;
+
+    if (t0 >= t_min && t0 <= t_max) {
+        *t = t0;
+        return 1;
+    }
+    if (t1 >= t_min && t1 <= t_max) {
+        *t = t1;
+        return 1;
+    }
+    return 0;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+// Distances from the origin to SOA_WIDTH spheres starting at entry
+// first, computed lane by lane as in hitSphere with t_min = 0: the near
+// root if it is not negative, the far root otherwise.
+// Misses give a negative distance or NaN.
+__attribute__((target("avx2")))
+static __m256 hitSpheres8(const SphereSoA* soa, Vector3 o, Vector3 d, int first) {
+    __m256 dx = _mm256_set1_ps(d._x);
+    __m256 dy = _mm256_set1_ps(d._y);
+    __m256 dz = _mm256_set1_ps(d._z);
+
+    __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(soa->_center_x + first), _mm256_set1_ps(o._x));
+    __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(soa->_center_y + first), _mm256_set1_ps(o._y));
+    __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(soa->_center_z + first), _mm256_set1_ps(o._z));
+    __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)),
+                               _mm256_mul_ps(ocz, dz));
+
+    __m256 lx = _mm256_sub_ps(ocx, _mm256_mul_ps(tca, dx));
+    __m256 ly = _mm256_sub_ps(ocy, _mm256_mul_ps(tca, dy));
+    __m256 lz = _mm256_sub_ps(ocz, _mm256_mul_ps(tca, dz));
+    __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)),
+                              _mm256_mul_ps(lz, lz));
+
+    // NaN where the line misses the sphere
+    __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(_mm256_loadu_ps(soa->_radius_squared + first), l2));
+    __m256 t0 = _mm256_sub_ps(tca, thc);
+    __m256 t1 = _mm256_add_ps(tca, thc);
+
+    return _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, _mm256_setzero_ps(), _CMP_GE_OQ));
+}
+
+
+__attribute__((target("avx2")))
+static void closestHit8(const SphereSoA* soa, Vector3 origin, Vector3 direction,
+                        int first, int count, float* t_min, int* hit_k) {
+    float t[SOA_WIDTH];
+    int mask;
+
+    __m256 tv = hitSpheres8(soa, origin, direction, first);
+    __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(tv, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                    _mm256_cmp_ps(tv, _mm256_set1_ps(*t_min), _CMP_LE_OQ));
+    mask = _mm256_movemask_ps(in_range) & ((1 << count) - 1);
+    if (!mask) return;
+
+    // few lanes hit before the closest hit so far: finish in scalar
+    // code, in entry order
+    _mm256_storeu_ps(t, tv);
+    while (mask) {
+        int lane = __builtin_ctz(mask);
+        int k = first + lane;
+        int best = *hit_k >= 0 ? soa->_index[*hit_k] : -1;
+
+        if (t[lane] < *t_min || (t[lane] == *t_min && soa->_index[k] < best)) {
+            *t_min = t[lane];
+            *hit_k = k;
+        }
+        mask &= mask - 1;
+    }
+}
+
+
+__attribute__((target("avx2")))
+static int anyHit8(const SphereSoA* soa, Vector3 origin, Vector3 direction,
+                   int first, int count, float t_max) {
+    __m256 tv = hitSpheres8(soa, origin, direction, first);
+    __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(tv, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                    _mm256_cmp_ps(tv, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+    return (_mm256_movemask_ps(in_range) & ((1 << count) - 1)) != 0;
+}
+
+#endif
+
+
+void initSphereSoA(SphereSoA* soa) {
+    soa->_count = 0;
+    soa->_padded_count = 0;
+    soa->_center_x = NULL;
+    soa->_center_y = NULL;
+    soa->_center_z = NULL;
+    soa->_radius = NULL;
+    soa->_radius_squared = NULL;
+    soa->_index = NULL;
+    soa->_vectorized = 0;
+}
+
+
+// Allocate count floats (or ints) aligned on SOA_ALIGNMENT bytes
+static void* allocateAligned(int count) {
+    void* ptr = NULL;
+
+    if (posix_memalign(&ptr, SOA_ALIGNMENT, count * sizeof(float)) != 0) {
+        printf("Error: Couldn't allocate memory for %d spheres\n", count);
+        exit(1);
+    }
+
+    return ptr;
+}
+
+
+// Entries of a store of count spheres: room for a full load from the
+// last entry, rounded to whole lines
+static int computePaddedCount(int count) {
+    int per_line = SOA_ALIGNMENT / sizeof(float);
+
+    return ((count + SOA_WIDTH - 1 + per_line - 1) / per_line) * per_line;
+}
+
+
+// 1 if the SIMD kernels can be used on this CPU
+static int isVectorized(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return 0;
+#endif
+}
+
+
+void allocateSphereSoA(SphereSoA* soa, int count) {
+    int k;
+
+    freeSphereSoA(soa);
+    if (count <= 0) return;
+
+    soa->_count = count;
+    soa->_padded_count = computePaddedCount(count);
+
+    soa->_center_x = (float*) allocateAligned(soa->_padded_count);
+    soa->_center_y = (float*) allocateAligned(soa->_padded_count);
+    soa->_center_z = (float*) allocateAligned(soa->_padded_count);
+    soa->_radius = (float*) allocateAligned(soa->_padded_count);
+    soa->_radius_squared = (float*) allocateAligned(soa->_padded_count);
+    soa->_index = (int*) allocateAligned(soa->_padded_count);
+
+    // a NaN radius makes every distance NaN: padding is never hit
+    for (k = count; k < soa->_padded_count; k++) {
+        soa->_center_x[k] = 0.0f;
+        soa->_center_y[k] = 0.0f;
+        soa->_center_z[k] = 0.0f;
+        soa->_radius[k] = NAN;
+        soa->_radius_squared[k] = NAN;
+        soa->_index[k] = -1;
+    }
+
+    soa->_vectorized = isVectorized();
+}
+
+
+void setSphereSoA(SphereSoA* soa, int k, Vector3 center, float radius, int idx) {
+    soa->_center_x[k] = center._x;
+    soa->_center_y[k] = center._y;
+    soa->_center_z[k] = center._z;
+    soa->_radius[k] = radius;
+    soa->_radius_squared[k] = radius * radius;
+    soa->_index[k] = idx;
+}
+
+
+void freeSphereSoA(SphereSoA* soa) {
+    free(soa->_center_x);
+    free(soa->_center_y);
+    free(soa->_center_z);
+    free(soa->_radius);
+    free(soa->_radius_squared);
+    free(soa->_index);
+
+    initSphereSoA(soa);
+}
+
+
+size_t getSphereSoASize(int count) {
+    if (count <= 0) return 0;
+    return 6 * (size_t) computePaddedCount(count) * sizeof(float);
+}
+
+
+void mapSphereSoA(SphereSoA* soa, int count, void* data) {
+    float* arrays = (float*) data;
+
+    initSphereSoA(soa);
+    if (count <= 0) return;
+
+    soa->_count = count;
+    soa->_padded_count = computePaddedCount(count);
+    soa->_center_x = arrays;
+    soa->_center_y = arrays + soa->_padded_count;
+    soa->_center_z = arrays + 2 * soa->_padded_count;
+    soa->_radius = arrays + 3 * soa->_padded_count;
+    soa->_radius_squared = arrays + 4 * soa->_padded_count;
+    soa->_index = (int*) (arrays + 5 * soa->_padded_count);
+    soa->_vectorized = isVectorized();
+}
+
+
+// Center of entry k
+static Vector3 getCenter(const SphereSoA* soa, int k) {
+    Vector3 c;
+    c._x = soa->_center_x[k];
+    c._y = soa->_center_y[k];
+    c._z = soa->_center_z[k];
+    return c;
+}
+
+
+void closestHitSphereSoA(const SphereSoA* soa, Vector3 origin, Vector3 direction,
+                         int first, int count, float* t_min, int* hit_k) {
+    int k;
+
+#ifdef HAVE_X86_KERNELS
+    if (soa->_vectorized) {
+        closestHit8(soa, origin, direction, first, count, t_min, hit_k);
+        return;
+    }
+#endif
+
+    for (k = first; k < first + count; k++) {
+        float t = 0.0f;
+        if (hitSphere(origin, direction, getCenter(soa, k), soa->_radius_squared[k],
+                      0.0f, *t_min, &t)) {
+            int best = *hit_k >= 0 ? soa->_index[*hit_k] : -1;
+            if (t < *t_min || (t == *t_min && soa->_index[k] < best)) {
+                *t_min = t;
+                *hit_k = k;
+            }
+        }
+    }
+}
+
+
+int anyHitSphereSoA(const SphereSoA* soa, Vector3 origin, Vector3 direction,
+                    int first, int count, float t_max) {
+    int k;
+
+#ifdef HAVE_X86_KERNELS
+    if (soa->_vectorized) {
+        return anyHit8(soa, origin, direction, first, count, t_max);
+    }
+#endif
+
+    for (k = first; k < first + count; k++) {
+        float t = 0.0f;
+        if (hitSphere(origin, direction, getCenter(soa, k), soa->_radius_squared[k],
+                      0.0f, t_max, &t) && t < t_max) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
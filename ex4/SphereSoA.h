@@ -0,0 +1,72 @@
+#include <stddef.h>
+#include "Geometry.h"
+
+
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+
+// Sphere geometry stored as separate arrays (structure of arrays), so
+// that SOA_WIDTH spheres can be tested against a ray at once.
+// Entry k holds the center, radius and squared radius of the sphere
+// _index[k] of the scene. The arrays are aligned on SOA_ALIGNMENT bytes and padded
+// past _count with spheres that are never hit, so SOA_WIDTH entries
+// can always be loaded from any k < _count.
+#define SOA_WIDTH 8
+#define SOA_ALIGNMENT 64
+struct _SphereSoA {
+    int _count;
+    int _padded_count;
+    float* _center_x;
+    float* _center_y;
+    float* _center_z;
+    float* _radius;
+    float* _radius_squared;
+    int* _index;
+
+    // 1 if the SIMD kernels can be used on this CPU
+    int _vectorized;
+};
+
+typedef struct _SphereSoA SphereSoA;
+
+
+// Empty store
+void initSphereSoA(SphereSoA* soa);
+
+// Allocate the store for count spheres; the caller then fills
+// entries [0, count) with setSphereSoA
+void allocateSphereSoA(SphereSoA* soa, int count);
+
+// Set entry k to the sphere (center, radius) of index idx
+void setSphereSoA(SphereSoA* soa, int k, Vector3 center, float radius, int idx);
+
+// Free memory used by the store
+void freeSphereSoA(SphereSoA* soa);
+
+// Bytes taken by the arrays of a store of count spheres, laid out one
+// after the other in the order of the structure (see mapSphereSoA)
+size_t getSphereSoASize(int count);
+
+// Point the store at the arrays of count spheres laid out one after
+// the other at data (aligned on SOA_ALIGNMENT bytes), as written from
+// a filled store. The store borrows data: never free it with
+// freeSphereSoA.
+void mapSphereSoA(SphereSoA* soa, int count, void* data);
+
+// Test the ray (origin, unit direction) against entries
+// [first, first + count) (count <= SOA_WIDTH) and keep the closest hit
+// in *t_min and *hit_k. A ray starting inside a sphere hits it on the
+// way out.
+// On a tie the sphere with the lowest _index wins. *hit_k is -1 as
+// long as nothing was hit.
+void closestHitSphereSoA(const SphereSoA* soa, Vector3 origin, Vector3 direction,
+                         int first, int count, float* t_min, int* hit_k);
+
+// Return 1 if the ray (origin, unit direction) hits one of the entries
+// [first, first + count) (count <= SOA_WIDTH) at a distance in
+// [0, t_max), 0 otherwise.
+int anyHitSphereSoA(const SphereSoA* soa, Vector3 origin, Vector3 direction,
+                    int first, int count, float t_max);
+
+#endif
@@ -0,0 +1,319 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "TileScheduler.h"
+
+
+// Range of tile indices [_head, _tail) owned by one worker.
+// The owner takes tiles from the head, thieves take them from the tail.
+struct _TileQueue {
+    pthread_mutex_t _lock;
+    int _head;
+    int _tail;
+};
+
+typedef struct _TileQueue TileQueue;
+
+
+// Workers kept alive between calls of runTiles. Helper threads park
+// on _start until the caller posts a job (a new _generation); the
+// caller runs as worker 0 and waits on _done for the others. A pool
+// runs one job at a time: callers running at once (frame workers,
+// progressive renders) take different pools from the free list, so
+// only the first calls create threads and allocate queues.
+struct _TilePool {
+    // Current job
+    int _width;
+    int _height;
+    int _tile_size;
+    int _tiles_x;
+
+    TileFunc _func;
+    void* _data;
+
+    int _number_workers;
+    TileQueue* _queues;
+    int _capacity_queues;
+
+    // Helper threads (workers 1 to _number_threads), and helpers of the
+    // current job still running
+    int _number_threads;
+    int _running;
+    unsigned int _generation;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _start;
+    pthread_cond_t _done;
+
+    struct _TilePool* _next;
+};
+
+typedef struct _TilePool TilePool;
+
+
+struct _Worker {
+    TilePool* _pool;
+    int _id;
+};
+
+typedef struct _Worker Worker;
+
+
+// Pools not running a job
+static TilePool* g_free_pools = NULL;
+static pthread_mutex_t g_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Index of the worker running in this thread (see getTileWorker)
+static __thread int g_worker_id = 0;
+
+
+int getNumberCores(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return (int) n;
+}
+
+
+// Take the next tile from the front of the queue.
+// Return -1 if the queue is empty.
+static int popTile(TileQueue* queue) {
+    int idx = -1;
+    pthread_mutex_lock(&queue->_lock);
+    if (queue->_head < queue->_tail) {
+        idx = queue->_head;
+        queue->_head++;
+    }
+    pthread_mutex_unlock(&queue->_lock);
+    return idx;
+}
+
+
+// Take the last tile from the back of the queue.
+// Return -1 if the queue is empty.
+static int stealTile(TileQueue* queue) {
+    int idx = -1;
+    pthread_mutex_lock(&queue->_lock);
+    if (queue->_head < queue->_tail) {
+        queue->_tail--;
+        idx = queue->_tail;
+    }
+    pthread_mutex_unlock(&queue->_lock);
+    return idx;
+}
+
+
+static void computeTile(TilePool* pool, int idx, Tile* tile) {
+    int tx = idx % pool->_tiles_x;
+    int ty = idx / pool->_tiles_x;
+
+    tile->_x0 = tx * pool->_tile_size;
+    tile->_y0 = ty * pool->_tile_size;
+    tile->_x1 = tile->_x0 + pool->_tile_size;
+    tile->_y1 = tile->_y0 + pool->_tile_size;
+
+    if (tile->_x1 > pool->_width) tile->_x1 = pool->_width;
+    if (tile->_y1 > pool->_height) tile->_y1 = pool->_height;
+}
+
+
+// Run the tiles of worker id in the current job of pool
+static void runWorker(TilePool* pool, int id) {
+    Tile tile;
+    int idx;
+    int k;
+
+    g_worker_id = id;
+
+    // own tiles first
+    while ((idx = popTile(&pool->_queues[id])) >= 0) {
+        computeTile(pool, idx, &tile);
+        pool->_func(&tile, pool->_data);
+    }
+
+    // then steal from the others until every queue is empty
+    for (k = 1; k < pool->_number_workers; k++) {
+        TileQueue* victim = &pool->_queues[(id + k) % pool->_number_workers];
+        while ((idx = stealTile(victim)) >= 0) {
+            computeTile(pool, idx, &tile);
+            pool->_func(&tile, pool->_data);
+        }
+    }
+}
+
+
+// Helper thread: wait for each job and take part in it if the job has
+// enough workers
+static void* helperMain(void* arg) {
+    Worker* worker = (Worker*) arg;
+    TilePool* pool = worker->_pool;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&pool->_mutex);
+    for (;;) {
+        while (pool->_generation == generation) {
+            pthread_cond_wait(&pool->_start, &pool->_mutex);
+        }
+        generation = pool->_generation;
+        if (worker->_id >= pool->_number_workers) continue;
+
+        pthread_mutex_unlock(&pool->_mutex);
+        runWorker(pool, worker->_id);
+        pthread_mutex_lock(&pool->_mutex);
+
+        if (--pool->_running == 0) pthread_cond_signal(&pool->_done);
+    }
+
+    return NULL;
+}
+
+
+// Take a free pool, or make a new one without threads
+static TilePool* acquirePool(void) {
+    TilePool* pool;
+
+    pthread_mutex_lock(&g_pools_mutex);
+    pool = g_free_pools;
+    if (pool) g_free_pools = pool->_next;
+    pthread_mutex_unlock(&g_pools_mutex);
+    if (pool) return pool;
+
+    pool = (TilePool*) malloc(sizeof(TilePool));
+    if (!pool) {
+        printf("Error: Couldn't allocate memory for a tile pool\n");
+        exit(1);
+    }
+    pool->_queues = NULL;
+    pool->_capacity_queues = 0;
+    pool->_number_threads = 0;
+    pool->_running = 0;
+    pool->_generation = 0;
+    pthread_mutex_init(&pool->_mutex, NULL);
+    pthread_cond_init(&pool->_start, NULL);
+    pthread_cond_init(&pool->_done, NULL);
+
+    return pool;
+}
+
+
+static void releasePool(TilePool* pool) {
+    pthread_mutex_lock(&g_pools_mutex);
+    pool->_next = g_free_pools;
+    g_free_pools = pool;
+    pthread_mutex_unlock(&g_pools_mutex);
+}
+
+
+// Give the pool (not running a job) number_workers - 1 helper threads
+// and queues at least
+static void growPool(TilePool* pool, int number_workers) {
+    if (number_workers > pool->_capacity_queues) {
+        TileQueue* queues = (TileQueue*) malloc(number_workers * sizeof(TileQueue));
+        int i;
+
+        if (!queues) {
+            printf("Error: Couldn't allocate memory for %d tile queues\n", number_workers);
+            exit(1);
+        }
+        for (i = 0; i < pool->_capacity_queues; i++) {
+            pthread_mutex_destroy(&pool->_queues[i]._lock);
+        }
+        for (i = 0; i < number_workers; i++) pthread_mutex_init(&queues[i]._lock, NULL);
+        free(pool->_queues);
+        pool->_queues = queues;
+        pool->_capacity_queues = number_workers;
+    }
+
+    while (pool->_number_threads < number_workers - 1) {
+        Worker* worker = (Worker*) malloc(sizeof(Worker));
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        if (!worker) {
+            printf("Error: Couldn't allocate memory for a render thread\n");
+            exit(1);
+        }
+        worker->_pool = pool;
+        worker->_id = pool->_number_threads + 1;
+
+        // helpers live as long as the process: nobody joins them
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, helperMain, worker) != 0) {
+            printf("Error: Couldn't create render thread %d\n", worker->_id);
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+        pool->_number_threads++;
+    }
+}
+
+
+void runTiles(int width, int height, int tile_size, int number_threads,
+              TileFunc func, void* data) {
+    TilePool* pool;
+    int number_tiles;
+    int tiles_x;
+    int i;
+
+    if (width <= 0 || height <= 0) return;
+    if (tile_size <= 0) tile_size = DEFAULT_TILE_SIZE;
+    if (number_threads <= 0) number_threads = getNumberCores();
+
+    tiles_x = (width + tile_size - 1) / tile_size;
+    number_tiles = tiles_x * ((height + tile_size - 1) / tile_size);
+    if (number_threads > number_tiles) number_threads = number_tiles;
+
+    // serial path: no threads, no locks
+    if (number_threads == 1) {
+        TilePool serial;
+        Tile tile;
+
+        serial._width = width;
+        serial._height = height;
+        serial._tile_size = tile_size;
+        serial._tiles_x = tiles_x;
+        for (i = 0; i < number_tiles; i++) {
+            computeTile(&serial, i, &tile);
+            func(&tile, data);
+        }
+        return;
+    }
+
+    pool = acquirePool();
+    growPool(pool, number_threads);
+
+    // give each worker a contiguous range of tiles
+    for (i = 0; i < number_threads; i++) {
+        pool->_queues[i]._head = (int) ((long) number_tiles * i / number_threads);
+        pool->_queues[i]._tail = (int) ((long) number_tiles * (i + 1) / number_threads);
+    }
+
+    pthread_mutex_lock(&pool->_mutex);
+    pool->_width = width;
+    pool->_height = height;
+    pool->_tile_size = tile_size;
+    pool->_tiles_x = tiles_x;
+    pool->_func = func;
+    pool->_data = data;
+    pool->_number_workers = number_threads;
+    pool->_running = number_threads - 1;
+    pool->_generation++;
+    pthread_cond_broadcast(&pool->_start);
+    pthread_mutex_unlock(&pool->_mutex);
+
+    // the calling thread acts as worker 0
+    runWorker(pool, 0);
+
+    pthread_mutex_lock(&pool->_mutex);
+    while (pool->_running > 0) pthread_cond_wait(&pool->_done, &pool->_mutex);
+    pthread_mutex_unlock(&pool->_mutex);
+
+    releasePool(pool);
+}
+
+
+int getTileWorker(void) {
+    return g_worker_id;
+}
@@ -0,0 +1,44 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+
+// Rectangular block of pixels: rows [_y0, _y1), columns [_x0, _x1)
+struct _Tile {
+    int _x0;
+    int _y0;
+    int _x1;
+    int _y1;
+};
+
+typedef struct _Tile Tile;
+
+
+// Work done on one tile. Called concurrently from several threads,
+// so it must only write pixels that belong to the tile.
+typedef void (*TileFunc)(const Tile* tile, void* data);
+
+
+// Default edge length (in pixels) of a tile
+#define DEFAULT_TILE_SIZE 32
+
+
+// Return the number of hardware threads available (at least 1)
+int getNumberCores(void);
+
+// Split a width by height image into tiles of tile_size by tile_size
+// pixels and call func on each of them using number_threads threads.
+// Each thread starts on its own contiguous range of tiles and steals
+// from the other threads once its range is exhausted.
+// number_threads <= 0 uses one thread per core; 1 runs everything
+// in the calling thread. The calling thread is one of the workers;
+// the others are kept parked between calls, so repeated calls create
+// no threads and allocate nothing.
+void runTiles(int width, int height, int tile_size, int number_threads,
+              TileFunc func, void* data);
+
+// Index of the worker calling the tile function, from 0 to the number
+// of threads of runTiles - 1 (0 outside runTiles): lets the tile
+// function keep per-thread data without locks
+int getTileWorker(void);
+
+#endif
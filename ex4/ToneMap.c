@@ -0,0 +1,394 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ToneMap.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+// The SIMD kernels must round exactly like the scalar code
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+// The ACES curve is 1 from about 7.3 on; larger inputs are clamped
+// so that the polynomials do not overflow
+#define ACES_MAX_INPUT 64.0f
+
+// Bit pattern of the largest finite float
+#define MAX_FINITE_BITS 0x7f7fffffu
+
+// Largest difference between the values at both ends of a bucket of a
+// float table, leaving room for rounding in the interpolation
+#define MAX_BUCKET_STEP (TONEMAP_MAX_ERROR - 1e-6f)
+
+
+static unsigned int floatToBits(float x) {
+    unsigned int bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+
+static float bitsToFloat(unsigned int bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+
+static float encodeSRGB(float x) {
+    x = fminf(fmaxf(x, 0.f), 1.f);
+    return x <= 0.0031308f ? 12.92f * x : 1.055f * powf(x, 1.0f / 2.4f) - 0.055f;
+}
+
+
+float applyToneMapExact(int op, float x) {
+    switch (op) {
+        case TONEMAP_SRGB:
+            return encodeSRGB(x);
+
+        case TONEMAP_REINHARD:
+            x = fminf(fmaxf(x, 0.f), FLT_MAX);
+            return encodeSRGB(x / (1.0f + x));
+
+        case TONEMAP_ACES:
+            x = fminf(fmaxf(x, 0.f), ACES_MAX_INPUT);
+            return encodeSRGB((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f));
+
+        default:
+            // Gamma
+            x = x * 1.1f - 0.02f;
+            x = fminf(fmaxf(x, 0.f), 1.f);
+            x = powf(x, 0.4545f);
+
+            // Contrast
+            return x * x * (3.f - 2.f * x);
+    }
+}
+
+
+static int toByte(int op, float x) {
+    return (unsigned char) (applyToneMapExact(op, x) * 255.0f);
+}
+
+
+// Smallest non-negative float x with toByte(op, x) >= k, infinity if
+// there is none
+static float findThreshold(int op, int k) {
+    unsigned int low = 0;
+    unsigned int high = MAX_FINITE_BITS;
+
+    if (toByte(op, bitsToFloat(high)) < k) return INFINITY;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (toByte(op, bitsToFloat(mid)) >= k) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return bitsToFloat(low);
+}
+
+
+static void setTableRange(ToneMapTable* table, float low, float high, int shift) {
+    table->_low = low;
+    table->_high = high;
+    table->_low_bits = floatToBits(low);
+    table->_shift = shift;
+    table->_number_buckets = (int) ((floatToBits(high) - table->_low_bits) >> shift) + 1;
+    table->_inv_bucket_size = 1.0f / (float) (1u << shift);
+}
+
+
+static int findBucket(const ToneMapTable* table, float x) {
+    return (int) ((floatToBits(x) - table->_low_bits) >> table->_shift);
+}
+
+
+static void buildByteTable(ToneMap* tone_map) {
+    ToneMapTable* table = &tone_map->_byte_table;
+    float* thresholds = tone_map->_thresholds;
+    int* bytes;
+    int last = 0;
+    int shift;
+    int i;
+    int k;
+
+    thresholds[0] = 0.0f;
+    for (k = 1; k <= 255; k++) {
+        thresholds[k] = findThreshold(tone_map->_operator, k);
+        if (thresholds[k] < INFINITY) last = k;
+    }
+    thresholds[256] = INFINITY;
+
+    // Below the first threshold the value is 0, from the last one on
+    // it is the largest one
+    {
+        unsigned int low_bits = floatToBits(thresholds[1]);
+        float low = last > 0 && low_bits > 0 ? bitsToFloat(low_bits - 1) : 0.0f;
+        float high = last > 0 ? thresholds[last] : low;
+
+        // Use the largest buckets that hold at most one threshold each
+        for (shift = 23; shift >= 0; shift--) {
+            setTableRange(table, low, high, shift);
+            for (k = 1; k < last; k++) {
+                if (findBucket(table, thresholds[k]) == findBucket(table, thresholds[k + 1])) break;
+            }
+            if (k >= last) break;
+        }
+
+        if (shift < 0) {
+            printf("Error: Tone map operator %d jumps by more than one 8-bit step\n",
+                   tone_map->_operator);
+            exit(1);
+        }
+    }
+
+    bytes = (int*) malloc(table->_number_buckets * sizeof(int));
+    if (!bytes) {
+        printf("Error: Couldn't allocate memory for the tone map tables\n");
+        exit(1);
+    }
+
+    for (i = 0; i < table->_number_buckets; i++) {
+        float start = bitsToFloat(table->_low_bits + ((unsigned int) i << table->_shift));
+        bytes[i] = toByte(tone_map->_operator, start);
+    }
+
+    table->_entries = bytes;
+}
+
+
+static void buildFloatTable(ToneMap* tone_map) {
+    ToneMapTable* table = &tone_map->_float_table;
+    int op = tone_map->_operator;
+    float value_min = applyToneMapExact(op, 0.0f);
+    float value_max = applyToneMapExact(op, FLT_MAX);
+    unsigned int low_bits;
+    unsigned int high_bits;
+    unsigned int lo;
+    unsigned int hi;
+    float* values = NULL;
+    int shift;
+    int i;
+
+    // Clamping to [low, high] changes the value by at most
+    // MAX_BUCKET_STEP: low is the largest input whose value is within
+    // MAX_BUCKET_STEP of the smallest one, high the smallest input
+    // within MAX_BUCKET_STEP of the largest one
+    lo = 0;
+    hi = MAX_FINITE_BITS;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo + 1) / 2;
+        if (applyToneMapExact(op, bitsToFloat(mid)) - value_min <= MAX_BUCKET_STEP) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    low_bits = lo;
+
+    hi = MAX_FINITE_BITS;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (value_max - applyToneMapExact(op, bitsToFloat(mid)) <= MAX_BUCKET_STEP) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    high_bits = lo;
+
+    // Use the largest buckets whose values at both ends are at most
+    // MAX_BUCKET_STEP apart; entry i is the value at the start of
+    // bucket i, entry _number_buckets the value at the end of the last
+    for (shift = 23; shift >= 0; shift--) {
+        setTableRange(table, bitsToFloat(low_bits), bitsToFloat(high_bits), shift);
+
+        free(values);
+        values = (float*) malloc((table->_number_buckets + 1) * sizeof(float));
+        if (!values) {
+            printf("Error: Couldn't allocate memory for the tone map tables\n");
+            exit(1);
+        }
+
+        for (i = 0; i <= table->_number_buckets; i++) {
+            unsigned long long bits = table->_low_bits + ((unsigned long long) i << shift);
+            if (bits > MAX_FINITE_BITS) bits = MAX_FINITE_BITS;
+            values[i] = applyToneMapExact(op, bitsToFloat((unsigned int) bits));
+        }
+
+        for (i = 0; i < table->_number_buckets; i++) {
+            if (values[i + 1] - values[i] > MAX_BUCKET_STEP) break;
+        }
+        if (i == table->_number_buckets) break;
+    }
+
+    table->_entries = values;
+}
+
+
+void initToneMap(ToneMap* tone_map, int op) {
+    tone_map->_operator = op;
+
+    buildByteTable(tone_map);
+    buildFloatTable(tone_map);
+
+#ifdef HAVE_X86_KERNELS
+    tone_map->_vectorized = __builtin_cpu_supports("avx2") != 0;
+#else
+    tone_map->_vectorized = 0;
+#endif
+}
+
+
+void freeToneMap(ToneMap* tone_map) {
+    free(tone_map->_byte_table._entries);
+    free(tone_map->_float_table._entries);
+    tone_map->_byte_table._entries = NULL;
+    tone_map->_float_table._entries = NULL;
+}
+
+
+static unsigned char lookupByte(const ToneMap* tone_map, float x) {
+    const ToneMapTable* table = &tone_map->_byte_table;
+    const int* bytes = (const int*) table->_entries;
+    int b;
+
+    x = fminf(fmaxf(x, table->_low), table->_high);
+    b = bytes[findBucket(table, x)];
+
+    return (unsigned char) (x >= tone_map->_thresholds[b + 1] ? b + 1 : b);
+}
+
+
+static float lookupFloat(const ToneMap* tone_map, float x) {
+    const ToneMapTable* table = &tone_map->_float_table;
+    const float* values = (const float*) table->_entries;
+    unsigned int d;
+    float v0;
+    float v1;
+    float t;
+
+    x = fminf(fmaxf(x, table->_low), table->_high);
+    d = floatToBits(x) - table->_low_bits;
+    v0 = values[d >> table->_shift];
+    v1 = values[(d >> table->_shift) + 1];
+    t = (float) (int) (d & ((1u << table->_shift) - 1)) * table->_inv_bucket_size;
+
+    return v0 + t * (v1 - v0);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+// lookupByte on 8 values
+__attribute__((target("avx2")))
+static void lookupBytes8(const ToneMap* tone_map, const float* in, unsigned char* out) {
+    const ToneMapTable* table = &tone_map->_byte_table;
+
+    // max_ps returns its second operand for NaN, like fmaxf
+    __m256 x = _mm256_max_ps(_mm256_loadu_ps(in), _mm256_set1_ps(table->_low));
+    x = _mm256_min_ps(x, _mm256_set1_ps(table->_high));
+
+    __m256i d = _mm256_sub_epi32(_mm256_castps_si256(x), _mm256_set1_epi32((int) table->_low_bits));
+    __m256i bucket = _mm256_srl_epi32(d, _mm_cvtsi32_si128(table->_shift));
+    __m256i b = _mm256_i32gather_epi32((const int*) table->_entries, bucket, 4);
+    __m256 next = _mm256_i32gather_ps(tone_map->_thresholds + 1, b, 4);
+
+    // the comparison mask is -1 where the next threshold is reached
+    b = _mm256_sub_epi32(b, _mm256_castps_si256(_mm256_cmp_ps(x, next, _CMP_GE_OQ)));
+
+    __m128i b16 = _mm_packus_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1));
+    _mm_storel_epi64((__m128i*) out, _mm_packus_epi16(b16, b16));
+}
+
+
+// lookupFloat on 8 values
+__attribute__((target("avx2")))
+static void lookupFloats8(const ToneMap* tone_map, const float* in, float* out) {
+    const ToneMapTable* table = &tone_map->_float_table;
+    const float* values = (const float*) table->_entries;
+
+    __m256 x = _mm256_max_ps(_mm256_loadu_ps(in), _mm256_set1_ps(table->_low));
+    x = _mm256_min_ps(x, _mm256_set1_ps(table->_high));
+
+    __m256i d = _mm256_sub_epi32(_mm256_castps_si256(x), _mm256_set1_epi32((int) table->_low_bits));
+    __m256i bucket = _mm256_srl_epi32(d, _mm_cvtsi32_si128(table->_shift));
+    __m256 v0 = _mm256_i32gather_ps(values, bucket, 4);
+    __m256 v1 = _mm256_i32gather_ps(values + 1, bucket, 4);
+
+    __m256i rest = _mm256_and_si256(d, _mm256_set1_epi32((int) ((1u << table->_shift) - 1)));
+    __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(rest), _mm256_set1_ps(table->_inv_bucket_size));
+
+    _mm256_storeu_ps(out, _mm256_add_ps(v0, _mm256_mul_ps(t, _mm256_sub_ps(v1, v0))));
+}
+
+#endif
+
+
+void toneMapValues(const ToneMap* tone_map, const float* in, int count,
+                   void* out, int format) {
+    int i = 0;
+
+    if (format == FRAMEBUFFER_RGB8) {
+        unsigned char* bytes = (unsigned char*) out;
+
+#ifdef HAVE_X86_KERNELS
+        if (tone_map->_vectorized) {
+            for (; i + 8 <= count; i += 8) lookupBytes8(tone_map, in + i, bytes + i);
+        }
+#endif
+        for (; i < count; i++) bytes[i] = lookupByte(tone_map, in[i]);
+    } else if (format == FRAMEBUFFER_RGB16F) {
+        unsigned short* halves = (unsigned short*) out;
+
+#ifdef HAVE_X86_KERNELS
+        if (tone_map->_vectorized) {
+            float values[8];
+            int l;
+            for (; i + 8 <= count; i += 8) {
+                lookupFloats8(tone_map, in + i, values);
+                for (l = 0; l < 8; l++) halves[i + l] = floatToHalf(values[l]);
+            }
+        }
+#endif
+        for (; i < count; i++) halves[i] = floatToHalf(lookupFloat(tone_map, in[i]));
+    } else {
+        float* floats = (float*) out;
+
+#ifdef HAVE_X86_KERNELS
+        if (tone_map->_vectorized) {
+            for (; i + 8 <= count; i += 8) lookupFloats8(tone_map, in + i, floats + i);
+        }
+#endif
+        for (; i < count; i++) floats[i] = lookupFloat(tone_map, in[i]);
+    }
+}
+
+
+void toneMapFrameBuffer(const ToneMap* tone_map, const FrameBuffer* in, FrameBuffer* out) {
+    int i;
+
+    for (i = 0; i < in->_height; i++) {
+        toneMapValues(tone_map,
+                      (const float*) ((const char*) in->_data + i * in->_row_size),
+                      3 * in->_width,
+                      (char*) out->_data + i * out->_row_size,
+                      out->_format);
+    }
+}
@@ -0,0 +1,92 @@
+#include "FrameBuffer.h"
+
+
+#ifndef TONE_MAP_H
+#define TONE_MAP_H
+
+
+// Operators turning the linear color of a pixel into a display value
+// in [0, 1], channel by channel:
+// - TONEMAP_DEFAULT: gain and bias, gamma 0.4545 and a smoothstep
+//   contrast curve (the look the ray tracer always had)
+// - TONEMAP_SRGB: clamp to [0, 1] and sRGB encoding
+// - TONEMAP_REINHARD: x / (1 + x), then sRGB encoding
+// - TONEMAP_ACES: filmic curve fitted to the ACES reference rendering
+//   transform (Narkowicz 2015), then sRGB encoding
+#define TONEMAP_DEFAULT 0
+#define TONEMAP_SRGB 1
+#define TONEMAP_REINHARD 2
+#define TONEMAP_ACES 3
+
+// Largest difference between a float output of the tables and the
+// exact operator
+#define TONEMAP_MAX_ERROR (1.0f / 4096.0f)
+
+
+// Lookup table over a range of positive floats, split into buckets
+// of 2^_shift consecutive bit patterns: the bucket of x is
+// (bits(x) - bits(_low)) >> _shift. Inputs are clamped to
+// [_low, _high] first.
+struct _ToneMapTable {
+    float _low;
+    float _high;
+    unsigned int _low_bits;
+    int _shift;
+    int _number_buckets;
+
+    // 1 / 2^_shift, to interpolate inside a bucket
+    float _inv_bucket_size;
+
+    // One entry per bucket (plus one at the end for float tables)
+    void* _entries;
+};
+
+typedef struct _ToneMapTable ToneMapTable;
+
+
+// The tables rely on the operators being non-decreasing:
+// - 8-bit output is exact, that is equal to (unsigned char)
+//   (255 * operator(x)). The 8-bit value of each bucket start is
+//   stored, and every bucket holds at most one of the points where
+//   the 8-bit value goes up; _thresholds[k] is the smallest input
+//   giving k or more. (Float rounding makes the Reinhard and ACES
+//   curves wobble at a few isolated inputs, where the table is one
+//   step off; TONEMAP_DEFAULT and TONEMAP_SRGB are exact for every
+//   float.)
+// - float output interpolates linearly between the values at the
+//   bucket ends, which are close enough for the error to stay below
+//   TONEMAP_MAX_ERROR.
+struct _ToneMap {
+    int _operator;
+
+    ToneMapTable _byte_table;
+    float _thresholds[257];
+
+    ToneMapTable _float_table;
+
+    // 1 if the SIMD kernels can be used on this CPU
+    int _vectorized;
+};
+
+typedef struct _ToneMap ToneMap;
+
+
+// Build the tables of the given operator
+void initToneMap(ToneMap* tone_map, int op);
+
+// Free memory used by the tables
+void freeToneMap(ToneMap* tone_map);
+
+// Apply the operator exactly (with powf) to one value
+float applyToneMapExact(int op, float x);
+
+// Map count linear values to out, stored in the given frame buffer
+// format (count bytes, half floats or floats)
+void toneMapValues(const ToneMap* tone_map, const float* in, int count,
+                   void* out, int format);
+
+// Map a linear RGB32F frame buffer to another frame buffer of the
+// same size in any format
+void toneMapFrameBuffer(const ToneMap* tone_map, const FrameBuffer* in, FrameBuffer* out);
+
+#endif
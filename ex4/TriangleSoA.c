@@ -0,0 +1,424 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "TriangleSoA.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+// The SIMD kernels must round exactly like hitTriangle
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+static float getComponent(Vector3 v, int axis) {
+    return axis == 0 ? v._x : (axis == 1 ? v._y : v._z);
+}
+
+
+void initTriangleRay(TriangleRay* ray, Vector3 origin, Vector3 direction) {
+    float dx = fabsf(direction._x);
+    float dy = fabsf(direction._y);
+    float dz = fabsf(direction._z);
+    float d_kz;
+
+    ray->_kz = dx > dy ? (dx > dz ? 0 : 2) : (dy > dz ? 1 : 2);
+    ray->_kx = (ray->_kz + 1) % 3;
+    ray->_ky = (ray->_kx + 1) % 3;
+
+    // keep the winding of the triangles
+    d_kz = getComponent(direction, ray->_kz);
+    if (d_kz < 0.0f) {
+        int k = ray->_kx;
+        ray->_kx = ray->_ky;
+        ray->_ky = k;
+    }
+
+    ray->_shear_x = getComponent(direction, ray->_kx) / d_kz;
+    ray->_shear_y = getComponent(direction, ray->_ky) / d_kz;
+    ray->_shear_z = 1.0f / d_kz;
+
+    ray->_origin[0] = getComponent(origin, ray->_kx);
+    ray->_origin[1] = getComponent(origin, ray->_ky);
+    ray->_origin[2] = getComponent(origin, ray->_kz);
+}
+
+
+// Edge functions of entry k seen from the ray, in uvw (weights of
+// vertices 0, 1 and 2 times their sum), and the distance to the plane
+// of the triangle times that sum in *t_scaled.
+// Return 0 if the ray misses the triangle.
+static int
+hitTriangle(const TriangleSoA* soa, const TriangleRay* ray, int k,
+            float uvw[3], float* t_scaled, float* det) {
+    float p[3][3];
+    float px[3];
+    float py[3];
+    float u;
+    float v;
+    float w;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        p[i][0] = soa->_vertices[i][ray->_kx][k] - ray->_origin[0];
+        p[i][1] = soa->_vertices[i][ray->_ky][k] - ray->_origin[1];
+        p[i][2] = soa->_vertices[i][ray->_kz][k] - ray->_origin[2];
+
+        px[i] = p[i][0] - ray->_shear_x * p[i][2];
+        py[i] = p[i][1] - ray->_shear_y * p[i][2];
+    }
+
+    u = px[2] * py[1] - py[2] * px[1];
+    v = px[0] * py[2] - py[0] * px[2];
+    w = px[1] * py[0] - py[1] * px[0];
+
+    // on an edge: decide with exact products
+    if (u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = (float) ((double) px[2] * py[1] - (double) py[2] * px[1]);
+        v = (float) ((double) px[0] * py[2] - (double) py[0] * px[2]);
+        w = (float) ((double) px[1] * py[0] - (double) py[1] * px[0]);
+    }
+
+    // both sides are hit
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) return 0;
+
+    *det = u + v + w;
+    if (*det == 0.0f) return 0;
+
+    uvw[0] = u;
+    uvw[1] = v;
+    uvw[2] = w;
+    *t_scaled = u * (ray->_shear_z * p[0][2])
+                + v * (ray->_shear_z * p[1][2])
+                + w * (ray->_shear_z * p[2][2]);
+
+    return 1;
+}
+
+
+// Distance from the origin to entry k along the ray, NaN or negative
+// if the ray misses it
+static float distanceTriangle(const TriangleSoA* soa, const TriangleRay* ray, int k) {
+    float uvw[3];
+    float t_scaled;
+    float det;
+
+    if (!hitTriangle(soa, ray, k, uvw, &t_scaled, &det)) return NAN;
+    return t_scaled / det;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+// Distances to SOA_WIDTH triangles starting at entry first, computed
+// lane by lane as in hitTriangle. Misses give a negative distance or
+// NaN. Lanes on an edge of their triangle are set in *exact_lanes:
+// their distance must be found again by hitTriangle.
+__attribute__((target("avx2")))
+static __m256 hitTriangles8(const TriangleSoA* soa, const TriangleRay* ray, int first,
+                            int* exact_lanes) {
+    __m256 zero = _mm256_setzero_ps();
+    __m256 shear_x = _mm256_set1_ps(ray->_shear_x);
+    __m256 shear_y = _mm256_set1_ps(ray->_shear_y);
+    __m256 shear_z = _mm256_set1_ps(ray->_shear_z);
+    __m256 px[3];
+    __m256 py[3];
+    __m256 pz[3];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        __m256 x = _mm256_sub_ps(_mm256_loadu_ps(soa->_vertices[i][ray->_kx] + first),
+                                 _mm256_set1_ps(ray->_origin[0]));
+        __m256 y = _mm256_sub_ps(_mm256_loadu_ps(soa->_vertices[i][ray->_ky] + first),
+                                 _mm256_set1_ps(ray->_origin[1]));
+        pz[i] = _mm256_sub_ps(_mm256_loadu_ps(soa->_vertices[i][ray->_kz] + first),
+                              _mm256_set1_ps(ray->_origin[2]));
+
+        px[i] = _mm256_sub_ps(x, _mm256_mul_ps(shear_x, pz[i]));
+        py[i] = _mm256_sub_ps(y, _mm256_mul_ps(shear_y, pz[i]));
+    }
+
+    __m256 u = _mm256_sub_ps(_mm256_mul_ps(px[2], py[1]), _mm256_mul_ps(py[2], px[1]));
+    __m256 v = _mm256_sub_ps(_mm256_mul_ps(px[0], py[2]), _mm256_mul_ps(py[0], px[2]));
+    __m256 w = _mm256_sub_ps(_mm256_mul_ps(px[1], py[0]), _mm256_mul_ps(py[1], px[0]));
+
+    __m256 on_edge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ),
+                                               _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                                  _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+    *exact_lanes = _mm256_movemask_ps(on_edge);
+
+    __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ),
+                                                _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                                   _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+    __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ),
+                                                _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                                   _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+
+    __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+    __m256 t_scaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, _mm256_mul_ps(shear_z, pz[0])),
+                                                  _mm256_mul_ps(v, _mm256_mul_ps(shear_z, pz[1]))),
+                                    _mm256_mul_ps(w, _mm256_mul_ps(shear_z, pz[2])));
+    __m256 t = _mm256_div_ps(t_scaled, det);
+
+    // rays crossing both sides of an edge, or parallel to the
+    // triangle, miss: make their distance NaN
+    __m256 miss = _mm256_or_ps(_mm256_and_ps(negative, positive),
+                               _mm256_cmp_ps(det, zero, _CMP_EQ_OQ));
+    return _mm256_or_ps(t, _mm256_and_ps(miss, _mm256_set1_ps(NAN)));
+}
+
+
+__attribute__((target("avx2")))
+static void closestHit8(const TriangleSoA* soa, const TriangleRay* ray,
+                        int first, int count, float* t_min, int* hit_k) {
+    float t[SOA_WIDTH];
+    int exact_lanes;
+    int valid = (1 << count) - 1;
+    int mask;
+
+    __m256 tv = hitTriangles8(soa, ray, first, &exact_lanes);
+    mask = _mm256_movemask_ps(_mm256_cmp_ps(tv, _mm256_setzero_ps(), _CMP_GE_OQ));
+    mask = (mask & ~exact_lanes & valid) | (exact_lanes & valid);
+    if (!mask) return;
+
+    _mm256_storeu_ps(t, tv);
+    while (mask) {
+        int lane = __builtin_ctz(mask);
+        int k = first + lane;
+        float tk = (exact_lanes >> lane) & 1 ? distanceTriangle(soa, ray, k) : t[lane];
+
+        if (tk >= 0.0f && (tk < *t_min || (tk == *t_min && k < *hit_k))) {
+            *t_min = tk;
+            *hit_k = k;
+        }
+        mask &= mask - 1;
+    }
+}
+
+
+__attribute__((target("avx2")))
+static int anyHit8(const TriangleSoA* soa, const TriangleRay* ray,
+                   int first, int count, float t_max) {
+    int exact_lanes;
+    int valid = (1 << count) - 1;
+    int mask;
+
+    __m256 tv = hitTriangles8(soa, ray, first, &exact_lanes);
+    __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(tv, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                    _mm256_cmp_ps(tv, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+    if (_mm256_movemask_ps(in_range) & ~exact_lanes & valid) return 1;
+
+    mask = exact_lanes & valid;
+    while (mask) {
+        float t = distanceTriangle(soa, ray, first + __builtin_ctz(mask));
+        if (t >= 0.0f && t < t_max) return 1;
+        mask &= mask - 1;
+    }
+
+    return 0;
+}
+
+#endif
+
+
+void initTriangleSoA(TriangleSoA* soa) {
+    int i;
+    int a;
+
+    soa->_count = 0;
+    soa->_padded_count = 0;
+    for (i = 0; i < 3; i++) {
+        for (a = 0; a < 3; a++) soa->_vertices[i][a] = NULL;
+    }
+    soa->_mesh = NULL;
+    soa->_triangle = NULL;
+    soa->_vectorized = 0;
+}
+
+
+// Allocate count floats (or ints) aligned on SOA_ALIGNMENT bytes
+static void* allocateAligned(int count) {
+    void* ptr = NULL;
+
+    if (posix_memalign(&ptr, SOA_ALIGNMENT, count * sizeof(float)) != 0) {
+        printf("Error: Couldn't allocate memory for %d triangles\n", count);
+        exit(1);
+    }
+
+    return ptr;
+}
+
+
+// Entries of a store of count triangles: room for a full load from
+// the last entry, rounded to whole lines
+static int computePaddedCount(int count) {
+    int per_line = SOA_ALIGNMENT / sizeof(float);
+
+    return ((count + SOA_WIDTH - 1 + per_line - 1) / per_line) * per_line;
+}
+
+
+// 1 if the SIMD kernels can be used on this CPU
+static int isVectorized(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return 0;
+#endif
+}
+
+
+void allocateTriangleSoA(TriangleSoA* soa, int count) {
+    int i;
+    int a;
+    int k;
+
+    freeTriangleSoA(soa);
+    if (count <= 0) return;
+
+    soa->_count = count;
+    soa->_padded_count = computePaddedCount(count);
+
+    for (i = 0; i < 3; i++) {
+        for (a = 0; a < 3; a++) soa->_vertices[i][a] = (float*) allocateAligned(soa->_padded_count);
+    }
+    soa->_mesh = (int*) allocateAligned(soa->_padded_count);
+    soa->_triangle = (int*) allocateAligned(soa->_padded_count);
+
+    // NaN vertices make every edge test fail: padding is never hit
+    for (k = count; k < soa->_padded_count; k++) {
+        for (i = 0; i < 3; i++) {
+            for (a = 0; a < 3; a++) soa->_vertices[i][a][k] = NAN;
+        }
+        soa->_mesh[k] = -1;
+        soa->_triangle[k] = -1;
+    }
+
+    soa->_vectorized = isVectorized();
+}
+
+
+void setTriangleSoA(TriangleSoA* soa, int k, Vector3 p0, Vector3 p1, Vector3 p2,
+                    int mesh, int tri) {
+    Vector3 p[3];
+    int i;
+
+    p[0] = p0;
+    p[1] = p1;
+    p[2] = p2;
+
+    for (i = 0; i < 3; i++) {
+        soa->_vertices[i][0][k] = p[i]._x;
+        soa->_vertices[i][1][k] = p[i]._y;
+        soa->_vertices[i][2][k] = p[i]._z;
+    }
+    soa->_mesh[k] = mesh;
+    soa->_triangle[k] = tri;
+}
+
+
+void freeTriangleSoA(TriangleSoA* soa) {
+    int i;
+    int a;
+
+    for (i = 0; i < 3; i++) {
+        for (a = 0; a < 3; a++) free(soa->_vertices[i][a]);
+    }
+    free(soa->_mesh);
+    free(soa->_triangle);
+
+    initTriangleSoA(soa);
+}
+
+
+size_t getTriangleSoASize(int count) {
+    if (count <= 0) return 0;
+    return 11 * (size_t) computePaddedCount(count) * sizeof(float);
+}
+
+
+void mapTriangleSoA(TriangleSoA* soa, int count, void* data) {
+    float* arrays = (float*) data;
+    int i;
+    int a;
+
+    initTriangleSoA(soa);
+    if (count <= 0) return;
+
+    soa->_count = count;
+    soa->_padded_count = computePaddedCount(count);
+    for (i = 0; i < 3; i++) {
+        for (a = 0; a < 3; a++) soa->_vertices[i][a] = arrays + (3 * i + a) * soa->_padded_count;
+    }
+    soa->_mesh = (int*) (arrays + 9 * soa->_padded_count);
+    soa->_triangle = (int*) (arrays + 10 * soa->_padded_count);
+    soa->_vectorized = isVectorized();
+}
+
+
+void closestHitTriangleSoA(const TriangleSoA* soa, const TriangleRay* ray,
+                           int first, int count, float* t_min, int* hit_k) {
+    int k;
+
+#ifdef HAVE_X86_KERNELS
+    if (soa->_vectorized) {
+        closestHit8(soa, ray, first, count, t_min, hit_k);
+        return;
+    }
+#endif
+
+    for (k = first; k < first + count; k++) {
+        float t = distanceTriangle(soa, ray, k);
+        if (t >= 0.0f && (t < *t_min || (t == *t_min && k < *hit_k))) {
+            *t_min = t;
+            *hit_k = k;
+        }
+    }
+}
+
+
+int anyHitTriangleSoA(const TriangleSoA* soa, const TriangleRay* ray,
+                      int first, int count, float t_max) {
+    int k;
+
+#ifdef HAVE_X86_KERNELS
+    if (soa->_vectorized) {
+        return anyHit8(soa, ray, first, count, t_max);
+    }
+#endif
+
+    for (k = first; k < first + count; k++) {
+        float t = distanceTriangle(soa, ray, k);
+        if (t >= 0.0f && t < t_max) return 1;
+    }
+
+    return 0;
+}
+
+
+void getTriangleHitWeights(const TriangleSoA* soa, const TriangleRay* ray, int k,
+                           float weights[3]) {
+    float uvw[3];
+    float t_scaled;
+    float det;
+
+    if (!hitTriangle(soa, ray, k, uvw, &t_scaled, &det)) {
+        // grazing hit lost to rounding: use the centroid
+        weights[0] = weights[1] = weights[2] = 1.0f / 3.0f;
+        return;
+    }
+
+    weights[0] = uvw[0] / det;
+    weights[1] = uvw[1] / det;
+    weights[2] = uvw[2] / det;
+}
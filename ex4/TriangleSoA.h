@@ -0,0 +1,92 @@
+#include "Geometry.h"
+#include "SphereSoA.h"
+
+
+#ifndef TRIANGLE_SOA_H
+#define TRIANGLE_SOA_H
+
+
+// Triangle vertices stored as separate arrays (structure of arrays),
+// so that SOA_WIDTH triangles can be tested against a ray at once.
+// _vertices[v][a] holds coordinate a (0: x, 1: y, 2: z) of vertex v
+// of every entry. Entry k is triangle _triangle[k] of mesh _mesh[k] of
+// the scene. As in SphereSoA, the arrays are aligned and padded past
+// _count with triangles that are never hit.
+struct _TriangleSoA {
+    int _count;
+    int _padded_count;
+    float* _vertices[3][3];
+    int* _mesh;
+    int* _triangle;
+
+    // 1 if the SIMD kernels can be used on this CPU
+    int _vectorized;
+};
+
+typedef struct _TriangleSoA TriangleSoA;
+
+
+// A ray set up for the watertight ray/triangle test (Woop, Benthin and
+// Wald, "Watertight Ray/Triangle Intersection", JCGT 2013): the
+// vertices are moved to the ray origin and sheared so that the ray
+// becomes the +z axis (_kz is the dominant axis of the direction).
+// Neighbouring triangles then share their edge tests exactly, so no
+// ray slips through a shared edge or vertex.
+struct _TriangleRay {
+    // origin coordinates along _kx, _ky and _kz
+    float _origin[3];
+    int _kx;
+    int _ky;
+    int _kz;
+    float _shear_x;
+    float _shear_y;
+    float _shear_z;
+};
+
+typedef struct _TriangleRay TriangleRay;
+
+
+// Empty store
+void initTriangleSoA(TriangleSoA* soa);
+
+// Allocate the store for count triangles; the caller then fills
+// entries [0, count) with setTriangleSoA
+void allocateTriangleSoA(TriangleSoA* soa, int count);
+
+// Set entry k to the triangle (p0, p1, p2), triangle tri of mesh mesh
+void setTriangleSoA(TriangleSoA* soa, int k, Vector3 p0, Vector3 p1, Vector3 p2,
+                    int mesh, int tri);
+
+// Free memory used by the store
+void freeTriangleSoA(TriangleSoA* soa);
+
+// Bytes taken by the arrays of a store of count triangles, laid out
+// one after the other in the order of the structure (see
+// mapTriangleSoA)
+size_t getTriangleSoASize(int count);
+
+// Point the store at the arrays of count triangles laid out one after
+// the other at data, as mapSphereSoA does for spheres. The store
+// borrows data: never free it with freeTriangleSoA.
+void mapTriangleSoA(TriangleSoA* soa, int count, void* data);
+
+// Prepare the ray (origin, direction) for the triangle tests
+void initTriangleRay(TriangleRay* ray, Vector3 origin, Vector3 direction);
+
+// Test the ray against entries [first, first + count) (count <=
+// SOA_WIDTH) and keep the closest hit at a distance in [0, *t_min) in
+// *t_min and *hit_k. On a tie the lowest entry wins.
+void closestHitTriangleSoA(const TriangleSoA* soa, const TriangleRay* ray,
+                           int first, int count, float* t_min, int* hit_k);
+
+// Return 1 if the ray hits one of entries [first, first + count) at a
+// distance in [0, t_max), 0 otherwise
+int anyHitTriangleSoA(const TriangleSoA* soa, const TriangleRay* ray,
+                      int first, int count, float t_max);
+
+// Barycentric coordinates of the point where the ray hits entry k
+// (weights of vertices 0, 1 and 2, summing to 1)
+void getTriangleHitWeights(const TriangleSoA* soa, const TriangleRay* ray, int k,
+                           float weights[3]);
+
+#endif